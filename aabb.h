@@ -32,29 +32,34 @@ class aabb {
         }
 
         bool hit(const ray& r, interval ray_t) const {
+            stat_add(stat_counter::box_tests);
             const point3& ray_orig = r.origin();
-            const vec3& ray_dir = r.direction();
+            const vec3& ray_inv_dir = r.inv_direction();
 
             for(int axis = 0; axis < 3; axis++) {
                 const interval& ax = axis_interval(axis);
-                const double adinv = 1.0 / ray_dir[axis];
-
-                auto t0 = (ax.min - ray_orig[axis]) * adinv;
-                auto t1 = (ax.max - ray_orig[axis]) * adinv;
-            
-                if (t0 < t1) {
-                    if (t0 > ray_t.min) ray_t.min = t0;
-                    if (t1 < ray_t.max) ray_t.max = t1;
-                } else {
-                    if (t1 > ray_t.min) ray_t.min = t1;
-                    if (t0 < ray_t.max) ray_t.max = t0;
-                }
-
-                if (ray_t.max <= ray_t.min) { 
-                    return false;
-                }
+
+                // The direction sign picks the entry and exit planes, so the
+                // only comparisons left are min/max selects
+                bool neg = r.dir_is_neg(axis);
+                auto t0 = ((neg ? ax.max : ax.min) - ray_orig[axis]) * ray_inv_dir[axis];
+                auto t1 = ((neg ? ax.min : ax.max) - ray_orig[axis]) * ray_inv_dir[axis];
+
+                ray_t.min = t0 > ray_t.min ? t0 : ray_t.min;
+                ray_t.max = t1 < ray_t.max ? t1 : ray_t.max;
             }
-            return true;
+            return ray_t.min < ray_t.max;
+        }
+
+        double surface_area() const {
+            // An empty box has negative extents, treat it as having no area
+            auto dx = x.size(), dy = y.size(), dz = z.size();
+            if (dx < 0 || dy < 0 || dz < 0) return 0;
+            return 2 * (dx * dy + dy * dz + dz * dx);
+        }
+
+        point3 centroid() const {
+            return point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
         }
 
         int longest_axis() const {
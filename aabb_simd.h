@@ -0,0 +1,149 @@
+#ifndef AABB_SIMD_H
+#define AABB_SIMD_H
+
+#include "ray.h"
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__AVX__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+// N boxes in structure of arrays layout, so one vector load fetches the same
+// bound of every box. Unused lanes should hold an empty box (min > max)
+template <int N> struct alignas(32) aabb_soa {
+  float min[3][N];
+  float max[3][N];
+};
+
+inline float round_down(double x) {
+  float f = float(x);
+  return (double(f) > x) ? std::nextafter(f, -INFINITY) : f;
+}
+
+inline float round_up(double x) {
+  float f = float(x);
+  return (double(f) < x) ? std::nextafter(f, INFINITY) : f;
+}
+
+// Float copy of the parts of a ray the slab test needs, built once per
+// traversal rather than once per node. The origin is rounded twice: ahead
+// along the direction for the near planes and back against it for the far
+// ones, so the entry distances can only come out early and the exits late.
+// Rounded to nearest, an origin far from the boxes would be off by more
+// than the far padding covers and could cull a grazing hit
+struct simd_ray {
+  float orig_near[3];
+  float orig_far[3];
+  float inv_dir[3];
+  int neg[3];
+
+  simd_ray() {}
+
+  simd_ray(const ray &r) {
+    for (int axis = 0; axis < 3; axis++) {
+      double o = r.origin()[axis];
+      neg[axis] = r.dir_is_neg(axis) ? 1 : 0;
+      orig_near[axis] = neg[axis] ? round_down(o) : round_up(o);
+      orig_far[axis] = neg[axis] ? round_up(o) : round_down(o);
+      inv_dir[axis] = float(r.inv_direction()[axis]);
+    }
+  }
+};
+
+// Widens the far distance by 2 * gamma(3) in float precision, covering the
+// rounding of the subtraction, the product and the reciprocal direction
+// for both the entry and the exit. With the origin rounded outwards and the
+// box bounds and [tmin, tmax] rounded outwards by their callers, a box the
+// ray really hits can't look missed
+constexpr float slab_far_scale = 1.0f + 2.0f * 3.0f * 5.96046448e-8f /
+                                            (1.0f - 3.0f * 5.96046448e-8f);
+
+// Tests one ray against N boxes at once. Returns a bit mask of the boxes hit
+// in [tmin, tmax] and writes each box's entry distance to t_entry
+template <int N>
+inline uint32_t hit_boxes(const aabb_soa<N> &boxes, const simd_ray &r,
+                          float tmin, float tmax, float *t_entry) {
+  uint32_t mask = 0;
+  for (int lane = 0; lane < N; lane++) {
+    float t0 = tmin, t1 = tmax;
+    for (int axis = 0; axis < 3; axis++) {
+      const float *near_plane = r.neg[axis] ? boxes.max[axis] : boxes.min[axis];
+      const float *far_plane = r.neg[axis] ? boxes.min[axis] : boxes.max[axis];
+      float tn = (near_plane[lane] - r.orig_near[axis]) * r.inv_dir[axis];
+      float tf = (far_plane[lane] - r.orig_far[axis]) * r.inv_dir[axis] *
+                 slab_far_scale;
+      t0 = tn > t0 ? tn : t0;
+      t1 = tf < t1 ? tf : t1;
+    }
+    t_entry[lane] = t0;
+    mask |= uint32_t(t0 <= t1) << lane;
+  }
+  return mask;
+}
+
+#if defined(__SSE4_1__)
+template <>
+inline uint32_t hit_boxes<4>(const aabb_soa<4> &boxes, const simd_ray &r,
+                             float tmin, float tmax, float *t_entry) {
+  __m128 t0 = _mm_set1_ps(tmin);
+  __m128 t1 = _mm_set1_ps(tmax);
+  const __m128 scale = _mm_set1_ps(slab_far_scale);
+
+  for (int axis = 0; axis < 3; axis++) {
+    const float *near_plane = r.neg[axis] ? boxes.max[axis] : boxes.min[axis];
+    const float *far_plane = r.neg[axis] ? boxes.min[axis] : boxes.max[axis];
+    __m128 orig_near = _mm_set1_ps(r.orig_near[axis]);
+    __m128 orig_far = _mm_set1_ps(r.orig_far[axis]);
+    __m128 inv_dir = _mm_set1_ps(r.inv_dir[axis]);
+
+    __m128 tn =
+        _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_plane), orig_near), inv_dir);
+    __m128 tf = _mm_mul_ps(
+        _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_plane), orig_far), inv_dir),
+        scale);
+
+    // With a NaN in the first operand max/min return the second, so a 0 * inf
+    // from a ray lying in a slab plane leaves the interval unchanged
+    t0 = _mm_max_ps(tn, t0);
+    t1 = _mm_min_ps(tf, t1);
+  }
+
+  _mm_storeu_ps(t_entry, t0);
+  return uint32_t(_mm_movemask_ps(_mm_cmple_ps(t0, t1)));
+}
+#endif
+
+#if defined(__AVX__)
+template <>
+inline uint32_t hit_boxes<8>(const aabb_soa<8> &boxes, const simd_ray &r,
+                             float tmin, float tmax, float *t_entry) {
+  __m256 t0 = _mm256_set1_ps(tmin);
+  __m256 t1 = _mm256_set1_ps(tmax);
+  const __m256 scale = _mm256_set1_ps(slab_far_scale);
+
+  for (int axis = 0; axis < 3; axis++) {
+    const float *near_plane = r.neg[axis] ? boxes.max[axis] : boxes.min[axis];
+    const float *far_plane = r.neg[axis] ? boxes.min[axis] : boxes.max[axis];
+    __m256 orig_near = _mm256_set1_ps(r.orig_near[axis]);
+    __m256 orig_far = _mm256_set1_ps(r.orig_far[axis]);
+    __m256 inv_dir = _mm256_set1_ps(r.inv_dir[axis]);
+
+    __m256 tn = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_load_ps(near_plane), orig_near), inv_dir);
+    __m256 tf = _mm256_mul_ps(
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_plane), orig_far),
+                      inv_dir),
+        scale);
+
+    t0 = _mm256_max_ps(tn, t0);
+    t1 = _mm256_min_ps(tf, t1);
+  }
+
+  _mm256_storeu_ps(t_entry, t0);
+  return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)));
+}
+#endif
+
+#endif
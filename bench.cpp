@@ -0,0 +1,352 @@
+#include "rtweekend.h"
+
+#include "scenes.h"
+#include "simd.h"
+
+#include <omp.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Renders the standard scenes from scenes.h at fixed seeds and a fixed,
+// small image, and reports speed and memory as JSON so runs on different
+// commits can be diffed. Each scene runs in its own child process so its
+// peak RSS isn't hidden by a bigger scene before it
+//
+//   bench [--width N] [--spp N] [--depth N] [--threads N] [--json path]
+//         [--label text] [--integrator path|wavefront] [--packets 0|4|8]
+//         [--no-light-sampling] [--sampler independent|sobol|blue]
+//         [--frames N] [scene ...]
+//
+// Animated scenes are advanced through frames 1 to N before the render,
+// refitting their BVHs each frame, then rebuilt once from scratch so the
+// two can be compared
+
+// Indexed by sampler_type
+static const std::string sampler_names[] = {"independent", "sobol", "blue"};
+
+struct bench_settings {
+  int image_width = 480;
+  int samples_per_pixel = 16;
+  int max_depth = 50;
+  int threads = 0;
+  integrator_type integrator = integrator_type::path;
+  int packet_size = 0;
+  bool sample_lights = true;
+  sampler_type sampling = sampler_type::sobol;
+  int frames = 8;
+  std::string json_path;
+  std::string label;
+  std::vector<std::string> scenes;
+};
+
+// Sent back from the child through a pipe, so plain data only
+struct bench_result {
+  uint64_t primitives = 0;
+  uint64_t instances = 0;
+  uint64_t rays = 0;
+  double setup_seconds = 0;
+  double bvh_build_seconds = 0;
+  double first_tile_seconds = 0;
+  double render_seconds = 0;
+  long peak_rss_kb = 0;
+  // Animated scenes only
+  int frames = 0;
+  int rebuilds = 0; // refits that fell back to a rebuild, over all frames
+  double refit_seconds = 0;
+  double max_cost_ratio = 0;
+  double rebuild_seconds = 0;
+  stat_counts counters; // with RT_STATS
+};
+
+static bench_result run_scene(const std::string &name,
+                              const bench_settings &settings) {
+  auto start = std::chrono::steady_clock::now();
+
+  bvh_build_options options;
+  options.split = bvh_split::sah;
+  options.width = 8;
+  scene s;
+  make_scene(name, s, options);
+  auto built = std::chrono::steady_clock::now();
+
+  bench_result result;
+  if (s.advance) {
+    for (int frame = 1; frame <= settings.frames; frame++) {
+      frame_update update = s.advance(frame);
+      result.frames++;
+      result.rebuilds += update.rebuilds;
+      result.refit_seconds += update.seconds;
+      result.max_cost_ratio =
+          std::max(result.max_cost_ratio, update.max_cost_ratio);
+    }
+  }
+
+  s.cam.image_width = settings.image_width;
+  s.cam.samples_per_pixel = settings.samples_per_pixel;
+  s.cam.max_depth = settings.max_depth;
+  s.cam.thread_count = settings.threads;
+  s.cam.integrator = settings.integrator;
+  s.cam.packet_size = settings.packet_size;
+  s.cam.sample_lights = settings.sample_lights;
+  s.cam.sampling = settings.sampling;
+  s.cam.output_path.clear();
+  s.cam.render(s.world);
+  // After the render, so what it traced was the refit BVHs
+  if (s.rebuild) {
+    result.rebuild_seconds = s.rebuild();
+  }
+
+  result.primitives = s.primitive_count;
+  result.instances = s.instance_count;
+  result.rays = s.cam.last_render_stats().rays;
+  result.setup_seconds =
+      std::chrono::duration<double>(built - start).count();
+  result.bvh_build_seconds = s.bvh_build_seconds;
+  result.first_tile_seconds = s.cam.last_render_stats().first_tile_seconds;
+  result.render_seconds = s.cam.last_render_stats().seconds;
+  result.counters = s.cam.last_render_stats().counters;
+  return result;
+}
+
+// Runs the scene in a child and waits for it. False if the child died
+static bool run_isolated(const std::string &name,
+                         const bench_settings &settings, bench_result &out) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  std::cout.flush();
+  std::clog.flush();
+
+  pid_t child = fork();
+  if (child < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (child == 0) {
+    close(fds[0]);
+    bench_result result = run_scene(name, settings);
+    bool sent = write(fds[1], &result, sizeof(result)) == sizeof(result);
+    _exit(sent ? 0 : 1);
+  }
+
+  close(fds[1]);
+  bool received = read(fds[0], &out, sizeof(out)) == sizeof(out);
+  close(fds[0]);
+
+  // wait4 gives this child's own usage, ru_maxrss is in kilobytes on Linux
+  int status = 0;
+  struct rusage usage;
+  if (wait4(child, &status, 0, &usage) != child || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0 || !received) {
+    return false;
+  }
+  out.peak_rss_kb = usage.ru_maxrss;
+  return true;
+}
+
+// Writes text as a quoted JSON string
+static void write_json_string(std::ostream &out, const std::string &text) {
+  static const char hex[] = "0123456789abcdef";
+  out << '"';
+  for (char c : text) {
+    unsigned char u = c;
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c == '\n') {
+      out << "\\n";
+    } else if (c == '\t') {
+      out << "\\t";
+    } else if (u < 0x20 || u == 0x7f) {
+      out << "\\u00" << hex[u >> 4] << hex[u & 15];
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+static void write_json(std::ostream &out, const bench_settings &settings,
+                       const std::vector<std::string> &names,
+                       const std::vector<bench_result> &results) {
+  out << "{\n";
+  if (!settings.label.empty()) {
+    out << "  \"label\": ";
+    write_json_string(out, settings.label);
+    out << ",\n";
+  }
+  out << "  \"precision\": \"" << (sizeof(real) == 4 ? "float" : "double")
+      << "\",\n";
+  out << "  \"simd_width\": " << fvec::width << ",\n";
+  out << "  \"stats\": " << (stats_enabled ? "true" : "false") << ",\n";
+  out << "  \"threads\": "
+      << (settings.threads > 0 ? settings.threads : omp_get_max_threads())
+      << ",\n";
+  out << "  \"integrator\": \""
+      << (settings.integrator == integrator_type::wavefront ? "wavefront"
+                                                             : "path")
+      << "\",\n";
+  out << "  \"packet_size\": " << settings.packet_size << ",\n";
+  out << "  \"light_sampling\": "
+      << (settings.sample_lights ? "true" : "false") << ",\n";
+  out << "  \"sampler\": \"" << sampler_names[int(settings.sampling)]
+      << "\",\n";
+  out << "  \"image_width\": " << settings.image_width << ",\n";
+  out << "  \"samples_per_pixel\": " << settings.samples_per_pixel << ",\n";
+  out << "  \"max_depth\": " << settings.max_depth << ",\n";
+  out << "  \"scenes\": [\n";
+  for (size_t i = 0; i < results.size(); i++) {
+    const bench_result &r = results[i];
+    double mrays = r.render_seconds > 0 ? r.rays / r.render_seconds / 1e6 : 0;
+    out << "    {\"name\": ";
+    write_json_string(out, names[i]);
+    out << ", \"primitives\": " << r.primitives << ", "
+        << "\"instances\": " << r.instances << ", "
+        << "\"bvh_build_ms\": " << r.bvh_build_seconds * 1000.0 << ", "
+        << "\"setup_ms\": " << r.setup_seconds * 1000.0 << ", "
+        << "\"time_to_first_pixel_ms\": "
+        << (r.setup_seconds + r.first_tile_seconds) * 1000.0 << ", "
+        << "\"render_ms\": " << r.render_seconds * 1000.0 << ", "
+        << "\"rays\": " << r.rays << ", "
+        << "\"mrays_per_s\": " << mrays << ", "
+        << "\"peak_rss_kb\": " << r.peak_rss_kb;
+    if (r.frames > 0) {
+      out << ", \"frames\": " << r.frames << ", "
+          << "\"refit_ms\": " << r.refit_seconds / r.frames * 1000.0 << ", "
+          << "\"rebuild_ms\": " << r.rebuild_seconds * 1000.0 << ", "
+          << "\"rebuilds\": " << r.rebuilds << ", "
+          << "\"max_cost_ratio\": " << r.max_cost_ratio;
+    }
+    if (stats_enabled) {
+      out << ", \"counters\": ";
+      r.counters.write_json(out);
+    }
+    out << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+  }
+  out << "  ]\n}\n";
+}
+
+static bool parse_args(int argc, char *argv[], bench_settings &settings) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--width" && has_value) {
+      settings.image_width = std::atoi(argv[++i]);
+    } else if (arg == "--spp" && has_value) {
+      settings.samples_per_pixel = std::atoi(argv[++i]);
+    } else if (arg == "--depth" && has_value) {
+      settings.max_depth = std::atoi(argv[++i]);
+    } else if (arg == "--threads" && has_value) {
+      settings.threads = std::atoi(argv[++i]);
+    } else if (arg == "--frames" && has_value) {
+      settings.frames = std::atoi(argv[++i]);
+    } else if (arg == "--json" && has_value) {
+      settings.json_path = argv[++i];
+    } else if (arg == "--label" && has_value) {
+      settings.label = argv[++i];
+    } else if (arg == "--integrator" && has_value) {
+      std::string name = argv[++i];
+      if (name != "path" && name != "wavefront") {
+        std::clog << "Unknown integrator " << name << '\n';
+        return false;
+      }
+      settings.integrator = name == "wavefront" ? integrator_type::wavefront
+                                                : integrator_type::path;
+    } else if (arg == "--packets" && has_value) {
+      settings.packet_size = std::atoi(argv[++i]);
+      if (settings.packet_size != 0 && settings.packet_size != 4 &&
+          settings.packet_size != 8) {
+        std::clog << "Packet size must be 0, 4 or 8\n";
+        return false;
+      }
+    } else if (arg == "--no-light-sampling") {
+      settings.sample_lights = false;
+    } else if (arg == "--sampler" && has_value) {
+      std::string name = argv[++i];
+      auto found = std::find(std::begin(sampler_names),
+                             std::end(sampler_names), name);
+      if (found == std::end(sampler_names)) {
+        std::clog << "Unknown sampler " << name << '\n';
+        return false;
+      }
+      settings.sampling = sampler_type(found - std::begin(sampler_names));
+    } else if (arg.rfind("--", 0) == 0) {
+      std::clog << "Unknown option " << arg << '\n';
+      return false;
+    } else {
+      settings.scenes.push_back(arg);
+    }
+  }
+
+  if (settings.scenes.empty()) {
+    settings.scenes = scene_names();
+  }
+  for (const auto &name : settings.scenes) {
+    bool known = false;
+    for (const auto &known_name : scene_names()) {
+      known = known || name == known_name;
+    }
+    if (!known) {
+      std::clog << "Unknown scene " << name << '\n';
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  bench_settings settings;
+  if (!parse_args(argc, argv, settings)) {
+    return 1;
+  }
+
+  std::vector<bench_result> results;
+  for (const auto &name : settings.scenes) {
+    std::clog << "Scene " << name << '\n' << std::flush;
+    bench_result result;
+    if (!run_isolated(name, settings, result)) {
+      std::clog << "Failed to run scene " << name << '\n';
+      return 1;
+    }
+    results.push_back(result);
+  }
+
+  std::clog << '\n';
+  for (size_t i = 0; i < results.size(); i++) {
+    const bench_result &r = results[i];
+    std::clog << settings.scenes[i] << ": "
+              << r.rays / r.render_seconds / 1e6 << " Mrays/s, BVH "
+              << r.bvh_build_seconds * 1000.0 << " ms, first pixel after "
+              << (r.setup_seconds + r.first_tile_seconds) * 1000.0
+              << " ms, peak RSS " << r.peak_rss_kb / 1024.0 << " MB\n";
+    if (r.frames > 0) {
+      std::clog << "  refit " << r.refit_seconds / r.frames * 1000.0
+                << " ms a frame over " << r.frames << " frames, "
+                << r.rebuilds << " fell back to rebuilds, rebuild "
+                << r.rebuild_seconds * 1000.0 << " ms\n";
+    }
+  }
+
+  if (settings.json_path.empty()) {
+    write_json(std::cout, settings, settings.scenes, results);
+    return 0;
+  }
+  std::ofstream out(settings.json_path);
+  write_json(out, settings, settings.scenes, results);
+  if (!out) {
+    std::clog << "Failed to write " << settings.json_path << '\n';
+    return 1;
+  }
+  return 0;
+}
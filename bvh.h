@@ -2,94 +2,423 @@
 #define BVH_H
 
 #include "aabb.h"
+#include "bvh_build.h"
+#include "bvh_wide.h"
 #include "hittable.h"
 #include "hittable_list.h"
 
-#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
 
-class bvh_node : public hittable {
-public:
-  bvh_node(hittable_list list)
-      : bvh_node(list.objects, 0, list.objects.size()) {
-    // This constructor creates an implicity copy of the hittanle list that will
-    // be modified
-    //  The lifetime of the copied list only extends until this constructor
-    //  exists ok since this only needs to persist the resulting bounding volume
-    //  hierachy
+// Slab test against a packed node
+inline bool node_hit(const bvh_linear_node &node, const ray &r,
+                     interval ray_t) {
+  const point3 &orig = r.origin();
+  const vec3 &inv_dir = r.inv_direction();
+
+  for (int axis = 0; axis < 3; axis++) {
+    bool neg = r.dir_is_neg(axis);
+    real t0 = ((neg ? node.bmax[axis] : node.bmin[axis]) - orig[axis]) *
+                inv_dir[axis];
+    real t1 = ((neg ? node.bmin[axis] : node.bmax[axis]) - orig[axis]) *
+                inv_dir[axis];
+
+    ray_t.min = t0 > ray_t.min ? t0 : ray_t.min;
+    ray_t.max = t1 < ray_t.max ? t1 : ray_t.max;
   }
+  return ray_t.min < ray_t.max;
+}
 
-  bvh_node(std::vector<shared_ptr<hittable>> &objects, size_t start,
-           size_t end) {
+namespace bvh_detail {
 
-    // Build the bounding box of the span of the source objects
-    bbox = aabb::empty;
-    for(size_t obect_index = start; obect_index < end; obect_index++) {
-        bbox = aabb(bbox, objects[obect_index]->bounding_box());
-    }
+inline const bvh_linear_node &shape(const bvh_linear_node &node) {
+  return node;
+}
+
+inline const bvh_linear_node &shape(const bvh_motion_node &node) {
+  return node.start;
+}
 
-    int axis = bbox.longest_axis();
+// Traversal shared by static and motion trees. node_hit(index, ray_t) tests
+// the ray against node index's bounds as of the ray's time. With any_hit
+// it returns at the first leaf that reports a hit
+template <bool any_hit, typename Node, typename NodeHitFn, typename LeafFn>
+bool traverse(const std::vector<Node> &nodes, NodeHitFn &&node_hit,
+              const ray &r, interval ray_t, LeafFn &&leaf) {
+  if (nodes.empty()) {
+    return false;
+  }
 
-    auto comparator = (axis == 0)   ? box_x_compare
-                      : (axis == 1) ? box_y_compare
-                                    : box_z_compare;
+  uint32_t stack[bvh_max_depth];
+  int stack_size = 0;
+  uint32_t current = 0;
+  bool hit_anything = false;
 
-    size_t object_span = end - start;
+  while (true) {
+    const bvh_linear_node &node = shape(nodes[current]);
 
-    if (object_span == 1) {
-      left = right = objects[start];
-    } else if (object_span == 2) {
-      left = objects[start];
-      right = objects[start + 1];
-    } else {
-      std::sort(std::begin(objects) + start, std::begin(objects) + end,
-                comparator);
+    stat_add(stat_counter::box_tests);
+    if (node_hit(current, ray_t)) {
+      if (node.count > 0) {
+        if (leaf(node.offset, node.count, ray_t)) {
+          if constexpr (any_hit) {
+            return true;
+          }
+          hit_anything = true;
+        }
+      } else {
+        // Descend into the child on the near side of the split first, so
+        // the far child is more likely to be culled by the shrunk interval
+        if (r.dir_is_neg(node.axis)) {
+          stack[stack_size++] = current + 1;
+          current = node.offset;
+        } else {
+          stack[stack_size++] = node.offset;
+          current = current + 1;
+        }
+        continue;
+      }
+    }
 
-      auto mid = start + object_span / 2;
-      left = make_shared<bvh_node>(objects, start, mid);
-      right = make_shared<bvh_node>(objects, mid, end);
+    if (stack_size == 0) {
+      break;
     }
-    // bbox = aabb(left->bounding_box(), right->bounding_box());
+    current = stack[--stack_size];
   }
 
-  bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
-    if (!bbox.hit(r, ray_t)) {
+  return hit_anything;
+}
+
+} // namespace bvh_detail
+
+// Slab test against a node of a motion tree, using its time 0 and time 1
+// bounds interpolated to the ray's time
+inline bool node_hit_motion(const bvh_motion_node &node, const ray &r,
+                            interval ray_t) {
+  const point3 &orig = r.origin();
+  const vec3 &inv_dir = r.inv_direction();
+  const real time = r.time();
+  const bvh_linear_node &start = node.start;
+
+  for (int axis = 0; axis < 3; axis++) {
+    real lo =
+        start.bmin[axis] + time * (node.end_min[axis] - start.bmin[axis]);
+    real hi =
+        start.bmax[axis] + time * (node.end_max[axis] - start.bmax[axis]);
+    bool neg = r.dir_is_neg(axis);
+    real t0 = ((neg ? hi : lo) - orig[axis]) * inv_dir[axis];
+    real t1 = ((neg ? lo : hi) - orig[axis]) * inv_dir[axis];
+
+    ray_t.min = t0 > ray_t.min ? t0 : ray_t.min;
+    ray_t.max = t1 < ray_t.max ? t1 : ray_t.max;
+  }
+  return ray_t.min < ray_t.max;
+}
+
+// Closest hit traversal of a binary tree. leaf(first, count, ray_t) tests a
+// primitive range, shrinks ray_t.max on a hit and returns whether it hit.
+// With any_hit the walk stops at the first hit instead, which is all a
+// shadow ray needs to know
+template <bool any_hit = false, typename LeafFn>
+bool bvh_traverse(const std::vector<bvh_linear_node> &nodes, const ray &r,
+                  interval ray_t, LeafFn &&leaf) {
+  auto hit_node = [&](uint32_t index, const interval &t) {
+    return node_hit(nodes[index], r, t);
+  };
+  return bvh_detail::traverse<any_hit>(nodes, hit_node, r, ray_t, leaf);
+}
+
+// As bvh_traverse, for a motion tree
+template <bool any_hit = false, typename LeafFn>
+bool bvh_traverse_motion(const std::vector<bvh_motion_node> &nodes,
+                         const ray &r, interval ray_t, LeafFn &&leaf) {
+  auto hit_node = [&](uint32_t index, const interval &t) {
+    return node_hit_motion(nodes[index], r, t);
+  };
+  return bvh_detail::traverse<any_hit>(nodes, hit_node, r, ray_t, leaf);
+}
+
+namespace bvh_detail {
+
+template <typename Node>
+bool valid(const std::vector<Node> &nodes, size_t primitive_count) {
+  // Depth of each node reached from the root so far, 0 if none reaches it.
+  // Children sit after their parents, so one forward pass sees every
+  // parent before its children
+  std::vector<uint8_t> depth(nodes.size(), 0);
+  if (!nodes.empty()) {
+    depth[0] = 1;
+  }
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if (depth[i] == 0) {
+      continue;
+    }
+    const bvh_linear_node &node = shape(nodes[i]);
+    if (node.count > 0) {
+      if (uint64_t(node.offset) + node.count > primitive_count) {
+        return false;
+      }
+      continue;
+    }
+    if (i + 1 >= nodes.size() || node.offset <= i ||
+        node.offset >= nodes.size() || node.axis > 2 ||
+        depth[i] >= bvh_max_depth) {
       return false;
     }
+    uint8_t child_depth = uint8_t(depth[i] + 1);
+    depth[i + 1] = std::max(depth[i + 1], child_depth);
+    depth[node.offset] = std::max(depth[node.offset], child_depth);
+  }
+  return true;
+}
+
+} // namespace bvh_detail
+
+// Whether a tree that didn't come from the builder, such as one read from a
+// cache file, is safe to traverse: every child after its parent and inside
+// the array, every leaf inside [0, primitive_count), and no deeper than the
+// traversal stack allows
+inline bool bvh_valid(const std::vector<bvh_linear_node> &nodes,
+                      size_t primitive_count) {
+  return bvh_detail::valid(nodes, primitive_count);
+}
+
+inline bool bvh_valid(const std::vector<bvh_motion_node> &nodes,
+                      size_t primitive_count) {
+  return bvh_detail::valid(nodes, primitive_count);
+}
 
-    bool hit_left = left->hit(r, ray_t, rec);
-    bool hit_right =
-        right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+class bvh_node : public hittable {
+public:
+  bvh_node(hittable_list list, const bvh_build_options &options = {})
+      : bvh_node(list.objects, options) {
+    // This constructor creates an implicity copy of the hittanle list
+    //  The lifetime of the copied list only extends until this constructor
+    //  exists ok since the tree keeps its own references to the objects
+  }
+
+  bvh_node(std::vector<shared_ptr<hittable>> &objects,
+           const bvh_build_options &options = {})
+      : options(options) {
+    build(objects);
+  }
+
+  bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+    auto leaf = [&](uint32_t first, uint32_t count, interval &t) {
+      bool hit_anything = false;
+      for (uint32_t i = first; i < first + count; i++) {
+        if (primitives[i]->hit(r, t, rec)) {
+          hit_anything = true;
+          t.max = rec.t;
+        }
+      }
+      return hit_anything;
+    };
+    return traverse<false>(r, ray_t, leaf);
+  }
 
-    return hit_left || hit_right;
+  bool occluded(const ray &r, interval ray_t) const override {
+    auto leaf = [&](uint32_t first, uint32_t count, interval &t) {
+      for (uint32_t i = first; i < first + count; i++) {
+        if (primitives[i]->occluded(r, t)) {
+          return true;
+        }
+      }
+      return false;
+    };
+    return traverse<true>(r, ray_t, leaf);
   }
 
   aabb bounding_box() const override { return bbox; }
 
+  void add_lights(light_list &lights) const override {
+    for (const hittable *object : primitives) {
+      object->add_lights(lights);
+    }
+  }
+
+  bool motion_bounds(aabb &start, aabb &end) const override {
+    start = start_box;
+    end = end_box;
+    return has_motion;
+  }
+
+  const bvh_build_stats &build_stats() const { return stats; }
+
+  // Refits the tree to the objects' current bounding boxes, for objects
+  // that have moved since the tree was built. Rebuilds instead if the refit
+  // tree has lost too much quality, see bvh_build_options::rebuild_ratio
+  bvh_refit_result refit() {
+    auto start_time = std::chrono::steady_clock::now();
+    bvh_refit_result result;
+
+    std::vector<aabb> slot_bounds;
+    slot_bounds.reserve(primitives.size());
+    for (const hittable *object : primitives) {
+      slot_bounds.push_back(object->bounding_box());
+    }
+    refit_bvh(nodes, slot_bounds);
+
+    result.cost_ratio =
+        built_cost > 0 ? bvh_sah_cost(nodes, options) / built_cost : 1;
+    if (result.cost_ratio > options.rebuild_ratio) {
+      auto objects = owned;
+      build(objects);
+      result.rebuilt = true;
+    } else {
+      bbox = aabb::empty;
+      for (const auto &box : slot_bounds) {
+        bbox = aabb(bbox, box);
+      }
+      fit_motion();
+      collapse();
+    }
+
+    auto end_time = std::chrono::steady_clock::now();
+    result.seconds =
+        std::chrono::duration<double>(end_time - start_time).count();
+    return result;
+  }
+
 private:
-  shared_ptr<hittable> left;
-  shared_ptr<hittable> right;
+  std::vector<bvh_linear_node> nodes;
+  std::vector<const hittable *> primitives;
+  std::vector<shared_ptr<hittable>> owned;
+  std::vector<bvh_wide_node<4>> wide4;
+  std::vector<bvh_wide_node<8>> wide8;
+  int width = 2;
   aabb bbox;
+  bvh_build_stats stats;
+  bvh_build_options options;
+  double built_cost = 0;
+
+  // Set when any object moves, start_box and end_box then bound them at
+  // time 0 and time 1. moving is set when one of the motion trees is
+  // traversed instead of the trees above, see fit_motion
+  bool has_motion = false;
+  bool moving = false;
+  std::vector<bvh_motion_node> motion_nodes;
+  std::vector<bvh_wide_motion_node<4>> motion_wide4;
+  std::vector<bvh_wide_motion_node<8>> motion_wide8;
+  aabb start_box, end_box;
+
+  // Whichever tree build() kept. With any_hit the walk stops at the first
+  // hit, see bvh_traverse
+  template <bool any_hit, typename LeafFn>
+  bool traverse(const ray &r, interval ray_t, LeafFn &&leaf) const {
+    if (moving) {
+      switch (width) {
+      case 4:
+        return bvh_traverse_wide_motion<4, any_hit>(motion_wide4, r, ray_t,
+                                                    leaf);
+      case 8:
+        return bvh_traverse_wide_motion<8, any_hit>(motion_wide8, r, ray_t,
+                                                    leaf);
+      default:
+        return bvh_traverse_motion<any_hit>(motion_nodes, r, ray_t, leaf);
+      }
+    }
 
-  static bool box_compare(const shared_ptr<hittable> a,
-                          const shared_ptr<hittable> b, int axis_index) {
-    auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
-    auto b_axis_interval = b->bounding_box().axis_interval(axis_index);
-    return a_axis_interval.min < b_axis_interval.min;
+    switch (width) {
+    case 4:
+      return bvh_traverse_wide<4, any_hit>(wide4, r, ray_t, leaf);
+    case 8:
+      return bvh_traverse_wide<8, any_hit>(wide8, r, ray_t, leaf);
+    default:
+      return bvh_traverse<any_hit>(nodes, r, ray_t, leaf);
+    }
   }
 
-  static bool box_x_compare(const shared_ptr<hittable> a,
-                            const shared_ptr<hittable> b) {
-    return box_compare(a, b, 0);
+  void build(const std::vector<shared_ptr<hittable>> &objects) {
+    std::vector<aabb> prim_bounds;
+    prim_bounds.reserve(objects.size());
+    for (const auto &object : objects) {
+      prim_bounds.push_back(object->bounding_box());
+    }
+
+    auto result = build_bvh(prim_bounds, options);
+    nodes = std::move(result.nodes);
+    bbox = result.bounds;
+    stats = std::move(result.stats);
+    width = options.width;
+
+    // Store the objects in leaf order so every leaf covers a contiguous range
+    owned.clear();
+    primitives.clear();
+    owned.reserve(objects.size());
+    primitives.reserve(objects.size());
+    for (uint32_t index : result.order) {
+      owned.push_back(objects[index]);
+      primitives.push_back(objects[index].get());
+    }
+
+    built_cost = bvh_sah_cost(nodes, options);
+    fit_motion();
+    collapse();
   }
 
-  static bool box_y_compare(const shared_ptr<hittable> a,
-                            const shared_ptr<hittable> b) {
-    return box_compare(a, b, 1);
+  // The tree is built around each object's box over the whole shutter,
+  // which for a fast mover is its entire swept path. If anything moves, a
+  // copy of the tree is refit to the boxes at time 0 and another to the
+  // boxes at time 1, and traversal interpolates between the two at the
+  // ray's time. A node's box then follows its objects rather than covering
+  // every place they pass through. That costs more per node, so the motion
+  // tree is only kept when the SAH says it pays
+  void fit_motion() {
+    size_t count = primitives.size();
+    std::vector<aabb> starts(count), ends(count);
+    has_motion = false;
+    for (size_t slot = 0; slot < count; slot++) {
+      if (primitives[slot]->motion_bounds(starts[slot], ends[slot])) {
+        has_motion = true;
+      } else {
+        starts[slot] = ends[slot] = primitives[slot]->bounding_box();
+      }
+    }
+
+    moving = false;
+    motion_nodes.clear();
+    motion_wide4.clear();
+    motion_wide8.clear();
+    if (!has_motion) {
+      return;
+    }
+
+    start_box = aabb::empty;
+    end_box = aabb::empty;
+    for (size_t slot = 0; slot < count; slot++) {
+      start_box = aabb(start_box, starts[slot]);
+      end_box = aabb(end_box, ends[slot]);
+    }
+
+    auto start_nodes = nodes;
+    auto end_nodes = nodes;
+    refit_bvh(start_nodes, starts);
+    refit_bvh(end_nodes, ends);
+    moving = bvh_motion_pays(nodes, start_nodes, end_nodes, options);
+    if (!moving) {
+      return;
+    }
+
+    if (width == 4) {
+      motion_wide4 = collapse_bvh_motion<4>(start_nodes, end_nodes);
+    } else if (width == 8) {
+      motion_wide8 = collapse_bvh_motion<8>(start_nodes, end_nodes);
+    } else {
+      motion_nodes = make_motion_nodes(start_nodes, end_nodes);
+    }
   }
 
-  static bool box_z_compare(const shared_ptr<hittable> a,
-                            const shared_ptr<hittable> b) {
-    return box_compare(a, b, 2);
+  void collapse() {
+    if (moving) {
+      return;
+    }
+    if (width == 4) {
+      wide4 = collapse_bvh<4>(nodes);
+    } else if (width == 8) {
+      wide8 = collapse_bvh<8>(nodes);
+    }
   }
 };
 
@@ -0,0 +1,497 @@
+#ifndef BVH_BUILD_H
+#define BVH_BUILD_H
+
+#include "aabb.h"
+#include "aabb_simd.h"
+#include "rtweekend.h"
+
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+// One node of the flattened tree, packed into 32 bytes so two fit in a cache
+// line. Nodes are stored depth first, so the first child of an interior node
+// is always the next node in the array and only the second child needs an
+// offset
+struct bvh_linear_node {
+  float bmin[3];
+  float bmax[3];
+  uint32_t offset; // leaf: first primitive, interior: index of second child
+  uint16_t count;  // number of primitives, 0 for interior nodes
+  uint8_t axis;    // split axis, used to visit the nearer child first
+  uint8_t pad;
+};
+
+static_assert(sizeof(bvh_linear_node) == 32, "bvh nodes should be 32 bytes");
+
+// One node of a motion tree, see bvh_node::fit_motion. start is the node
+// fitted to its primitives at time 0 and also carries the tree's shape, the
+// end bounds are the same node fitted at time 1. Both halves share a cache
+// line, as traversal always reads them together
+struct alignas(64) bvh_motion_node {
+  bvh_linear_node start;
+  float end_min[3];
+  float end_max[3];
+};
+
+static_assert(sizeof(bvh_motion_node) == 64,
+              "motion nodes should be one cache line");
+
+// Deep enough for any tree the builder produces, traversal stacks are sized
+// from this
+constexpr int bvh_max_depth = 96;
+
+enum class bvh_split {
+  median, // object median on the longest axis, the original builder
+  sah     // binned surface area heuristic
+};
+
+struct bvh_build_options {
+  bvh_split split = bvh_split::sah;
+  int max_leaf_size = 4;
+  int bins = 16;
+
+  // Relative cost of visiting a node vs intersecting a primitive
+  double traversal_cost = 1.0;
+  double intersection_cost = 1.0;
+
+  // Primitives a leaf tests together, e.g. the SIMD width of a packed
+  // primitive set. Leaf cost is charged per batch rather than per primitive
+  int leaf_batch_size = 1;
+
+  // Subtrees with fewer primitives than this are built on the current thread
+  size_t parallel_threshold = 4096;
+
+  // Children per node at traversal time: 2 traverses the binary tree as
+  // built, 4 or 8 collapse it into a wide tree tested with SIMD
+  int width = 2;
+
+  // A refit that leaves the SAH cost more than this many times the cost at
+  // the last build rebuilds the tree instead
+  double rebuild_ratio = 1.5;
+
+  // Cost of visiting a node of a motion tree, whose bounds are interpolated
+  // to the ray's time, relative to traversal_cost. Moving primitives only
+  // get a motion tree when it's expected to beat the plain tree over their
+  // swept boxes, see bvh_motion_pays
+  double motion_traversal_cost = 1.5;
+};
+
+struct bvh_build_stats {
+  double build_seconds = 0;
+  size_t primitive_count = 0;
+  size_t node_count = 0;
+  size_t leaf_count = 0;
+  int depth = 0;
+  double sah_cost = 0;
+  std::vector<size_t> leaf_histogram; // index is the leaf size
+
+  void print(std::ostream &out) const {
+    out << "BVH: " << primitive_count << " primitives, " << node_count
+        << " nodes, " << leaf_count << " leaves, depth " << depth
+        << ", SAH cost " << sah_cost << ", built in " << build_seconds * 1000.0
+        << " ms\n";
+    out << "BVH leaf sizes:";
+    for (size_t size = 1; size < leaf_histogram.size(); size++) {
+      if (leaf_histogram[size] > 0) {
+        out << ' ' << size << ':' << leaf_histogram[size];
+      }
+    }
+    out << '\n';
+  }
+};
+
+struct bvh_build_result {
+  std::vector<bvh_linear_node> nodes;
+  std::vector<uint32_t> order; // primitive index for each leaf slot
+  aabb bounds;
+  bvh_build_stats stats;
+};
+
+// The float bounds are rounded outwards so tests against them stay
+// conservative
+inline void pack_bounds(bvh_linear_node &node, const aabb &box) {
+  for (int axis = 0; axis < 3; axis++) {
+    node.bmin[axis] = round_down(box.axis_interval(axis).min);
+    node.bmax[axis] = round_up(box.axis_interval(axis).max);
+  }
+}
+
+class bvh_builder {
+public:
+  bvh_builder(const std::vector<aabb> &prim_bounds,
+              const bvh_build_options &options)
+      : bounds(prim_bounds), options(options) {}
+
+  bvh_build_result build() {
+    auto start_time = std::chrono::steady_clock::now();
+
+    bvh_build_result result;
+    size_t n = bounds.size();
+    result.order.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      result.order[i] = uint32_t(i);
+    }
+    if (n == 0) {
+      return result;
+    }
+
+    centroids.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      centroids[i] = bounds[i].centroid();
+    }
+
+    std::unique_ptr<build_node> root;
+    if (omp_in_parallel()) {
+      root = build_recursive(result.order, 0, n, 0);
+    } else {
+#pragma omp parallel
+#pragma omp single
+      root = build_recursive(result.order, 0, n, 0);
+    }
+
+    result.bounds = root->box;
+    result.nodes.reserve(node_total(root.get()));
+    result.stats.primitive_count = n;
+    result.stats.leaf_histogram.assign(options.max_leaf_size + 1, 0);
+    double root_area = root->box.surface_area();
+    flatten(root.get(), result, 0, root_area > 0 ? 1.0 / root_area : 0.0);
+    result.stats.node_count = result.nodes.size();
+
+    auto end_time = std::chrono::steady_clock::now();
+    result.stats.build_seconds =
+        std::chrono::duration<double>(end_time - start_time).count();
+    return result;
+  }
+
+private:
+  struct build_node {
+    aabb box;
+    std::unique_ptr<build_node> left, right;
+    size_t start = 0, count = 0; // leaf range, count is 0 for interior
+    int axis = 0;
+  };
+
+  struct bin {
+    aabb box;
+    size_t count = 0;
+  };
+
+  const std::vector<aabb> &bounds;
+  bvh_build_options options;
+  std::vector<point3> centroids;
+
+  // Past this depth only median splits are made, which guarantees the tree
+  // stays within bvh_max_depth
+  static constexpr int sah_depth_limit = bvh_max_depth - 32;
+  static constexpr int max_bins = 64;
+
+  std::unique_ptr<build_node> build_recursive(std::vector<uint32_t> &order,
+                                              size_t start, size_t end,
+                                              int depth) {
+    auto node = std::make_unique<build_node>();
+
+    aabb centroid_box = aabb::empty;
+    for (size_t i = start; i < end; i++) {
+      node->box = aabb(node->box, bounds[order[i]]);
+      centroid_box = aabb(centroid_box, aabb(centroids[order[i]],
+                                             centroids[order[i]]));
+    }
+
+    size_t span = end - start;
+    node->axis = centroid_box.longest_axis();
+
+    size_t mid;
+    if (span <= size_t(options.max_leaf_size) &&
+        (options.split == bvh_split::median || span == 1)) {
+      return make_leaf(std::move(node), start, span);
+    }
+
+    if (options.split == bvh_split::sah && depth < sah_depth_limit) {
+      int axis;
+      double split_pos;
+      double split_cost = find_sah_split(order, start, end, node->box,
+                                         centroid_box, axis, split_pos);
+      double leaf_cost = options.intersection_cost * batches(span);
+
+      if (span <= size_t(options.max_leaf_size) && split_cost >= leaf_cost) {
+        return make_leaf(std::move(node), start, span);
+      }
+
+      mid = start;
+      if (axis >= 0) {
+        node->axis = axis;
+        mid = size_t(std::partition(order.begin() + start, order.begin() + end,
+                                    [&](uint32_t prim) {
+                                      return centroids[prim][axis] < split_pos;
+                                    }) -
+                     order.begin());
+      }
+      if (mid == start || mid == end) {
+        // All centroids fell in one bin, fall back to an object median
+        mid = median_split(order, start, end, node->axis);
+      }
+    } else {
+      // Split at the median of the box minimums along the longest axis of
+      // the node bounds
+      node->axis = node->box.longest_axis();
+      mid = median_split(order, start, end, node->axis);
+    }
+
+    if (span >= options.parallel_threshold) {
+#pragma omp task shared(order, node)
+      node->left = build_recursive(order, start, mid, depth + 1);
+      node->right = build_recursive(order, mid, end, depth + 1);
+#pragma omp taskwait
+    } else {
+      node->left = build_recursive(order, start, mid, depth + 1);
+      node->right = build_recursive(order, mid, end, depth + 1);
+    }
+
+    return node;
+  }
+
+  double batches(size_t count) const {
+    size_t batch = size_t(std::max(1, options.leaf_batch_size));
+    return double((count + batch - 1) / batch);
+  }
+
+  std::unique_ptr<build_node> make_leaf(std::unique_ptr<build_node> node,
+                                        size_t start, size_t count) {
+    node->start = start;
+    node->count = count;
+    return node;
+  }
+
+  size_t median_split(std::vector<uint32_t> &order, size_t start, size_t end,
+                      int axis) {
+    size_t mid = start + (end - start) / 2;
+    std::nth_element(order.begin() + start, order.begin() + mid,
+                     order.begin() + end, [&](uint32_t a, uint32_t b) {
+                       return bounds[a].axis_interval(axis).min <
+                              bounds[b].axis_interval(axis).min;
+                     });
+    return mid;
+  }
+
+  // Returns the SAH cost of the best binned split, relative to the cost of
+  // one primitive intersection. axis is set to -1 if no split plane exists
+  double find_sah_split(const std::vector<uint32_t> &order, size_t start,
+                        size_t end, const aabb &box, const aabb &centroid_box,
+                        int &best_axis, double &best_pos) const {
+    const int bin_count = std::clamp(options.bins, 2, max_bins);
+    bin bins[max_bins];
+    double right_cost[max_bins];
+
+    double best_cost = infinity;
+    best_axis = -1;
+    best_pos = 0;
+    double inv_parent_area =
+        box.surface_area() > 0 ? 1.0 / box.surface_area() : 0.0;
+
+    for (int axis = 0; axis < 3; axis++) {
+      const interval &extent = centroid_box.axis_interval(axis);
+      if (extent.size() <= 0) {
+        continue;
+      }
+
+      std::fill(bins, bins + bin_count, bin());
+      double scale = bin_count / extent.size();
+      for (size_t i = start; i < end; i++) {
+        uint32_t prim = order[i];
+        int b = std::min(bin_count - 1,
+                         int((centroids[prim][axis] - extent.min) * scale));
+        bins[b].box = aabb(bins[b].box, bounds[prim]);
+        bins[b].count++;
+      }
+
+      // Sweep from the right to get the cost of everything past each plane
+      aabb right_box = aabb::empty;
+      size_t right_count = 0;
+      for (int b = bin_count - 1; b > 0; b--) {
+        right_box = aabb(right_box, bins[b].box);
+        right_count += bins[b].count;
+        right_cost[b] = right_box.surface_area() * batches(right_count);
+      }
+
+      aabb left_box = aabb::empty;
+      size_t left_count = 0;
+      for (int b = 0; b < bin_count - 1; b++) {
+        left_box = aabb(left_box, bins[b].box);
+        left_count += bins[b].count;
+        if (left_count == 0 || left_count == end - start) {
+          continue;
+        }
+
+        double cost = options.traversal_cost +
+                      options.intersection_cost * inv_parent_area *
+                          (left_box.surface_area() * batches(left_count) +
+                           right_cost[b + 1]);
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_pos = extent.min + (b + 1) / scale;
+        }
+      }
+    }
+
+    return best_cost;
+  }
+
+  static size_t node_total(const build_node *node) {
+    if (node->count > 0) {
+      return 1;
+    }
+    return 1 + node_total(node->left.get()) + node_total(node->right.get());
+  }
+
+  // Writes the build tree out in depth first order and accumulates the stats
+  uint32_t flatten(const build_node *node, bvh_build_result &result, int depth,
+                   double inv_root_area) {
+    uint32_t index = uint32_t(result.nodes.size());
+    result.nodes.emplace_back();
+    pack_bounds(result.nodes[index], node->box);
+    result.nodes[index].axis = uint8_t(node->axis);
+    result.nodes[index].pad = 0;
+
+    auto &stats = result.stats;
+    stats.depth = std::max(stats.depth, depth + 1);
+    double area_ratio = node->box.surface_area() * inv_root_area;
+
+    if (node->count > 0) {
+      result.nodes[index].offset = uint32_t(node->start);
+      result.nodes[index].count = uint16_t(node->count);
+      stats.leaf_count++;
+      if (node->count >= stats.leaf_histogram.size()) {
+        stats.leaf_histogram.resize(node->count + 1, 0);
+      }
+      stats.leaf_histogram[node->count]++;
+      stats.sah_cost +=
+          options.intersection_cost * batches(node->count) * area_ratio;
+      return index;
+    }
+
+    stats.sah_cost += options.traversal_cost * area_ratio;
+    flatten(node->left.get(), result, depth + 1, inv_root_area);
+    uint32_t second =
+        flatten(node->right.get(), result, depth + 1, inv_root_area);
+    result.nodes[index].offset = second;
+    result.nodes[index].count = 0;
+    return index;
+  }
+};
+
+inline bvh_build_result build_bvh(const std::vector<aabb> &prim_bounds,
+                                  const bvh_build_options &options = {}) {
+  return bvh_builder(prim_bounds, options).build();
+}
+
+inline double bvh_node_area(const bvh_linear_node &node) {
+  double dx = node.bmax[0] - node.bmin[0];
+  double dy = node.bmax[1] - node.bmin[1];
+  double dz = node.bmax[2] - node.bmin[2];
+  if (dx < 0 || dy < 0 || dz < 0) {
+    return 0.0;
+  }
+  return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+// SAH cost of a flattened tree, worked out from its packed bounds. Use it to
+// compare one tree before and after a refit, it differs slightly from the
+// builder's figure which comes from the unrounded boxes
+inline double bvh_sah_cost(const std::vector<bvh_linear_node> &nodes,
+                           const bvh_build_options &options) {
+  if (nodes.empty() || bvh_node_area(nodes[0]) <= 0) {
+    return 0;
+  }
+
+  size_t batch = size_t(std::max(1, options.leaf_batch_size));
+  double cost = 0;
+  for (const auto &node : nodes) {
+    double weight = node.count > 0
+                        ? options.intersection_cost *
+                              double((node.count + batch - 1) / batch)
+                        : options.traversal_cost;
+    cost += weight * bvh_node_area(node);
+  }
+  return cost / bvh_node_area(nodes[0]);
+}
+
+// Recomputes every node's bounds after the primitives have moved, keeping
+// the tree's shape and leaf order. slot_bounds holds the new primitive
+// bounds in leaf order. Children always sit after their parent in the
+// array, so a single backwards pass refits both children before the parent
+inline void refit_bvh(std::vector<bvh_linear_node> &nodes,
+                      const std::vector<aabb> &slot_bounds) {
+  for (size_t i = nodes.size(); i-- > 0;) {
+    auto &node = nodes[i];
+    if (node.count > 0) {
+      aabb box = aabb::empty;
+      for (uint32_t slot = node.offset; slot < node.offset + node.count;
+           slot++) {
+        box = aabb(box, slot_bounds[slot]);
+      }
+      pack_bounds(node, box);
+      continue;
+    }
+
+    const auto &left = nodes[i + 1];
+    const auto &right = nodes[node.offset];
+    for (int axis = 0; axis < 3; axis++) {
+      node.bmin[axis] = std::min(left.bmin[axis], right.bmin[axis]);
+      node.bmax[axis] = std::max(left.bmax[axis], right.bmax[axis]);
+    }
+  }
+}
+
+// Interleaves the same tree fitted at time 0 (start) and at time 1 (end)
+inline std::vector<bvh_motion_node>
+make_motion_nodes(const std::vector<bvh_linear_node> &start,
+                  const std::vector<bvh_linear_node> &end) {
+  std::vector<bvh_motion_node> nodes(start.size());
+  for (size_t i = 0; i < start.size(); i++) {
+    nodes[i].start = start[i];
+    for (int axis = 0; axis < 3; axis++) {
+      nodes[i].end_min[axis] = end[i].bmin[axis];
+      nodes[i].end_max[axis] = end[i].bmax[axis];
+    }
+  }
+  return nodes;
+}
+
+// Whether a motion tree is worth traversing. swept is a tree fitted to the
+// primitives' boxes over the whole shutter, start and end the same tree
+// fitted at time 0 and time 1. The costs are left unnormalised, as the rays
+// that reach either tree are the ones that hit the swept root, and the
+// motion tree's cost is taken as the mean of its two ends
+inline bool bvh_motion_pays(const std::vector<bvh_linear_node> &swept,
+                            const std::vector<bvh_linear_node> &start,
+                            const std::vector<bvh_linear_node> &end,
+                            const bvh_build_options &options) {
+  if (swept.empty()) {
+    return false;
+  }
+  bvh_build_options motion = options;
+  motion.traversal_cost *= options.motion_traversal_cost;
+  double swept_cost = bvh_sah_cost(swept, options) * bvh_node_area(swept[0]);
+  double motion_cost =
+      0.5 * (bvh_sah_cost(start, motion) * bvh_node_area(start[0]) +
+             bvh_sah_cost(end, motion) * bvh_node_area(end[0]));
+  return motion_cost < swept_cost;
+}
+
+// What a refit did. cost_ratio is the refit tree's SAH cost over its cost
+// when last built
+struct bvh_refit_result {
+  bool rebuilt = false;
+  double cost_ratio = 1;
+  double seconds = 0;
+};
+
+#endif
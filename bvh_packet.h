@@ -0,0 +1,248 @@
+#ifndef BVH_PACKET_H
+#define BVH_PACKET_H
+
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "hittable.h"
+#include "ray_packet.h"
+
+#include <cstdint>
+#include <vector>
+
+// Packet traversal: a coherent packet walks the tree once, with each box
+// tested against the whole packet by interval arithmetic (Wald, Boulos and
+// Shirley, "Ray tracing deformable scenes using dynamic bounding volume
+// hierarchies", 2007). With the direction signs shared, the earliest any
+// ray can enter a slab comes from one corner of the origin and reciprocal
+// direction bounds and the latest any ray can leave from the opposite one.
+// If the earliest entry is after the latest exit, no ray hits the box. At a
+// leaf each ray is tested against the leaf's box on its own, then against
+// its primitives
+
+namespace bvh_packet_detail {
+
+// Bounds on the entry and exit of the packet into the slabs of one box,
+// the same arithmetic as hit_boxes with the packet bounds in place of a
+// single ray. True unless every ray misses the box within [tmin, tmax]
+inline bool slab_bounds(const ray_packet &p, const float *lo, const float *hi,
+                        float tmin, float tmax, float &t_entry) {
+  float t0 = tmin, t1 = tmax;
+  for (int axis = 0; axis < 3; axis++) {
+    float near_plane = p.neg[axis] ? hi[axis] : lo[axis];
+    float far_plane = p.neg[axis] ? lo[axis] : hi[axis];
+    float near_orig = p.neg[axis] ? p.orig_lo[axis] : p.orig_hi[axis];
+    float far_orig = p.neg[axis] ? p.orig_hi[axis] : p.orig_lo[axis];
+    float dn = near_plane - near_orig;
+    float df = far_plane - far_orig;
+    float tn = dn * (dn >= 0 ? p.inv_lo[axis] : p.inv_hi[axis]);
+    float tf = df * (df >= 0 ? p.inv_hi[axis] : p.inv_lo[axis]) *
+               slab_far_scale;
+    t0 = tn > t0 ? tn : t0;
+    t1 = tf < t1 ? tf : t1;
+  }
+  t_entry = t0;
+  return t0 <= t1;
+}
+
+// Each ray against one box, exactly as hit_boxes tests each lane. The
+// packet shares its direction signs, so the planes are the same for every
+// ray and the loop over the rays vectorises
+inline void rays_hit_box(const ray_packet &p, const float *lo, const float *hi,
+                         const float *ray_tmin, const float *ray_tmax,
+                         bool *hit) {
+  float near_plane[3], far_plane[3];
+  for (int axis = 0; axis < 3; axis++) {
+    near_plane[axis] = p.neg[axis] ? hi[axis] : lo[axis];
+    far_plane[axis] = p.neg[axis] ? lo[axis] : hi[axis];
+  }
+  for (int k = 0; k < p.count; k++) {
+    float t0 = ray_tmin[k], t1 = ray_tmax[k];
+    for (int axis = 0; axis < 3; axis++) {
+      float tn =
+          (near_plane[axis] - p.orig_near[axis][k]) * p.inv_dir[axis][k];
+      float tf = (far_plane[axis] - p.orig_far[axis][k]) * p.inv_dir[axis][k] *
+                 slab_far_scale;
+      t0 = tn > t0 ? tn : t0;
+      t1 = tf < t1 ? tf : t1;
+    }
+    hit[k] = t0 <= t1;
+  }
+}
+
+// The span of all the rays' intervals, what a box has to overlap for any
+// ray to still want it
+inline void packet_span(const ray_packet &p, const packet_hits &hits,
+                        float &tmin, float &tmax) {
+  real lo = hits.t[0].min, hi = hits.t[0].max;
+  for (int k = 1; k < p.count; k++) {
+    lo = std::min(lo, hits.t[k].min);
+    hi = std::max(hi, hits.t[k].max);
+  }
+  tmin = round_down(lo);
+  tmax = round_up(hi);
+}
+
+} // namespace bvh_packet_detail
+
+// Culls N boxes for a whole packet. Returns the mask of boxes some ray may
+// hit within [tmin, tmax], with a lower bound on each one's entry distance
+template <int N>
+inline uint32_t packet_hit_boxes(const aabb_soa<N> &boxes, const ray_packet &p,
+                                 float tmin, float tmax, float *t_entry) {
+  uint32_t mask = 0;
+  for (int lane = 0; lane < N; lane++) {
+    float lo[3], hi[3];
+    for (int axis = 0; axis < 3; axis++) {
+      lo[axis] = boxes.min[axis][lane];
+      hi[axis] = boxes.max[axis][lane];
+    }
+    mask |= uint32_t(bvh_packet_detail::slab_bounds(p, lo, hi, tmin, tmax,
+                                                    t_entry[lane]))
+            << lane;
+  }
+  return mask;
+}
+
+// Closest hit traversal of a binary tree for a coherent packet.
+// leaf(first, count, k) tests ray k of the packet against a primitive range
+// within hits.t[k], shrinking it and filling hits.rec[k] on a closer hit
+template <typename LeafFn>
+void bvh_traverse_packet(const std::vector<bvh_linear_node> &nodes,
+                         const ray_packet &p, packet_hits &hits,
+                         LeafFn &&leaf) {
+  if (nodes.empty()) {
+    return;
+  }
+
+  float tmin, tmax;
+  bvh_packet_detail::packet_span(p, hits, tmin, tmax);
+
+  uint32_t stack[bvh_max_depth];
+  int stack_size = 0;
+  uint32_t current = 0;
+
+  while (true) {
+    const bvh_linear_node &node = nodes[current];
+
+    float t_entry;
+    stat_add(stat_counter::box_tests);
+    if (bvh_packet_detail::slab_bounds(p, node.bmin, node.bmax, tmin, tmax,
+                                       t_entry)) {
+      if (node.count > 0) {
+        for (int k = 0; k < p.count; k++) {
+          stat_add(stat_counter::box_tests);
+          if (node_hit(node, p.rays[k], hits.t[k])) {
+            leaf(node.offset, node.count, k);
+          }
+        }
+        bvh_packet_detail::packet_span(p, hits, tmin, tmax);
+      } else {
+        // The packet shares its direction signs, so the near child is the
+        // same for every ray
+        if (p.neg[node.axis]) {
+          stack[stack_size++] = current + 1;
+          current = node.offset;
+        } else {
+          stack[stack_size++] = node.offset;
+          current = current + 1;
+        }
+        continue;
+      }
+    }
+
+    if (stack_size == 0) {
+      break;
+    }
+    current = stack[--stack_size];
+  }
+}
+
+// As bvh_traverse_packet, for an N wide tree. Children are visited near to
+// far by their packet entry bound
+template <int N, typename LeafFn>
+void bvh_traverse_wide_packet(const std::vector<bvh_wide_node<N>> &nodes,
+                              const ray_packet &p, packet_hits &hits,
+                              LeafFn &&leaf) {
+  if (nodes.empty()) {
+    return;
+  }
+
+  // A leaf keeps a pointer to its box in the parent, for the per ray tests
+  struct entry {
+    uint32_t offset;
+    uint32_t count;
+    float t;
+    const bvh_wide_node<N> *parent;
+    int lane;
+  };
+
+  entry stack[bvh_max_depth * (N - 1) + 1];
+  int stack_size = 0;
+  stack[stack_size++] = {0, 0, -INFINITY, nullptr, 0};
+
+  float tmin, tmax;
+  bvh_packet_detail::packet_span(p, hits, tmin, tmax);
+
+  // Each ray's interval, rounded outwards to float like simd_ray's tests
+  alignas(32) float ray_tmin[packet_max_rays];
+  alignas(32) float ray_tmax[packet_max_rays];
+  for (int k = 0; k < p.count; k++) {
+    ray_tmin[k] = round_down(hits.t[k].min);
+    ray_tmax[k] = round_up(hits.t[k].max);
+  }
+
+  while (stack_size > 0) {
+    entry current = stack[--stack_size];
+
+    if (current.t > tmax) {
+      continue;
+    }
+
+    if (current.count > 0) {
+      float lo[3], hi[3];
+      for (int axis = 0; axis < 3; axis++) {
+        lo[axis] = current.parent->bounds.min[axis][current.lane];
+        hi[axis] = current.parent->bounds.max[axis][current.lane];
+      }
+      bool hit[packet_max_rays];
+      stat_add(stat_counter::box_tests, p.count);
+      bvh_packet_detail::rays_hit_box(p, lo, hi, ray_tmin, ray_tmax, hit);
+      for (int k = 0; k < p.count; k++) {
+        if (hit[k]) {
+          leaf(current.offset, current.count, k);
+          ray_tmax[k] = round_up(hits.t[k].max);
+        }
+      }
+      bvh_packet_detail::packet_span(p, hits, tmin, tmax);
+      continue;
+    }
+
+    const bvh_wide_node<N> &node = nodes[current.offset];
+    float t_entry[N];
+    stat_add(stat_counter::box_tests, N);
+    uint32_t mask = packet_hit_boxes<N>(node.bounds, p, tmin, tmax, t_entry);
+
+    // Push the children far to near, so the nearest is popped first
+    entry hits_near[N];
+    int hit_count = 0;
+    while (mask) {
+      int lane = __builtin_ctz(mask);
+      mask &= mask - 1;
+
+      entry child = {node.offset[lane], node.count[lane], t_entry[lane],
+                     &node, lane};
+      int i = hit_count++;
+      while (i > 0 && hits_near[i - 1].t < child.t) {
+        hits_near[i] = hits_near[i - 1];
+        i--;
+      }
+      hits_near[i] = child;
+    }
+
+    for (int i = 0; i < hit_count; i++) {
+      stack[stack_size++] = hits_near[i];
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,371 @@
+#ifndef BVH_WIDE_H
+#define BVH_WIDE_H
+
+#include "aabb_simd.h"
+#include "bvh_build.h"
+#include "interval.h"
+#include "ray.h"
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// A node with up to N children, bounds stored structure of arrays so all
+// children are tested with one hit_boxes<N> call. Each lane is either an
+// interior child (count 0, offset is the node index), a leaf (offset/count
+// is the primitive range) or unused (empty box, never hit)
+template <int N> struct bvh_wide_node {
+  aabb_soa<N> bounds;
+  uint32_t offset[N];
+  uint16_t count[N];
+};
+
+// A node of a wide motion tree. start is the node collapsed from the tree
+// fitted at time 0 and carries the shape, end holds the child boxes of the
+// same node collapsed from the tree fitted at time 1
+template <int N> struct bvh_wide_motion_node {
+  bvh_wide_node<N> start;
+  aabb_soa<N> end;
+};
+
+namespace bvh_wide_detail {
+
+inline float node_area(const bvh_linear_node &node) {
+  float dx = node.bmax[0] - node.bmin[0];
+  float dy = node.bmax[1] - node.bmin[1];
+  float dz = node.bmax[2] - node.bmin[2];
+  return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+// end and end_wide are null for a static tree. For a motion tree they are
+// the same tree fitted at time 1 and its wide version, which is given
+// exactly the same shape as the time 0 version
+template <int N>
+uint32_t collapse(const std::vector<bvh_linear_node> &binary, uint32_t index,
+                  std::vector<bvh_wide_node<N>> &wide,
+                  const std::vector<bvh_linear_node> *end,
+                  std::vector<bvh_wide_node<N>> *end_wide) {
+  auto area = [&](uint32_t node) {
+    return node_area(binary[node]) + (end ? node_area((*end)[node]) : 0.0f);
+  };
+
+  // Start from the two children and keep opening the largest interior child
+  // until there are N children or only leaves are left
+  uint32_t children[N];
+  int child_count = 0;
+  const bvh_linear_node &node = binary[index];
+  if (node.count > 0) {
+    children[child_count++] = index;
+  } else {
+    children[child_count++] = index + 1;
+    children[child_count++] = node.offset;
+  }
+
+  while (child_count < N) {
+    int best = -1;
+    float best_area = -1;
+    for (int i = 0; i < child_count; i++) {
+      if (binary[children[i]].count == 0 && area(children[i]) > best_area) {
+        best = i;
+        best_area = area(children[i]);
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    uint32_t opened = children[best];
+    children[best] = opened + 1;
+    children[child_count++] = binary[opened].offset;
+  }
+
+  auto empty_node = [] {
+    bvh_wide_node<N> out;
+    for (int lane = 0; lane < N; lane++) {
+      for (int axis = 0; axis < 3; axis++) {
+        out.bounds.min[axis][lane] = INFINITY;
+        out.bounds.max[axis][lane] = -INFINITY;
+      }
+      out.offset[lane] = 0;
+      out.count[lane] = 0;
+    }
+    return out;
+  };
+
+  uint32_t wide_index = uint32_t(wide.size());
+  wide.push_back(empty_node());
+  if (end_wide) {
+    end_wide->push_back(empty_node());
+  }
+
+  auto set_lane = [&](bvh_wide_node<N> &out, int lane,
+                      const bvh_linear_node &child, uint32_t offset) {
+    for (int axis = 0; axis < 3; axis++) {
+      out.bounds.min[axis][lane] = child.bmin[axis];
+      out.bounds.max[axis][lane] = child.bmax[axis];
+    }
+    out.offset[lane] = offset;
+    out.count[lane] = child.count;
+  };
+
+  for (int lane = 0; lane < child_count; lane++) {
+    const bvh_linear_node &child = binary[children[lane]];
+    uint32_t offset = child.offset;
+    if (child.count == 0) {
+      // wide may be reallocated here, so only index into it afterwards
+      offset = collapse<N>(binary, children[lane], wide, end, end_wide);
+    }
+
+    set_lane(wide[wide_index], lane, child, offset);
+    if (end_wide) {
+      set_lane((*end_wide)[wide_index], lane, (*end)[children[lane]], offset);
+    }
+  }
+
+  return wide_index;
+}
+
+} // namespace bvh_wide_detail
+
+// Collapses a binary tree from the builder into an N wide tree
+template <int N>
+std::vector<bvh_wide_node<N>>
+collapse_bvh(const std::vector<bvh_linear_node> &binary) {
+  std::vector<bvh_wide_node<N>> wide;
+  if (!binary.empty()) {
+    wide.reserve(binary.size() / (N - 1) + 1);
+    bvh_wide_detail::collapse<N>(binary, 0, wide, nullptr, nullptr);
+  }
+  return wide;
+}
+
+// Collapses a motion tree, the tree fitted at time 0 (start) and the same
+// tree fitted at time 1 (end), into one wide tree with both sets of bounds
+template <int N>
+std::vector<bvh_wide_motion_node<N>>
+collapse_bvh_motion(const std::vector<bvh_linear_node> &start,
+                    const std::vector<bvh_linear_node> &end) {
+  std::vector<bvh_wide_node<N>> wide_start, wide_end;
+  if (!start.empty()) {
+    bvh_wide_detail::collapse<N>(start, 0, wide_start, &end, &wide_end);
+  }
+
+  std::vector<bvh_wide_motion_node<N>> nodes(wide_start.size());
+  for (size_t i = 0; i < nodes.size(); i++) {
+    nodes[i].start = wide_start[i];
+    nodes[i].end = wide_end[i].bounds;
+  }
+  return nodes;
+}
+
+namespace bvh_wide_detail {
+
+template <int N>
+const bvh_wide_node<N> &shape(const bvh_wide_node<N> &node) {
+  return node;
+}
+
+template <int N>
+const bvh_wide_node<N> &shape(const bvh_wide_motion_node<N> &node) {
+  return node.start;
+}
+
+// Lanes collapse leaves empty hold an empty box, which no ray can enter
+template <int N> bool lane_empty(const aabb_soa<N> &bounds, int lane) {
+  return bounds.min[0][lane] > bounds.max[0][lane];
+}
+
+template <int N> bool lane_unused(const bvh_wide_node<N> &node, int lane) {
+  return lane_empty(node.bounds, lane);
+}
+
+// A motion lane is only never entered if it is empty at both ends
+template <int N>
+bool lane_unused(const bvh_wide_motion_node<N> &node, int lane) {
+  return lane_empty(node.start.bounds, lane) && lane_empty(node.end, lane);
+}
+
+template <int N, typename Node>
+bool valid(const std::vector<Node> &nodes, size_t primitive_count) {
+  // As bvh_detail::valid, collapse also puts children after their parents
+  std::vector<uint8_t> depth(nodes.size(), 0);
+  if (!nodes.empty()) {
+    depth[0] = 1;
+  }
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if (depth[i] == 0) {
+      continue;
+    }
+    const bvh_wide_node<N> &node = shape(nodes[i]);
+    for (int lane = 0; lane < N; lane++) {
+      uint32_t offset = node.offset[lane];
+      if (node.count[lane] > 0) {
+        if (uint64_t(offset) + node.count[lane] > primitive_count) {
+          return false;
+        }
+        continue;
+      }
+      if (offset == 0 && lane_unused(nodes[i], lane)) {
+        continue;
+      }
+      if (offset <= i || offset >= nodes.size() ||
+          depth[i] >= bvh_max_depth) {
+        return false;
+      }
+      depth[offset] = std::max(depth[offset], uint8_t(depth[i] + 1));
+    }
+  }
+  return true;
+}
+
+} // namespace bvh_wide_detail
+
+// bvh_valid for wide trees
+template <int N>
+bool bvh_valid(const std::vector<bvh_wide_node<N>> &nodes,
+               size_t primitive_count) {
+  return bvh_wide_detail::valid<N>(nodes, primitive_count);
+}
+
+template <int N>
+bool bvh_valid(const std::vector<bvh_wide_motion_node<N>> &nodes,
+               size_t primitive_count) {
+  return bvh_wide_detail::valid<N>(nodes, primitive_count);
+}
+
+namespace bvh_wide_detail {
+
+// Traversal shared by static and motion trees. bounds(index) returns the
+// child boxes of node index as of the ray's time. With any_hit it returns
+// at the first leaf that reports a hit
+template <int N, bool any_hit, typename Node, typename BoundsFn,
+          typename LeafFn>
+bool traverse(const std::vector<Node> &nodes, BoundsFn &&bounds, const ray &r,
+              interval ray_t, LeafFn &&leaf) {
+  if (nodes.empty()) {
+    return false;
+  }
+
+  struct entry {
+    uint32_t offset;
+    uint32_t count;
+    float t;
+  };
+
+  entry stack[bvh_max_depth * (N - 1) + 1];
+  int stack_size = 0;
+  stack[stack_size++] = {0, 0, -INFINITY};
+
+  const simd_ray sr(r);
+  bool hit_anything = false;
+
+  while (stack_size > 0) {
+    entry current = stack[--stack_size];
+
+    // Skip anything that is further than a hit found since it was pushed
+    if (current.t > ray_t.max) {
+      continue;
+    }
+
+    if (current.count > 0) {
+      if (leaf(current.offset, current.count, ray_t)) {
+        if constexpr (any_hit) {
+          return true;
+        }
+        hit_anything = true;
+      }
+      continue;
+    }
+
+    const bvh_wide_node<N> &node = shape<N>(nodes[current.offset]);
+    float t_entry[N];
+    stat_add(stat_counter::box_tests, N);
+    uint32_t mask = hit_boxes<N>(bounds(current.offset), sr,
+                                 round_down(ray_t.min), round_up(ray_t.max),
+                                 t_entry);
+
+    // Any hit will do for a shadow ray, so the order doesn't matter
+    if constexpr (any_hit) {
+      while (mask) {
+        int lane = __builtin_ctz(mask);
+        mask &= mask - 1;
+        stack[stack_size++] = {node.offset[lane], node.count[lane],
+                               t_entry[lane]};
+      }
+      continue;
+    }
+
+    // Push the children far to near, so the nearest is popped first
+    entry hits[N];
+    int hit_count = 0;
+    while (mask) {
+      int lane = __builtin_ctz(mask);
+      mask &= mask - 1;
+
+      entry child = {node.offset[lane], node.count[lane], t_entry[lane]};
+      int i = hit_count++;
+      while (i > 0 && hits[i - 1].t < child.t) {
+        hits[i] = hits[i - 1];
+        i--;
+      }
+      hits[i] = child;
+    }
+
+    for (int i = 0; i < hit_count; i++) {
+      stack[stack_size++] = hits[i];
+    }
+  }
+
+  return hit_anything;
+}
+
+} // namespace bvh_wide_detail
+
+// Closest hit traversal of an N wide tree. leaf(first, count, ray_t) tests a
+// primitive range, shrinks ray_t.max on a hit and returns whether it hit.
+// With any_hit the walk stops at the first hit instead
+template <int N, bool any_hit = false, typename LeafFn>
+bool bvh_traverse_wide(const std::vector<bvh_wide_node<N>> &nodes,
+                       const ray &r, interval ray_t, LeafFn &&leaf) {
+  auto bounds = [&](uint32_t index) -> const aabb_soa<N> & {
+    return nodes[index].bounds;
+  };
+  return bvh_wide_detail::traverse<N, any_hit>(nodes, bounds, r, ray_t,
+                                               leaf);
+}
+
+// As bvh_traverse_wide, for a motion tree. Child boxes are interpolated to
+// the ray's time before the SIMD test
+template <int N, bool any_hit = false, typename LeafFn>
+bool bvh_traverse_wide_motion(
+    const std::vector<bvh_wide_motion_node<N>> &nodes, const ray &r,
+    interval ray_t, LeafFn &&leaf) {
+  const float time = float(r.time());
+  aabb_soa<N> box;
+  auto bounds = [&](uint32_t index) -> const aabb_soa<N> & {
+    const aabb_soa<N> &a = nodes[index].start.bounds;
+    const aabb_soa<N> &b = nodes[index].end;
+    for (int axis = 0; axis < 3; axis++) {
+      for (int lane = 0; lane < N; lane++) {
+        float lo0 = a.min[axis][lane], hi0 = a.max[axis][lane];
+        float lo1 = b.min[axis][lane], hi1 = b.max[axis][lane];
+        // Widened by a few ulps so float rounding in the interpolation
+        // can't shrink the box
+        float pad = 0x1p-22f * (std::fabs(lo0) + std::fabs(lo1) +
+                                std::fabs(hi0) + std::fabs(hi1));
+        float lo = lo0 + time * (lo1 - lo0) - pad;
+        float hi = hi0 + time * (hi1 - hi0) + pad;
+        // Unused lanes hold an inverted infinite box, which the arithmetic
+        // above turns into NaN, so they keep their start box. Selected
+        // rather than branched on so the loop vectorises
+        bool used = lo0 <= hi0;
+        box.min[axis][lane] = used ? lo : lo0;
+        box.max[axis][lane] = used ? hi : hi0;
+      }
+    }
+    return box;
+  };
+  return bvh_wide_detail::traverse<N, any_hit>(nodes, bounds, r, ray_t,
+                                               leaf);
+}
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef CACHE_IO_H
+#define CACHE_IO_H
+
+#include "bvh_build.h"
+#include "material.h"
+#include "rtweekend.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// 64 bit FNV-1a, used to key scene caches on everything that went into
+// building the scene
+class cache_hash {
+public:
+  void add(const void *data, size_t size) {
+    auto bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; i++) {
+      hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+  }
+
+  void add(const std::string &text) {
+    add(uint64_t(text.size()));
+    add(text.data(), text.size());
+  }
+
+  template <typename T> void add(const T &value) {
+    static_assert(std::is_trivially_copyable<T>::value, "hash raw bytes only");
+    add(&value, sizeof(T));
+  }
+
+  uint64_t value() const { return hash; }
+
+private:
+  uint64_t hash = 0xcbf29ce484222325ull;
+};
+
+// Arrays are aligned to this in the cache so SIMD node layouts stay aligned
+constexpr size_t cache_alignment = 32;
+
+// Serialises objects into one byte buffer. Materials are collected into a
+// table as objects refer to them, the table is stored separately and handed
+// to the reader before any object is read
+class cache_writer {
+public:
+  template <typename T> void write(const T &value) {
+    static_assert(std::is_trivially_copyable<T>::value, "write raw bytes only");
+    auto bytes = reinterpret_cast<const char *>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+  }
+
+  template <typename T> void write_array(const std::vector<T> &values) {
+    static_assert(std::is_trivially_copyable<T>::value, "write raw bytes only");
+    write(uint64_t(values.size()));
+    align();
+    auto bytes = reinterpret_cast<const char *>(values.data());
+    buffer.insert(buffer.end(), bytes, bytes + values.size() * sizeof(T));
+  }
+
+  // Index of the material in the cache's table, adding it on first use
+  uint32_t material_id(const material *mat) {
+    auto found = material_ids.find(mat);
+    if (found != material_ids.end()) {
+      return found->second;
+    }
+    uint32_t id = uint32_t(materials.size());
+    materials.push_back(mat ? mat->describe() : material_desc());
+    material_ids[mat] = id;
+    return id;
+  }
+
+  const std::vector<char> &bytes() const { return buffer; }
+  const std::vector<material_desc> &material_table() const {
+    return materials;
+  }
+
+  // True if every material seen can be described, a cache with an opaque
+  // material could not be loaded back
+  bool complete() const {
+    for (const auto &desc : materials) {
+      if (desc.kind == material_kind::none) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  std::vector<char> buffer;
+  std::vector<material_desc> materials;
+  std::unordered_map<const material *, uint32_t> material_ids;
+
+  void align() {
+    while (buffer.size() % cache_alignment != 0) {
+      buffer.push_back(0);
+    }
+  }
+};
+
+// Reads back what cache_writer wrote, from memory such as a mapped file.
+// Every read is bounds checked, after the first failure all reads fail
+class cache_reader {
+public:
+  cache_reader(const char *data, size_t size,
+               std::vector<shared_ptr<material>> materials = {})
+      : begin(data), p(data), end(data + size),
+        materials(std::move(materials)) {}
+
+  template <typename T> bool read(T &value) {
+    static_assert(std::is_trivially_copyable<T>::value, "read raw bytes only");
+    if (!take(sizeof(T))) {
+      return false;
+    }
+    std::memcpy(&value, p - sizeof(T), sizeof(T));
+    return true;
+  }
+
+  // One allocation and one copy per array, however many objects it holds
+  template <typename T> bool read_array(std::vector<T> &values) {
+    static_assert(std::is_trivially_copyable<T>::value, "read raw bytes only");
+    uint64_t count;
+    if (!read(count) || !align() || count > size_t(end - p) / sizeof(T)) {
+      ok = false;
+      return false;
+    }
+    values.resize(count);
+    if (count > 0) {
+      std::memcpy(static_cast<void *>(values.data()), p, count * sizeof(T));
+    }
+    p += count * sizeof(T);
+    return true;
+  }
+
+  shared_ptr<material> material_at(uint32_t id) {
+    if (id >= materials.size()) {
+      ok = false;
+      return nullptr;
+    }
+    return materials[id];
+  }
+
+  bool good() const { return ok; }
+
+private:
+  const char *begin;
+  const char *p;
+  const char *end;
+  std::vector<shared_ptr<material>> materials;
+  bool ok = true;
+
+  bool take(size_t size) {
+    if (!ok || size > size_t(end - p)) {
+      ok = false;
+      return false;
+    }
+    p += size;
+    return true;
+  }
+
+  bool align() {
+    size_t offset = size_t(p - begin);
+    size_t padding = (cache_alignment - offset % cache_alignment) %
+                     cache_alignment;
+    return take(padding);
+  }
+};
+
+// Build stats travel with a cached BVH so they can still be reported
+inline void write_bvh_stats(cache_writer &out, const bvh_build_stats &stats) {
+  out.write(stats.build_seconds);
+  out.write(uint64_t(stats.primitive_count));
+  out.write(uint64_t(stats.node_count));
+  out.write(uint64_t(stats.leaf_count));
+  out.write(int32_t(stats.depth));
+  out.write(stats.sah_cost);
+  std::vector<uint64_t> histogram(stats.leaf_histogram.begin(),
+                                  stats.leaf_histogram.end());
+  out.write_array(histogram);
+}
+
+inline bool read_bvh_stats(cache_reader &in, bvh_build_stats &stats) {
+  uint64_t primitive_count = 0, node_count = 0, leaf_count = 0;
+  int32_t depth = 0;
+  std::vector<uint64_t> histogram;
+  in.read(stats.build_seconds);
+  in.read(primitive_count);
+  in.read(node_count);
+  in.read(leaf_count);
+  in.read(depth);
+  in.read(stats.sah_cost);
+  in.read_array(histogram);
+  stats.primitive_count = primitive_count;
+  stats.node_count = node_count;
+  stats.leaf_count = leaf_count;
+  stats.depth = depth;
+  stats.leaf_histogram.assign(histogram.begin(), histogram.end());
+  return in.good();
+}
+
+#endif
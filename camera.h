@@ -1,18 +1,97 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "framebuffer.h"
 #include "hittable.h"
+#include "image_writer.h"
+#include "lights.h"
 #include "material.h"
+#include "ray_packet.h"
 #include "ray.h"
 #include "rtweekend.h"
+#include "sampler.h"
+#include "tiles.h"
 #include "vec3.h"
 #include <cmath>
 #include <iostream>
 #include <omp.h>
 
+#include <algorithm>
 #include <chrono>
+#include <fstream>
 #include <iostream>
-#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+enum class integrator_type {
+  path,     // each sample traced to the end before the next one starts
+  wavefront // batches of samples traced a bounce at a time, see camera
+};
+
+// One path in flight in the wavefront integrator
+struct wavefront_path {
+  ray r;
+  colour throughput;
+  sampler gen;
+  uint32_t sample; // index into the batch's samples
+  // Whether light given off at the next hit counts, see camera::sample_lights
+  bool count_emission;
+};
+
+// A shadow ray from a diffuse hit to a point on a light, and the light it
+// brings to its sample if nothing is in the way
+struct wavefront_shadow {
+  ray r;
+  colour contribution;
+  uint32_t sample;
+};
+
+// A thread's working set for the wavefront integrator, reused from tile to
+// tile so the arrays are only allocated once. Packet tracing uses the per
+// pixel sums as well
+struct wavefront_batch {
+  std::vector<wavefront_path> paths, next;
+  std::vector<hit_record> hits;
+  // Camera rays traced as packets: where each packet ends in paths, and
+  // whether each path hit
+  std::vector<uint32_t> packet_ends;
+  std::vector<unsigned char> hit_flags;
+  // Indices into paths and hits, one queue per material_kind
+  std::vector<uint32_t> queues[5];
+  std::vector<wavefront_shadow> shadows;
+  // Per sample, in the order the samples were generated
+  std::vector<colour> results;
+  std::vector<uint32_t> owners; // tile local pixel
+  // Per tile local pixel
+  std::vector<colour> pixel_colour;
+  std::vector<double> luminance_sq;
+  std::vector<uint64_t> cost;
+};
+
+// Totals for one call to camera::render
+struct render_stats {
+  double seconds = 0;
+  // From the start of the render until the first tile was finished
+  double first_tile_seconds = 0;
+  // Camera, scattered and shadow rays traced
+  uint64_t rays = 0;
+  // All zero unless built with RT_STATS
+  stat_counts counters;
+
+  double mrays_per_second() const {
+    return seconds > 0 ? rays / seconds / 1e6 : 0;
+  }
+
+  void print(std::ostream &out) const {
+    out << "Render completed in " << seconds << " s, first tile after "
+        << first_tile_seconds * 1000.0 << " ms, " << rays << " rays ("
+        << mrays_per_second() << " Mrays/s)\n";
+    if (stats_enabled) {
+      counters.print(out);
+    }
+  }
+};
 
 class camera {
 public:
@@ -21,6 +100,36 @@ public:
   int samples_per_pixel = 10;
   int max_depth = 10;
 
+  // path traces one sample at a time, alternating between traversal and
+  // whichever material it hit. wavefront generates up to wavefront_size
+  // camera rays, intersects them all, sorts the hits into a queue per
+  // material and shades each queue in one loop, then compacts the
+  // survivors for the next bounce. Both give the same image
+  integrator_type integrator = integrator_type::path;
+  int wavefront_size = 8192;
+
+  // With packet_size 4 or 8, camera rays are traced through the BVHs in
+  // packets covering packet_size x packet_size pixels, one sample of each,
+  // which share their box tests. Later bounces go one ray at a time. 0
+  // traces camera rays one at a time as well. The image is the same
+  int packet_size = 0;
+
+  // Next event estimation. Every primitive with an emissive material is
+  // gathered into a light list (see hittable::add_lights), and at each
+  // diffuse hit a point picked on the lights is tested for visibility with
+  // a shadow ray. A diffuse bounce that then hits a light doesn't count its
+  // light again. Without it, or without any lights, light is only found by
+  // paths that happen to hit an emitter or escape to the sky
+  bool sample_lights = true;
+
+  // The sky gradient lights the scene from every direction. Without it
+  // escaping paths get nothing, so emitters are the only light
+  bool sky = true;
+
+  // Paths always get this many bounces, after that Russian roulette ends
+  // them with a probability based on how much they can still contribute
+  int min_bounces = 3;
+
   double vfov = 90;
   point3 lookfrom = point3(0, 0, 0);
   point3 lookat = point3(0, 0, -1);
@@ -29,44 +138,203 @@ public:
   double defocus_angle = 0;
   double focus_dist = 10;
 
+  // Where the numbers for each sample come from, see sampler. Sobol points
+  // converge faster than independent ones. Blue noise dithering gives up a
+  // little of that to push what error is left into fine grain that blurs
+  // away, which pays off at a sample or two per pixel
+  sampler_type sampling = sampler_type::sobol;
+
+  // Animation frame index, folded into the per sample RNG seed so every
+  // frame gets fresh noise while each frame stays reproducible
+  int frame = 0;
+
+  // Where render() saves the image, the extension picks the format (.png,
+  // .pfm, anything else is binary PPM). Empty to skip saving
+  std::string output_path = "image.png";
+
+  // The image is split into square tiles handed to the threads by a work
+  // stealing scheduler. 0 threads uses the OpenMP default
+  int tile_size = 32;
+  tile_order tile_ordering = tile_order::morton;
+  int thread_count = 0;
+
+  // If set, per tile render times are written here as CSV
+  std::string tile_timings_path;
+
+  // Progressive mode renders pass_samples per pixel at a time into an
+  // accumulation buffer, refining the whole image each pass. It stops at
+  // samples_per_pixel, when time_budget seconds have gone (mid pass if need
+  // be) or when the estimated noise falls to target_noise, whichever comes
+  // first. The current image is saved every checkpoint_interval seconds so a
+  // killed job still leaves something behind. 0 disables each limit
+  bool progressive = false;
+  int pass_samples = 4;
+  double time_budget = 0;
+  double target_noise = 0;
+  double checkpoint_interval = 30;
+
+  // Adaptive sampling gives every pixel adaptive_min_samples, then keeps
+  // sampling only the pixels whose relative standard error is still above
+  // adaptive_threshold, pass_samples at a time. No pixel goes past
+  // samples_per_pixel. sample_heatmap_path saves the per pixel sample count
+  bool adaptive = false;
+  int adaptive_min_samples = 16;
+  double adaptive_threshold = 0.02;
+  std::string sample_heatmap_path;
+
+  // Builds with RT_STATS count rays by depth, box and primitive tests and
+  // scatters by material (see stats.h), and print the totals after each
+  // render. stats_json_path saves them as JSON, traversal_heatmap_path saves
+  // the box and primitive tests per sample at each pixel, to tell a poor
+  // BVH from expensive shading
+  std::string stats_json_path;
+  std::string traversal_heatmap_path;
+
   void render(const hittable &world) {
     initialise();
-    std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
     auto start_time = std::chrono::steady_clock::now();
 
-    std::vector<std::string> image_output(image_height * image_width);
+    lights.clear();
+    if (sample_lights) {
+      world.add_lights(lights);
+    }
+    if (!lights.empty()) {
+      std::clog << "Sampling " << lights.size() << " lights, total area "
+                << lights.total_area() << '\n';
+    }
+
+    image = framebuffer(image_width, image_height);
+    size_t pixel_count = size_t(image_width) * image_height;
+    sample_sum.assign(pixel_count, colour(0, 0, 0));
+    luminance_sq_sum.assign(pixel_count, 0.0);
+    sample_counts.assign(pixel_count, 0);
+    pixel_done.assign(pixel_count, 0);
+    if (stats_enabled) {
+      traversal_cost.assign(pixel_count, 0);
+      stats_reset();
+    } else if (!stats_json_path.empty() || !traversal_heatmap_path.empty()) {
+      std::clog << "Render statistics need a build with RT_STATS\n";
+    }
 
-#pragma omp parallel for schedule(dynamic)
-    for (int i = 0; i < image_height; i++) {
-      int tid = omp_get_thread_num();
-      std::ostringstream local_stream;
+    auto tiles = make_tiles(image_width, image_height, tile_size, tile_ordering);
+    int threads = thread_count > 0 ? thread_count : omp_get_max_threads();
+    timings.assign(tiles.size(), tile_timing{});
+    for (size_t t = 0; t < tiles.size(); t++) {
+      timings[t].area = tiles[t];
+    }
 
-      for (int j = 0; j < image_width; j++) {
-        colour pixel_colour(0, 0, 0);
-        for (int sample = 0; sample < samples_per_pixel; sample++) {
-          ray r = get_ray(j, i);
-          pixel_colour += ray_colour(r, max_depth, world);
+    // Without a time budget nothing is ever cut short
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    if (progressive && time_budget > 0) {
+      deadline = start_time + std::chrono::duration_cast<
+                                  std::chrono::steady_clock::duration>(
+                                  std::chrono::duration<double>(time_budget));
+    }
+    auto last_checkpoint = start_time;
+
+    int pass_size = (progressive || adaptive) ? std::max(1, pass_samples)
+                                              : samples_per_pixel;
+    int pass = 0;
+    while (true) {
+      int samples = pass_size;
+      if (pass == 0 && adaptive) {
+        samples = std::max(pass_size, adaptive_min_samples);
+      }
+      render_pass(world, tiles, threads, samples, start_time, deadline);
+      pass++;
+
+      size_t active = std::count(pixel_done.begin(), pixel_done.end(), 0);
+      if (active == 0 || !progressive) {
+        if (active == 0) {
+          break;
         }
+        continue;
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      double elapsed = std::chrono::duration<double>(now - start_time).count();
+      double noise = estimate_noise();
+      std::clog << "Pass " << pass << ": " << average_samples()
+                << " spp average, " << active << " pixels active, noise "
+                << noise << ", " << elapsed << " s\n"
+                << std::flush;
 
-        std::ostringstream pixel_stream;
-        write_colour(pixel_stream, pixel_sample_scale * pixel_colour);
-        image_output[i * image_width + j] = pixel_stream.str();
+      if (now >= deadline) {
+        std::clog << "Time budget reached\n";
+        break;
+      }
+      if (target_noise > 0 && noise <= target_noise) {
+        std::clog << "Noise target reached\n";
+        break;
+      }
+      if (checkpoint_interval > 0 &&
+          std::chrono::duration<double>(now - last_checkpoint).count() >=
+              checkpoint_interval) {
+        save_image();
+        last_checkpoint = now;
       }
     }
 
-    for (int i = 0; i < image_height * image_width; i++) {
-      std::cout << image_output[i];
+    auto end_time = std::chrono::steady_clock::now();
+    stats = render_stats();
+    stats.seconds =
+        std::chrono::duration<double>(end_time - start_time).count();
+    stats.first_tile_seconds = infinity;
+    for (const auto &t : timings) {
+      stats.rays += t.rays;
+      if (t.first_done > 0) {
+        stats.first_tile_seconds = std::fmin(stats.first_tile_seconds,
+                                             t.first_done);
+      }
+    }
+    if (stats.first_tile_seconds == infinity) {
+      stats.first_tile_seconds = 0;
+    }
+    if (stats_enabled) {
+      stats.counters = stats_merged();
     }
 
-    auto end_time = std::chrono::steady_clock::now();
-    auto duration =
-        std::chrono::duration_cast<std::chrono::seconds>(end_time - start_time)
-            .count();
+    std::clog << '\n';
+    stats.print(std::clog);
+    std::clog << std::flush;
+
+    if (adaptive) {
+      std::clog << "Adaptive sampling: " << average_samples()
+                << " spp average of " << samples_per_pixel << "\n";
+    }
+
+    if (!sample_heatmap_path.empty()) {
+      save_sample_heatmap();
+    }
+
+    if (!tile_timings_path.empty()) {
+      write_tile_timings(tile_timings_path, timings);
+    }
+
+    if (stats_enabled && !stats_json_path.empty()) {
+      std::ofstream out(stats_json_path);
+      stats.counters.write_json(out);
+      out << '\n';
+      if (!out) {
+        std::clog << "Failed to write " << stats_json_path << '\n';
+      }
+    }
+
+    if (stats_enabled && !traversal_heatmap_path.empty()) {
+      save_traversal_heatmap();
+    }
 
-    std::clog << "\nRender completed in " << duration << " seconds.\n"
-              << std::flush;
+    save_image();
   }
 
+  // The last rendered image, linear and unclamped
+  const framebuffer &rendered_image() const { return image; }
+
+  // Per tile times from the last render, in the order tiles were scheduled
+  const std::vector<tile_timing> &tile_timings() const { return timings; }
+
+  const render_stats &last_render_stats() const { return stats; }
+
   // void render(const hittable &world) {
   //   initialise();
   //   auto start_time = std::chrono::steady_clock::now();
@@ -94,6 +362,9 @@ public:
 
 private:
   int image_height;
+  framebuffer image;
+  std::vector<tile_timing> timings;
+  render_stats stats;
   point3 centre;
   double pixel_sample_scale;
   point3 pixel00_loc;
@@ -103,6 +374,547 @@ private:
   vec3 defocus_disk_u;
   vec3 defocus_disk_v;
 
+  // Per pixel running sums, kept across passes so the image can be refined
+  std::vector<colour> sample_sum;
+  std::vector<double> luminance_sq_sum;
+  std::vector<int> sample_counts;
+  // Set once a pixel has all its samples or has converged
+  std::vector<unsigned char> pixel_done;
+  // Box and primitive tests per pixel, only with RT_STATS
+  std::vector<uint64_t> traversal_cost;
+  // Gathered from the world at the start of each render, see sample_lights
+  light_list lights;
+
+  void render_pass(const hittable &world, const std::vector<tile> &tiles,
+                   int threads, int samples,
+                   std::chrono::steady_clock::time_point start_time,
+                   std::chrono::steady_clock::time_point deadline) {
+    tile_scheduler scheduler(tiles.size(), threads);
+
+#pragma omp parallel num_threads(threads)
+    {
+      int tid = omp_get_thread_num();
+      wavefront_batch batch;
+      int index;
+      while (scheduler.next(tid, index)) {
+        // Once the budget is spent the remaining tiles are skipped, each
+        // pixel keeps its own sample count so a partial pass is still valid
+        auto tile_start = std::chrono::steady_clock::now();
+        if (tile_start >= deadline) {
+          continue;
+        }
+        uint64_t rays = 0;
+        if (integrator == integrator_type::wavefront) {
+          render_tile_wavefront(tiles[index], world, samples, rays, batch);
+        } else if (packet_size > 0) {
+          render_tile_packets(tiles[index], world, samples, rays, batch);
+        } else {
+          render_tile(tiles[index], world, samples, rays);
+        }
+        auto tile_end = std::chrono::steady_clock::now();
+
+        timings[index].thread = tid;
+        timings[index].seconds +=
+            std::chrono::duration<double>(tile_end - tile_start).count();
+        timings[index].rays += rays;
+        if (timings[index].first_done == 0) {
+          timings[index].first_done =
+              std::chrono::duration<double>(tile_end - start_time).count();
+        }
+      }
+    }
+  }
+
+  // Adds up to samples more samples to every pixel in the tile that still
+  // needs them. Sample indices carry on from the pixel's count, so the result
+  // doesn't depend on how the samples were split into passes
+  void render_tile(const tile &area, const hittable &world, int samples,
+                   uint64_t &rays) {
+    for (int i = area.y0; i < area.y1; i++) {
+      for (int j = area.x0; j < area.x1; j++) {
+        size_t pixel = size_t(i) * image_width + j;
+        if (pixel_done[pixel]) {
+          continue;
+        }
+
+        int first_sample = sample_counts[pixel];
+        int end_sample = std::min(samples_per_pixel, first_sample + samples);
+        colour pixel_colour(0, 0, 0);
+        double luminance_sq = 0;
+        uint64_t cost_before = 0;
+        if constexpr (stats_enabled) {
+          cost_before = thread_stats().traversal_cost();
+        }
+        for (int sample = first_sample; sample < end_sample; sample++) {
+          sampler gen = pixel_sampler(j, i, sample);
+          ray r = get_ray(j, i, gen);
+          colour c = ray_colour(r, world, gen, rays);
+          pixel_colour += c;
+          luminance_sq += luminance(c) * luminance(c);
+        }
+
+        if constexpr (stats_enabled) {
+          traversal_cost[pixel] +=
+              thread_stats().traversal_cost() - cost_before;
+        }
+        add_samples(j, i, end_sample, pixel_colour, luminance_sq);
+      }
+    }
+  }
+
+  // The same samples as render_tile, traced in batches of up to
+  // wavefront_size a bounce at a time. Each path carries its own generator
+  // and the results are summed in sample order, so the image matches
+  // render_tile's exactly
+  void render_tile_wavefront(const tile &area, const hittable &world,
+                             int samples, uint64_t &rays,
+                             wavefront_batch &batch) {
+    start_tile_sums(area, batch);
+    batch.paths.clear();
+    batch.owners.clear();
+    batch.packet_ends.clear();
+    int group = packet_group();
+    size_t batch_size =
+        size_t(std::max(group * group, std::max(1, wavefront_size)));
+
+    auto emit = [&](int j, int i, int sample) {
+      sampler gen = pixel_sampler(j, i, sample);
+      ray r = get_ray(j, i, gen);
+      batch.paths.push_back(
+          {r, colour(1, 1, 1), gen, uint32_t(batch.owners.size()), true});
+      batch.owners.push_back(tile_local(area, j, i));
+    };
+    auto end_group = [&] {
+      batch.packet_ends.push_back(uint32_t(batch.paths.size()));
+      if (batch.paths.size() + group * group > batch_size) {
+        trace_wavefront(world, batch, rays);
+      }
+    };
+    for_each_sample(area, samples, group, emit, end_group);
+    if (!batch.paths.empty()) {
+      trace_wavefront(world, batch, rays);
+    }
+
+    add_tile_sums(area, samples, batch);
+  }
+
+  // render_tile with the camera rays traced in packets, see packet_size.
+  // Each path carries on one ray at a time from its first hit
+  void render_tile_packets(const tile &area, const hittable &world,
+                           int samples, uint64_t &rays,
+                           wavefront_batch &batch) {
+    start_tile_sums(area, batch);
+    int group = packet_group();
+
+    ray_packet packet;
+    packet_hits hits;
+    sampler gens[packet_max_rays];
+    uint32_t owners[packet_max_rays];
+
+    auto emit = [&](int j, int i, int sample) {
+      gens[packet.count] = pixel_sampler(j, i, sample);
+      owners[packet.count] = tile_local(area, j, i);
+      packet.add(get_ray(j, i, gens[packet.count]));
+    };
+    auto end_group = [&] {
+      trace_packet(world, packet, hits, owners, batch, rays);
+      for (int k = 0; k < packet.count; k++) {
+        uint64_t cost_before = 0;
+        if constexpr (stats_enabled) {
+          cost_before = thread_stats().traversal_cost();
+        }
+        colour c = max_depth > 0
+                       ? continue_path(packet.rays[k], hits.mask >> k & 1,
+                                       hits.rec[k], world, gens[k], rays)
+                       : colour(0, 0, 0);
+        if constexpr (stats_enabled) {
+          batch.cost[owners[k]] +=
+              thread_stats().traversal_cost() - cost_before;
+        }
+        batch.pixel_colour[owners[k]] += c;
+        batch.luminance_sq[owners[k]] += luminance(c) * luminance(c);
+      }
+      packet.clear();
+    };
+    for_each_sample(area, samples, group, emit, end_group);
+
+    add_tile_sums(area, samples, batch);
+  }
+
+  // Closest hits for a packet of camera rays. Its traversal cost is shared
+  // evenly between the pixels in it
+  void trace_packet(const hittable &world, ray_packet &packet,
+                    packet_hits &hits, const uint32_t *owners,
+                    wavefront_batch &batch, uint64_t &rays) const {
+    packet.finish();
+    hits.reset(packet.count, interval(0, infinity));
+    if (max_depth <= 0) {
+      return;
+    }
+    rays += packet.count;
+    uint64_t cost_before = 0;
+    if constexpr (stats_enabled) {
+      cost_before = thread_stats().traversal_cost();
+    }
+    world.hit_packet(packet, hits);
+    for (int k = 0; k < packet.count; k++) {
+      stat_ray(0);
+    }
+    if constexpr (stats_enabled) {
+      uint64_t cost = thread_stats().traversal_cost() - cost_before;
+      for (int k = 0; k < packet.count; k++) {
+        batch.cost[owners[k]] += cost / packet.count;
+      }
+    }
+  }
+
+  // Side of the pixel blocks sampled together, 1 without packets
+  int packet_group() const {
+    return packet_size > 0 ? std::min(packet_size, 8) : 1;
+  }
+
+  static uint32_t tile_local(const tile &area, int j, int i) {
+    return uint32_t((i - area.y0) * (area.x1 - area.x0) + (j - area.x0));
+  }
+
+  // Calls emit(j, i, sample) for every sample the tile still needs this
+  // pass and end_group() after each group. A group is one sample of each
+  // pixel in a size x size block, so with size 1 it's a single sample and
+  // the pixels go one after another. Each pixel's samples come in order
+  template <typename EmitFn, typename GroupFn>
+  void for_each_sample(const tile &area, int samples, int size, EmitFn &&emit,
+                       GroupFn &&end_group) const {
+    for (int by = area.y0; by < area.y1; by += size) {
+      for (int bx = area.x0; bx < area.x1; bx += size) {
+        int y1 = std::min(by + size, area.y1);
+        int x1 = std::min(bx + size, area.x1);
+        for (int offset = 0; offset < samples; offset++) {
+          bool any = false;
+          for (int i = by; i < y1; i++) {
+            for (int j = bx; j < x1; j++) {
+              size_t pixel = size_t(i) * image_width + j;
+              int sample = sample_counts[pixel] + offset;
+              if (pixel_done[pixel] || sample >= samples_per_pixel) {
+                continue;
+              }
+              emit(j, i, sample);
+              any = true;
+            }
+          }
+          // No pixel in the block wants more samples
+          if (!any) {
+            break;
+          }
+          end_group();
+        }
+      }
+    }
+  }
+
+  void start_tile_sums(const tile &area, wavefront_batch &batch) const {
+    size_t tile_pixels = size_t(area.x1 - area.x0) * (area.y1 - area.y0);
+    batch.pixel_colour.assign(tile_pixels, colour(0, 0, 0));
+    batch.luminance_sq.assign(tile_pixels, 0.0);
+    batch.cost.assign(tile_pixels, 0);
+  }
+
+  void add_tile_sums(const tile &area, int samples,
+                     const wavefront_batch &batch) {
+    for (int i = area.y0; i < area.y1; i++) {
+      for (int j = area.x0; j < area.x1; j++) {
+        size_t pixel = size_t(i) * image_width + j;
+        if (pixel_done[pixel]) {
+          continue;
+        }
+        uint32_t local = tile_local(area, j, i);
+        if constexpr (stats_enabled) {
+          traversal_cost[pixel] += batch.cost[local];
+        }
+        int end_sample =
+            std::min(samples_per_pixel, sample_counts[pixel] + samples);
+        add_samples(j, i, end_sample, batch.pixel_colour[local],
+                    batch.luminance_sq[local]);
+      }
+    }
+  }
+
+  // Runs every path in the batch to the end, one bounce at a time, and adds
+  // the results to the batch's pixels
+  void trace_wavefront(const hittable &world, wavefront_batch &batch,
+                       uint64_t &rays) const {
+    batch.results.assign(batch.owners.size(), colour(0, 0, 0));
+
+    for (int depth = 0; depth < max_depth && !batch.paths.empty(); depth++) {
+      batch.hits.resize(batch.paths.size());
+      for (auto &queue : batch.queues) {
+        queue.clear();
+      }
+
+      // Camera rays go through as the packets they were generated in
+      if (depth == 0 && packet_size > 0) {
+        intersect_packets(world, batch, rays);
+      }
+
+      // Intersect every path, misses are finished here
+      for (size_t k = 0; k < batch.paths.size(); k++) {
+        const wavefront_path &p = batch.paths[k];
+        bool hit;
+        if (depth == 0 && packet_size > 0) {
+          hit = batch.hit_flags[k];
+        } else {
+          rays++;
+          stat_ray(depth);
+          uint64_t cost_before = 0;
+          if constexpr (stats_enabled) {
+            cost_before = thread_stats().traversal_cost();
+          }
+          hit = world.hit(p.r, interval(0, infinity), batch.hits[k]);
+          if constexpr (stats_enabled) {
+            batch.cost[batch.owners[p.sample]] +=
+                thread_stats().traversal_cost() - cost_before;
+          }
+        }
+        if (!hit) {
+          batch.results[p.sample] += p.throughput * background(p.r);
+        } else {
+          batch.queues[int(batch.hits[k].mat->kind)].push_back(uint32_t(k));
+        }
+      }
+
+      // Shade one material at a time, survivors go to next in queue order
+      batch.next.clear();
+      shade_queue<material>(batch, material_kind::none, depth);
+      shade_queue<lambertian>(batch, material_kind::lambertian, depth);
+      shade_queue<metal>(batch, material_kind::metal, depth);
+      shade_queue<dielectric>(batch, material_kind::dielectric, depth);
+      shade_queue<diffuse_light>(batch, material_kind::emissive, depth);
+      trace_shadows(world, batch, rays);
+      std::swap(batch.paths, batch.next);
+    }
+
+    // Paths still going after max_depth bounces gather no more light
+    batch.paths.clear();
+    batch.packet_ends.clear();
+
+    for (size_t sample = 0; sample < batch.results.size(); sample++) {
+      const colour &c = batch.results[sample];
+      uint32_t local = batch.owners[sample];
+      batch.pixel_colour[local] += c;
+      batch.luminance_sq[local] += luminance(c) * luminance(c);
+    }
+    batch.owners.clear();
+  }
+
+  // Closest hits for the batch's camera rays, a packet at a time, into
+  // hits and hit_flags
+  void intersect_packets(const hittable &world, wavefront_batch &batch,
+                         uint64_t &rays) const {
+    ray_packet packet;
+    packet_hits hits;
+    uint32_t owners[packet_max_rays];
+    batch.hit_flags.assign(batch.paths.size(), 0);
+    uint32_t start = 0;
+    for (uint32_t end : batch.packet_ends) {
+      for (uint32_t k = start; k < end; k++) {
+        owners[packet.count] = batch.owners[batch.paths[k].sample];
+        packet.add(batch.paths[k].r);
+      }
+      trace_packet(world, packet, hits, owners, batch, rays);
+      for (uint32_t k = start; k < end; k++) {
+        if (hits.mask >> (k - start) & 1) {
+          batch.hits[k] = hits.rec[k - start];
+          batch.hit_flags[k] = 1;
+        }
+      }
+      packet.clear();
+      start = end;
+    }
+  }
+
+  // Scatters every path in one material's queue. The call is qualified with
+  // the concrete type so it's direct and can be inlined into the loop.
+  // Diffuse hits queue a shadow ray when there are lights to sample
+  template <typename Material>
+  void shade_queue(wavefront_batch &batch, material_kind kind,
+                   int depth) const {
+    for (uint32_t k : batch.queues[int(kind)]) {
+      wavefront_path &p = batch.paths[k];
+      const hit_record &rec = batch.hits[k];
+      p.gen.start_bounce(depth);
+      if constexpr (std::is_same_v<Material, material> ||
+                    std::is_same_v<Material, diffuse_light>) {
+        if (p.count_emission) {
+          batch.results[p.sample] += p.throughput * emission(rec);
+        }
+      }
+      ray scattered;
+      colour attenuation;
+      bool scatters;
+      if constexpr (std::is_same_v<Material, material>) {
+        scatters = rec.mat->scatter(p.r, rec, attenuation, scattered, p.gen);
+      } else {
+        scatters = static_cast<const Material *>(rec.mat)->Material::scatter(
+            p.r, rec, attenuation, scattered, p.gen);
+      }
+      if (!scatters) {
+        continue;
+      }
+      p.throughput = p.throughput * attenuation;
+      p.count_emission = true;
+      if constexpr (std::is_same_v<Material, lambertian>) {
+        wavefront_shadow shadow;
+        if (!lights.empty() &&
+            sample_direct(p.r, rec, p.throughput, p.gen, shadow.r,
+                          shadow.contribution)) {
+          shadow.sample = p.sample;
+          batch.shadows.push_back(shadow);
+        }
+        p.count_emission = lights.empty();
+      }
+      p.r = scattered;
+      if (survives(p.throughput, depth, p.gen)) {
+        batch.next.push_back(p);
+      }
+    }
+  }
+
+  // Traces the shadow rays queued while shading, adding the light of each
+  // one that gets through
+  void trace_shadows(const hittable &world, wavefront_batch &batch,
+                     uint64_t &rays) const {
+    for (const wavefront_shadow &s : batch.shadows) {
+      rays++;
+      stat_add(stat_counter::shadow_rays);
+      uint64_t cost_before = 0;
+      if constexpr (stats_enabled) {
+        cost_before = thread_stats().traversal_cost();
+      }
+      bool blocked = world.occluded(s.r, interval(0, 1));
+      if constexpr (stats_enabled) {
+        batch.cost[batch.owners[s.sample]] +=
+            thread_stats().traversal_cost() - cost_before;
+      }
+      if (!blocked) {
+        batch.results[s.sample] += s.contribution;
+      }
+    }
+    batch.shadows.clear();
+  }
+
+  // Adds the colour sum and squared luminance sum of a pixel's samples up
+  // to end_sample, then marks it done if it has enough
+  void add_samples(int j, int i, int end_sample, const colour &pixel_colour,
+                   double luminance_sq) {
+    size_t pixel = size_t(i) * image_width + j;
+    sample_sum[pixel] += pixel_colour;
+    luminance_sq_sum[pixel] += luminance_sq;
+    sample_counts[pixel] = end_sample;
+    image.set(j, i, sample_sum[pixel] / sample_counts[pixel]);
+
+    if (end_sample >= samples_per_pixel ||
+        (adaptive && end_sample >= adaptive_min_samples &&
+         relative_error(pixel) <= adaptive_threshold)) {
+      pixel_done[pixel] = 1;
+    }
+  }
+
+  static double luminance(const colour &c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+  }
+
+  // Standard error of the pixel's mean luminance relative to the mean. Dark
+  // pixels are measured against a floor so they don't look endlessly noisy
+  double relative_error(size_t pixel) const {
+    int n = sample_counts[pixel];
+    if (n < 2) {
+      return infinity;
+    }
+    double mean = luminance(sample_sum[pixel]) / n;
+    double variance = std::fmax(
+        0.0, (luminance_sq_sum[pixel] / n - mean * mean) * n / (n - 1));
+    return std::sqrt(variance / n) / std::fmax(mean, 0.01);
+  }
+
+  // Mean relative error over all pixels
+  double estimate_noise() const {
+    double total = 0;
+    size_t counted = 0;
+    for (size_t pixel = 0; pixel < sample_counts.size(); pixel++) {
+      if (sample_counts[pixel] >= 2) {
+        total += relative_error(pixel);
+        counted++;
+      }
+    }
+    return counted > 0 ? total / counted : infinity;
+  }
+
+  double average_samples() const {
+    double total = 0;
+    for (int n : sample_counts) {
+      total += n;
+    }
+    return sample_counts.empty() ? 0 : total / sample_counts.size();
+  }
+
+  // Blue at 0 through green to red at 1
+  static colour heat_colour(double t) {
+    return colour(t, 1.0 - std::fabs(2.0 * t - 1.0), 1.0 - t);
+  }
+
+  // Samples taken per pixel as a fraction of samples_per_pixel, blue for
+  // few through green to red for the full budget
+  void save_sample_heatmap() const {
+    framebuffer heatmap(image_width, image_height);
+    for (int i = 0; i < image_height; i++) {
+      for (int j = 0; j < image_width; j++) {
+        double t = double(sample_counts[size_t(i) * image_width + j]) /
+                   samples_per_pixel;
+        heatmap.set(j, i, heat_colour(t));
+      }
+    }
+    if (!make_image_writer(sample_heatmap_path)
+             ->write(sample_heatmap_path, heatmap)) {
+      std::clog << "Failed to write " << sample_heatmap_path << '\n';
+    }
+  }
+
+  // Box and primitive tests per sample at each pixel. Red is the 99th
+  // percentile so a few pathological pixels don't wash out the rest
+  void save_traversal_heatmap() const {
+    std::vector<double> cost(traversal_cost.size(), 0.0);
+    for (size_t pixel = 0; pixel < cost.size(); pixel++) {
+      if (sample_counts[pixel] > 0) {
+        cost[pixel] = double(traversal_cost[pixel]) / sample_counts[pixel];
+      }
+    }
+    std::vector<double> sorted = cost;
+    size_t rank = sorted.size() * 99 / 100;
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    double scale = sorted.empty() ? 0 : sorted[rank];
+
+    framebuffer heatmap(image_width, image_height);
+    for (int i = 0; i < image_height; i++) {
+      for (int j = 0; j < image_width; j++) {
+        double c = cost[size_t(i) * image_width + j];
+        double t = scale > 0 ? std::fmin(c / scale, 1.0) : 0;
+        heatmap.set(j, i, heat_colour(t));
+      }
+    }
+    std::clog << "Traversal heatmap: red is " << scale
+              << " tests per sample or more\n";
+    if (!make_image_writer(traversal_heatmap_path)
+             ->write(traversal_heatmap_path, heatmap)) {
+      std::clog << "Failed to write " << traversal_heatmap_path << '\n';
+    }
+  }
+
+  void save_image() const {
+    if (!output_path.empty() &&
+        !make_image_writer(output_path)->write(output_path, image)) {
+      std::clog << "Failed to write " << output_path << '\n';
+    }
+  }
+
   void initialise() {
     image_height = int(image_width / aspect_ratio);
     // If lower than 1, set as 1
@@ -146,58 +958,178 @@ private:
     defocus_disk_v = v * defocus_radius;
   }
 
-  ray get_ray(int j, int i) const {
+  // The sampler for one sample of pixel (j, i)
+  sampler pixel_sampler(int j, int i, int sample) const {
+    return sampler(sampling, j, i, uint32_t(sample), uint32_t(frame));
+  }
+
+  ray get_ray(int j, int i, sampler &gen) const {
     // Construct a cmera ray originating from the defocus diskand directed at
     // randomly samped point around pixel location i, j
 
-    auto offset = sample_square();
+    auto offset = sample_square(gen);
     auto pixel_sample = pixel00_loc + ((j + offset.x()) * pixel_delta_u) +
                         ((i + offset.y()) * pixel_delta_v);
 
-    auto ray_orig = (defocus_angle <= 0) ? centre : defocus_disk_sample();
+    auto ray_orig = (defocus_angle <= 0) ? centre : defocus_disk_sample(gen);
     auto ray_dir = pixel_sample - ray_orig;
-    auto ray_time = random_double();
+    auto ray_time = random_double(gen);
 
     return ray(ray_orig, ray_dir, ray_time);
   }
 
-  vec3 sample_square() const {
+  vec3 sample_square(sampler &gen) const {
     // returns the vector to a random opint in the [-.5,-.5]-[+.5,+.5] unit
     // square
-    return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+    sample_2d s = gen.get_2d();
+    return vec3(s.u - 0.5, s.v - 0.5, 0);
   }
 
-  point3 defocus_disk_sample() const {
+  point3 defocus_disk_sample(sampler &gen) const {
     // Returns a random point in the camera defocus disk
-    auto p = random_in_unit_disk();
+    auto p = random_in_unit_disk(gen);
     return centre + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
   }
 
-  colour ray_colour(const ray &r, int depth, const hittable &world) const {
-    // If exceeded the ray bounce limit, no more light is gathered
-    if (depth <= 0) {
+  colour ray_colour(const ray &camera_ray, const hittable &world,
+                    sampler &gen, uint64_t &rays) const {
+    if (max_depth <= 0) {
       return colour(0, 0, 0);
     }
-
+    rays++;
+    stat_ray(0);
     hit_record rec;
-    if (world.hit(r, interval(0.001, infinity), rec)) {
-      //   vec3 dir = random_on_hemisphere(rec.normal);
-      // or
-      // vec3 dir = rec.normal + random_unit_vector();
+    // Scattered rays start just off the surface they leave, see
+    // hit_record::spawn_ray, so no epsilon is needed on t
+    bool hit = world.hit(camera_ray, interval(0, infinity), rec);
+    return continue_path(camera_ray, hit, rec, world, gen, rays);
+  }
 
-      // return 0.9 * ray_colour(ray(rec.p, dir), depth - 1, world);
+  // Iterative path tracer from a camera ray that has already been traced,
+  // hit saying whether it hit rec. throughput is the product of the
+  // attenuations along the path so far
+  colour continue_path(ray r, bool hit, hit_record rec, const hittable &world,
+                       sampler &gen, uint64_t &rays) const {
+    colour throughput(1, 1, 1);
+    colour result(0, 0, 0);
+    bool count_emission = true;
+
+    for (int depth = 0;;) {
+      if (!hit) {
+        return result + throughput * background(r);
+      }
+      if (count_emission) {
+        result += throughput * emission(rec);
+      }
+
+      gen.start_bounce(depth);
       ray scattered;
       colour attenuation;
-      if (rec.mat->scatter(r, rec, attenuation, scattered)) {
-        return attenuation * ray_colour(scattered, depth - 1, world);
+      if (!rec.mat->scatter(r, rec, attenuation, scattered, gen)) {
+        return result;
+      }
+      throughput = throughput * attenuation;
+
+      // The light a diffuse hit gets straight from the lights is added
+      // here, so the bounce mustn't add it again if it hits one
+      count_emission = true;
+      if (rec.mat->kind == material_kind::lambertian && !lights.empty()) {
+        ray shadow;
+        colour contribution;
+        if (sample_direct(r, rec, throughput, gen, shadow, contribution)) {
+          rays++;
+          stat_add(stat_counter::shadow_rays);
+          if (!world.occluded(shadow, interval(0, 1))) {
+            result += contribution;
+          }
+        }
+        count_emission = false;
+      }
+
+      r = scattered;
+      if (!survives(throughput, depth, gen)) {
+        return result;
       }
+
+      // If exceeded the ray bounce limit, no more light is gathered
+      if (++depth >= max_depth) {
+        return result;
+      }
+      rays++;
+      stat_ray(depth);
+      hit = world.hit(r, interval(0, infinity), rec);
+    }
+  }
+
+  // Light given off where a path hits. Of the built in materials only light
+  // sources emit, so the virtual call is left to them and to materials the
+  // integrators don't know
+  static colour emission(const hit_record &rec) {
+    material_kind kind = rec.mat->kind;
+    if ((kind != material_kind::emissive && kind != material_kind::none) ||
+        !rec.front_face) {
       return colour(0, 0, 0);
     }
+    return rec.mat->emitted();
+  }
+
+  // Next event estimation at a diffuse hit that r arrived at. Picks a point
+  // on the lights and sets shadow to the ray towards it and contribution to
+  // the light it brings if nothing is in the way: the radiance times
+  // throughput (which already includes the albedo), the Lambertian 1 / pi
+  // and the geometry term over the sample's density. False if the point
+  // can't light the hit, facing away from it or lying behind the surface
+  bool sample_direct(const ray &r, const hit_record &rec,
+                     const colour &throughput, sampler &gen, ray &shadow,
+                     colour &contribution) const {
+    light_sample s = lights.sample(r.time(), gen);
+    vec3 to_light = s.p - rec.p;
+    real dist_sq = to_light.length_squared();
+    if (!(dist_sq > 0)) {
+      return false;
+    }
+    vec3 dir = to_light / std::sqrt(dist_sq);
+    real cos_surface = dot(rec.normal, dir);
+    real cos_light = -dot(s.normal, dir);
+    if (cos_surface <= 0 || cos_light <= 0) {
+      return false;
+    }
+
+    // Aimed just off the light on the side facing the hit, so the light
+    // itself can't block the ray
+    shadow = rec.spawn_ray_to(offset_ray_origin(s.p, s.p_error, s.normal),
+                              r.time());
+    contribution = throughput * s.radiance *
+                   (cos_surface * cos_light * lights.total_area() /
+                    (pi * dist_sq));
+    return true;
+  }
 
+  colour background(const ray &r) const {
+    if (!sky) {
+      return colour(0, 0, 0);
+    }
     vec3 unit_dir = unit_vector(r.direction());
     auto a = 0.5 * (unit_dir.y() + 1.0);
     return (1.0 - a) * colour(1.0, 1.0, 1.0) + a * colour(0.5, 0.7, 1.0);
   }
+
+  // Russian roulette after the bounce at depth, dim paths are likely to be
+  // terminated and the survivors are scaled up so the estimate stays
+  // unbiased
+  bool survives(colour &throughput, int depth, sampler &gen) const {
+    if (depth + 1 < min_bounces) {
+      return true;
+    }
+    auto survive = std::fmin(
+        std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z())),
+        0.95);
+    if (random_double(gen) >= survive) {
+      return false;
+    }
+    throughput /= survive;
+    return true;
+  }
 };
 
 #endif
\ No newline at end of file
@@ -4,8 +4,6 @@
 #include "vec3.h"
 #include "interval.h"
 
-#include <ostream>
-
 using colour = vec3;
 
 inline double linear_to_gamma(double linear_component)
@@ -16,7 +14,8 @@ inline double linear_to_gamma(double linear_component)
     return 0;
 } 
 
-void write_colour(std::ostream& out, const colour& pixel_colour) {
+// Converts a linear colour to gamma corrected 8 bit RGB
+inline void colour_to_bytes(const colour& pixel_colour, unsigned char* out) {
     auto r = pixel_colour.x();
     auto g = pixel_colour.y();
     auto b = pixel_colour.z();
@@ -26,11 +25,9 @@ void write_colour(std::ostream& out, const colour& pixel_colour) {
     b = linear_to_gamma(b);
 
     static const interval intensity(0.000, 0.999);
-    int rbyte = int(256 * intensity.clamp(r));
-    int gbyte = int(256 * intensity.clamp(g));
-    int bbyte = int(256 * intensity.clamp(b));
-
-    out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
+    out[0] = (unsigned char)(256 * intensity.clamp(r));
+    out[1] = (unsigned char)(256 * intensity.clamp(g));
+    out[2] = (unsigned char)(256 * intensity.clamp(b));
 }
 
 
@@ -0,0 +1,41 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "colour.h"
+
+#include <vector>
+
+// Flat linear RGB float image, rows top to bottom. Pixels are written
+// straight from the render threads, nothing is formatted until the image is
+// saved
+class framebuffer {
+public:
+  framebuffer() {}
+
+  framebuffer(int width, int height)
+      : w(width), h(height), pixels(size_t(width) * height * 3, 0.0f) {}
+
+  int width() const { return w; }
+  int height() const { return h; }
+
+  void set(int x, int y, const colour &c) {
+    float *p = &pixels[(size_t(y) * w + x) * 3];
+    p[0] = float(c.x());
+    p[1] = float(c.y());
+    p[2] = float(c.z());
+  }
+
+  colour get(int x, int y) const {
+    const float *p = &pixels[(size_t(y) * w + x) * 3];
+    return colour(p[0], p[1], p[2]);
+  }
+
+  const float *data() const { return pixels.data(); }
+
+private:
+  int w = 0;
+  int h = 0;
+  std::vector<float> pixels;
+};
+
+#endif
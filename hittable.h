@@ -3,19 +3,26 @@
 
 
 #include "aabb.h"
+#include "ray_packet.h"
 // This is not needed, I just don't like how VSCode lists it as an error otherwise
 #include "rtweekend.h"
 
 class material;
+class light_list;
 
 class hit_record{
     public:
         point3 p;
         vec3 normal;
-        shared_ptr<material> mat;
-        double t;
+        // Non-owning, the primitive that was hit keeps the material alive.
+        // A raw pointer keeps refcount traffic off the per ray path
+        const material* mat;
+        real t;
         bool front_face;
-        
+        // Bound on the absolute error in each coordinate of p, set by the
+        // primitive from how it computed p. Zero means only rounding of p
+        real p_error = 0;
+
         void set_face_normal(const ray& r, const vec3& outward_normal){
             // Set the hit normal vec
             // NOTE: the param 'outward_norm' is assumed to have a unit length
@@ -23,6 +30,35 @@ class hit_record{
             front_face = dot(r.direction(), outward_normal) < 0;
             normal = front_face ? outward_normal : -outward_normal;
         }
+
+        // Ray leaving the hit in direction dir, started just off the surface
+        // on the side dir points to so it can't hit the surface again
+        ray spawn_ray(const vec3& dir, real time) const {
+            vec3 side = dot(dir, normal) > 0 ? normal : -normal;
+            return ray(offset_ray_origin(p, p_error, side), dir, time);
+        }
+
+        // Ray from just off the surface towards target, reaching it at t = 1
+        ray spawn_ray_to(const point3& target, real time) const {
+            vec3 side = dot(target - p, normal) > 0 ? normal : -normal;
+            point3 from = offset_ray_origin(p, p_error, side);
+            return ray(from, target - from, time);
+        }
+};
+
+// Closest hits so far for each ray of a packet. A ray's interval shrinks
+// to its closest hit, and its bit in mask is set once it has hit anything
+struct packet_hits {
+    interval t[packet_max_rays];
+    hit_record rec[packet_max_rays];
+    uint64_t mask = 0;
+
+    void reset(int count, interval ray_t) {
+        for (int k = 0; k < count; k++) {
+            t[k] = ray_t;
+        }
+        mask = 0;
+    }
 };
 
 class hittable {
@@ -31,7 +67,38 @@ class hittable {
 
         virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
 
+        // Closest hits for a whole packet, each ray searching its own
+        // interval in hits. Objects with a BVH override this to traverse it
+        // once for the packet, everything else takes the rays one at a time
+        virtual void hit_packet(const ray_packet& packet, packet_hits& hits) const {
+            for (int k = 0; k < packet.count; k++) {
+                if (hit(packet.rays[k], hits.t[k], hits.rec[k])) {
+                    hits.t[k].max = hits.rec[k].t;
+                    hits.mask |= uint64_t(1) << k;
+                }
+            }
+        }
+
+        // Whether anything is hit within ray_t, for shadow rays. Objects
+        // with a BVH override this to stop at the first hit they find
+        // rather than search on for the closest
+        virtual bool occluded(const ray& r, interval ray_t) const {
+            hit_record rec;
+            return hit(r, ray_t, rec);
+        }
+
         virtual aabb bounding_box() const = 0;
+
+        // Adds every emissive primitive to lights, so the integrator can
+        // sample them directly. Objects that can't emit add nothing
+        virtual void add_lights(light_list& /*lights*/) const {}
+
+        // For objects that move during the shutter: boxes at time 0 and
+        // time 1 whose interpolation bounds the object at any time between.
+        // Returns false for objects that don't move
+        virtual bool motion_bounds(aabb& /*start*/, aabb& /*end*/) const {
+            return false;
+        }
 };
 
 #endif
\ No newline at end of file
@@ -25,20 +25,41 @@ class hittable_list : public hittable {
         }
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            hit_record temp_rec;
             bool hit_anything = false;
             auto closest = ray_t.max;
 
+            // Objects only write rec when they find a hit inside the interval,
+            // which shrinks to the closest hit so far, so no temp copy needed
             for(const auto& object : objects) {
-                if(object->hit(r, interval(ray_t.min, closest), temp_rec)) {
+                if(object->hit(r, interval(ray_t.min, closest), rec)) {
                     hit_anything = true;
-                    closest = temp_rec.t;
-                    rec = temp_rec;
+                    closest = rec.t;
                 }
             }
             return hit_anything;
         }
 
+        void hit_packet(const ray_packet& packet, packet_hits& hits) const override {
+            for(const auto& object : objects) {
+                object->hit_packet(packet, hits);
+            }
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            for(const auto& object : objects) {
+                if (object->occluded(r, ray_t)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void add_lights(light_list& lights) const override {
+            for(const auto& object : objects) {
+                object->add_lights(lights);
+            }
+        }
+
         aabb bounding_box() const override {return bbox; }
     private:
         aabb bbox;
@@ -0,0 +1,371 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+class image_writer {
+public:
+  virtual ~image_writer() = default;
+
+  // Returns false if the file could not be written
+  virtual bool write(const std::string &path, const framebuffer &image) const = 0;
+
+protected:
+  static std::vector<unsigned char> to_bytes(const framebuffer &image) {
+    std::vector<unsigned char> bytes(size_t(image.width()) * image.height() * 3);
+    for (int y = 0; y < image.height(); y++) {
+      for (int x = 0; x < image.width(); x++) {
+        colour_to_bytes(image.get(x, y),
+                        &bytes[(size_t(y) * image.width() + x) * 3]);
+      }
+    }
+    return bytes;
+  }
+};
+
+// Binary 8 bit PPM
+class ppm_writer : public image_writer {
+public:
+  bool write(const std::string &path, const framebuffer &image) const override {
+    std::ofstream out(path, std::ios::binary);
+    out << "P6\n" << image.width() << ' ' << image.height() << "\n255\n";
+    auto bytes = to_bytes(image);
+    out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    return bool(out);
+  }
+};
+
+// Portable float map, linear HDR values with no gamma or clamping
+class pfm_writer : public image_writer {
+public:
+  bool write(const std::string &path, const framebuffer &image) const override {
+    std::ofstream out(path, std::ios::binary);
+    // A negative scale marks the data as little endian
+    out << "PF\n" << image.width() << ' ' << image.height() << "\n-1.0\n";
+
+    // PFM rows run bottom to top
+    size_t row_size = size_t(image.width()) * 3;
+    for (int y = image.height() - 1; y >= 0; y--) {
+      const float *row = image.data() + y * row_size;
+      if (is_little_endian()) {
+        out.write(reinterpret_cast<const char *>(row), row_size * sizeof(float));
+      } else {
+        for (size_t i = 0; i < row_size; i++) {
+          uint32_t bits;
+          std::memcpy(&bits, &row[i], sizeof(bits));
+          bits = __builtin_bswap32(bits);
+          out.write(reinterpret_cast<const char *>(&bits), sizeof(bits));
+        }
+      }
+    }
+    return bool(out);
+  }
+
+private:
+  static bool is_little_endian() {
+    uint16_t one = 1;
+    unsigned char first;
+    std::memcpy(&first, &one, 1);
+    return first == 1;
+  }
+};
+
+// 8 bit RGB PNG with a small built in encoder: per row filter selection,
+// greedy LZ77 with a hash table and fixed Huffman codes. Not as tight as
+// zlib but far smaller than PPM and needs no dependency
+class png_writer : public image_writer {
+public:
+  bool write(const std::string &path, const framebuffer &image) const override {
+    int width = image.width();
+    int height = image.height();
+    auto bytes = to_bytes(image);
+
+    std::vector<unsigned char> filtered = filter_rows(bytes, width, height);
+    std::vector<unsigned char> compressed = zlib_compress(filtered);
+
+    std::vector<unsigned char> header;
+    put_u32(header, uint32_t(width));
+    put_u32(header, uint32_t(height));
+    header.push_back(8); // bit depth
+    header.push_back(2); // colour type, RGB
+    header.push_back(0); // compression
+    header.push_back(0); // filter method
+    header.push_back(0); // no interlace
+
+    std::ofstream out(path, std::ios::binary);
+    static const unsigned char signature[8] = {0x89, 'P',  'N',  'G',
+                                               '\r', '\n', 0x1a, '\n'};
+    out.write(reinterpret_cast<const char *>(signature), 8);
+    write_chunk(out, "IHDR", header);
+    write_chunk(out, "IDAT", compressed);
+    write_chunk(out, "IEND", {});
+    return bool(out);
+  }
+
+private:
+  static void put_u32(std::vector<unsigned char> &out, uint32_t v) {
+    out.push_back((v >> 24) & 0xff);
+    out.push_back((v >> 16) & 0xff);
+    out.push_back((v >> 8) & 0xff);
+    out.push_back(v & 0xff);
+  }
+
+  static uint32_t crc32(const unsigned char *data, size_t size, uint32_t crc) {
+    static const auto table = [] {
+      std::vector<uint32_t> t(256);
+      for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+          c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        t[n] = c;
+      }
+      return t;
+    }();
+
+    for (size_t i = 0; i < size; i++) {
+      crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+  }
+
+  static void write_chunk(std::ofstream &out, const char *type,
+                          const std::vector<unsigned char> &data) {
+    std::vector<unsigned char> length;
+    put_u32(length, uint32_t(data.size()));
+    out.write(reinterpret_cast<const char *>(length.data()), 4);
+
+    uint32_t crc = crc32(reinterpret_cast<const unsigned char *>(type), 4,
+                         0xffffffffu);
+    crc = crc32(data.data(), data.size(), crc) ^ 0xffffffffu;
+
+    out.write(type, 4);
+    out.write(reinterpret_cast<const char *>(data.data()), data.size());
+    std::vector<unsigned char> crc_bytes;
+    put_u32(crc_bytes, crc);
+    out.write(reinterpret_cast<const char *>(crc_bytes.data()), 4);
+  }
+
+  static unsigned char paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return (unsigned char)a;
+    if (pb <= pc) return (unsigned char)b;
+    return (unsigned char)c;
+  }
+
+  // Tries every PNG filter on each row and keeps the one with the smallest
+  // sum of absolute (signed) residuals, the usual heuristic
+  static std::vector<unsigned char>
+  filter_rows(const std::vector<unsigned char> &bytes, int width, int height) {
+    const size_t stride = size_t(width) * 3;
+    std::vector<unsigned char> out;
+    out.reserve((stride + 1) * height);
+    std::vector<unsigned char> candidate(stride), best(stride);
+
+    for (int y = 0; y < height; y++) {
+      const unsigned char *row = &bytes[y * stride];
+      const unsigned char *prev = y > 0 ? &bytes[(y - 1) * stride] : nullptr;
+
+      long best_score = -1;
+      unsigned char best_filter = 0;
+      for (unsigned char filter = 0; filter < 5; filter++) {
+        long score = 0;
+        for (size_t i = 0; i < stride; i++) {
+          int a = i >= 3 ? row[i - 3] : 0;
+          int b = prev ? prev[i] : 0;
+          int c = (prev && i >= 3) ? prev[i - 3] : 0;
+          int predicted = 0;
+          switch (filter) {
+          case 1: predicted = a; break;
+          case 2: predicted = b; break;
+          case 3: predicted = (a + b) / 2; break;
+          case 4: predicted = paeth(a, b, c); break;
+          }
+          candidate[i] = (unsigned char)(row[i] - predicted);
+          score += std::abs((signed char)candidate[i]);
+        }
+        if (best_score < 0 || score < best_score) {
+          best_score = score;
+          best_filter = filter;
+          best.swap(candidate);
+        }
+      }
+
+      out.push_back(best_filter);
+      out.insert(out.end(), best.begin(), best.end());
+    }
+    return out;
+  }
+
+  class bit_writer {
+  public:
+    std::vector<unsigned char> bytes;
+
+    void put(uint32_t bits, int count) {
+      buffer |= uint64_t(bits) << filled;
+      filled += count;
+      while (filled >= 8) {
+        bytes.push_back((unsigned char)(buffer & 0xff));
+        buffer >>= 8;
+        filled -= 8;
+      }
+    }
+
+    // Huffman codes are defined most significant bit first
+    void put_code(uint32_t code, int length) {
+      uint32_t reversed = 0;
+      for (int i = 0; i < length; i++) {
+        reversed |= ((code >> i) & 1) << (length - 1 - i);
+      }
+      put(reversed, length);
+    }
+
+    void flush() {
+      if (filled > 0) {
+        bytes.push_back((unsigned char)(buffer & 0xff));
+      }
+      buffer = 0;
+      filled = 0;
+    }
+
+  private:
+    uint64_t buffer = 0;
+    int filled = 0;
+  };
+
+  static void put_literal(bit_writer &bits, int symbol) {
+    if (symbol < 144) {
+      bits.put_code(0x30 + symbol, 8);
+    } else if (symbol < 256) {
+      bits.put_code(0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+      bits.put_code(symbol - 256, 7);
+    } else {
+      bits.put_code(0xc0 + symbol - 280, 8);
+    }
+  }
+
+  static void put_match(bit_writer &bits, int length, int distance) {
+    static const int length_base[29] = {3,  4,  5,  6,   7,   8,   9,   10,
+                                        11, 13, 15, 17,  19,  23,  27,  31,
+                                        35, 43, 51, 59,  67,  83,  99,  115,
+                                        131, 163, 195, 227, 258};
+    static const int length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                         1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                         4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const int dist_base[30] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,   25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513,  769,
+        1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const int dist_extra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                       4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                       9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+    int lc = 28;
+    while (length_base[lc] > length) lc--;
+    put_literal(bits, 257 + lc);
+    bits.put(length - length_base[lc], length_extra[lc]);
+
+    int dc = 29;
+    while (dist_base[dc] > distance) dc--;
+    bits.put_code(dc, 5);
+    bits.put(distance - dist_base[dc], dist_extra[dc]);
+  }
+
+  static std::vector<unsigned char>
+  zlib_compress(const std::vector<unsigned char> &data) {
+    constexpr int window = 32768;
+    constexpr int min_match = 3;
+    constexpr int max_match = 258;
+    constexpr int hash_bits = 15;
+
+    bit_writer bits;
+    bits.bytes.reserve(data.size() / 2);
+    bits.bytes.push_back(0x78); // deflate, 32K window
+    bits.bytes.push_back(0x01);
+
+    // One final block with the fixed Huffman tables
+    bits.put(1, 1);
+    bits.put(1, 2);
+
+    std::vector<int> head(size_t(1) << hash_bits, -1);
+    const size_t n = data.size();
+    size_t i = 0;
+    while (i < n) {
+      int best_length = 0;
+      int best_distance = 0;
+
+      if (i + min_match <= n) {
+        uint32_t h = ((data[i] << 16) | (data[i + 1] << 8) | data[i + 2]) *
+                     2654435761u >> (32 - hash_bits);
+        int candidate = head[h];
+        head[h] = int(i);
+
+        if (candidate >= 0 && int(i) - candidate <= window) {
+          size_t limit = std::min(n - i, size_t(max_match));
+          size_t length = 0;
+          while (length < limit && data[candidate + length] == data[i + length]) {
+            length++;
+          }
+          if (length >= size_t(min_match)) {
+            best_length = int(length);
+            best_distance = int(i) - candidate;
+          }
+        }
+      }
+
+      if (best_length > 0) {
+        put_match(bits, best_length, best_distance);
+        // Keep the hash table up to date over the matched bytes too
+        for (size_t k = i + 1; k < i + best_length && k + min_match <= n; k++) {
+          uint32_t h = ((data[k] << 16) | (data[k + 1] << 8) | data[k + 2]) *
+                       2654435761u >> (32 - hash_bits);
+          head[h] = int(k);
+        }
+        i += best_length;
+      } else {
+        put_literal(bits, data[i]);
+        i++;
+      }
+    }
+
+    put_literal(bits, 256);
+    bits.flush();
+
+    uint32_t a = 1, b = 0;
+    for (unsigned char byte : data) {
+      a = (a + byte) % 65521;
+      b = (b + a) % 65521;
+    }
+    put_u32(bits.bytes, (b << 16) | a);
+    return bits.bytes;
+  }
+};
+
+// Picks a writer from the file extension, PPM if it is not recognised
+inline std::unique_ptr<image_writer> make_image_writer(const std::string &path) {
+  auto ends_with = [&](const std::string &ext) {
+    return path.size() >= ext.size() &&
+           path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+  };
+
+  if (ends_with(".png")) {
+    return std::make_unique<png_writer>();
+  }
+  if (ends_with(".pfm")) {
+    return std::make_unique<pfm_writer>();
+  }
+  return std::make_unique<ppm_writer>();
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.h"
+#include "lights.h"
+#include "rtweekend.h"
+#include "transform.h"
+
+// One placement of a shared prototype, e.g. a triangle_mesh or sphere_set
+// with its own BVH. Only the pointer and the transforms are stored per copy,
+// so a thousand trees cost one tree's geometry. Rays are moved into object
+// space rather than the geometry into world space. Put the instances in a
+// bvh_node to get a two level BVH: the top level over the instance boxes,
+// the bottom level inside each prototype
+class instance : public hittable {
+public:
+  instance(shared_ptr<hittable> prototype, const transform &object_to_world)
+      : prototype(prototype), object_to_world(object_to_world),
+        world_to_object(object_to_world.inverse()),
+        bbox(object_to_world.apply_box(prototype->bounding_box())) {}
+
+  bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+    // The direction isn't renormalised, so t means the same in both spaces
+    // and ray_t can be passed straight through
+    ray local(world_to_object.apply_point(r.origin()),
+              world_to_object.apply_vector(r.direction()), r.time());
+    if (!prototype->hit(local, ray_t, rec)) {
+      return false;
+    }
+
+    rec.p_error = object_to_world.point_error(rec.p, rec.p_error);
+    rec.p = object_to_world.apply_point(rec.p);
+    // Normals go by the inverse transpose. The sign of dot(direction,
+    // normal) is the same in both spaces, so front_face still holds
+    rec.normal = unit_vector(world_to_object.apply_transposed(rec.normal));
+    return true;
+  }
+
+  bool occluded(const ray &r, interval ray_t) const override {
+    ray local(world_to_object.apply_point(r.origin()),
+              world_to_object.apply_vector(r.direction()), r.time());
+    return prototype->occluded(local, ray_t);
+  }
+
+  aabb bounding_box() const override { return bbox; }
+
+  // The prototype's lights moved to where this copy is, see
+  // light_list::add for the limits on spheres
+  void add_lights(light_list &lights) const override {
+    light_list local;
+    prototype->add_lights(local);
+    lights.add(local, object_to_world);
+  }
+
+  // Moves the instance, e.g. between animation frames. The prototype is
+  // untouched, only a BVH over the instances needs a refit
+  void set_transform(const transform &to_world) {
+    object_to_world = to_world;
+    world_to_object = to_world.inverse();
+    bbox = to_world.apply_box(prototype->bounding_box());
+  }
+
+  const shared_ptr<hittable> &prototype_object() const { return prototype; }
+  const transform &object_transform() const { return object_to_world; }
+
+private:
+  shared_ptr<hittable> prototype;
+  transform object_to_world;
+  transform world_to_object;
+  aabb bbox;
+};
+
+#endif
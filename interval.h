@@ -4,11 +4,11 @@
 #include "rtweekend.h"
 class interval{
     public:
-        double min, max;
+        real min, max;
 
         interval() : min(+infinity), max(-infinity) {} // Default is empty
 
-        interval(double min, double max) : min(min), max(max) {}
+        interval(real min, real max) : min(min), max(max) {}
 
         interval(const interval& a, const interval& b){
             // Create the interval tightly enclosing the two input intervals
@@ -16,25 +16,25 @@ class interval{
             max = a.max >= b.max ? a.max : b.max;
         }
 
-        double size() const {
+        real size() const {
             return max - min;
         }
 
-        double contains(double x) const {
+        bool contains(real x) const {
             return min <= x && x <= max;
         }
 
-        double surrounds(double x) const {
+        bool surrounds(real x) const {
             return min < x && x < max;
         }
 
-        double clamp(double x) const {
+        real clamp(real x) const {
             if (x > max) return max;
             if (x < min) return min;
             return x;
         }
 
-        interval expand(double delta) const {
+        interval expand(real delta) const {
             auto padding = delta / 2;
             return interval(min - padding, max + padding);
         }
@@ -0,0 +1,135 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "rtweekend.h"
+#include "sampler.h"
+#include "transform.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// A point picked on one of the lights, for a shadow ray to aim at
+struct light_sample {
+  point3 p;
+  vec3 normal; // unit, on the side the light emits from
+  real p_error; // bound on the error in p, as hit_record::p_error
+  colour radiance;
+};
+
+// Every emissive sphere and triangle in a scene, gathered with
+// hittable::add_lights. sample() picks a light with probability
+// proportional to its area, then a point uniformly on it, so every point
+// on every light is equally likely and the density of a sample is
+// 1 / total_area() per unit area
+class light_list {
+public:
+  void clear() {
+    lights.clear();
+    cumulative.clear();
+  }
+
+  // Emits outwards. The centre moves by motion over the shutter
+  void add_sphere(const point3 &centre, const vec3 &motion, real radius,
+                  const colour &radiance) {
+    add_light({centre, motion, vec3(), vec3(), radius, radiance},
+              4 * pi * radius * radius);
+  }
+
+  // Emits from the side cross(edge1, edge2) points to, which is the front
+  // face a ray sees when it hits the triangle
+  void add_triangle(const point3 &v0, const vec3 &edge1, const vec3 &edge2,
+                    const colour &radiance) {
+    add_light({v0, vec3(), edge1, edge2, 0, radiance},
+              0.5 * cross(edge1, edge2).length());
+  }
+
+  // Adds the lights of other moved by to_world, for an instance. Sphere
+  // radii are scaled by the transform's mean scale, which is exact for
+  // rotations, translations and uniform scales only
+  void add(const light_list &other, const transform &to_world) {
+    real det = to_world.determinant();
+    real scale = std::cbrt(std::fabs(det));
+    for (const light &l : other.lights) {
+      if (l.radius > 0) {
+        add_sphere(to_world.apply_point(l.origin),
+                   to_world.apply_vector(l.motion), l.radius * scale,
+                   l.radiance);
+        continue;
+      }
+      // A mirroring transform flips the winding, swapping the edges keeps
+      // the light facing the way the instance's hits see it
+      vec3 edge1 = to_world.apply_vector(l.edge1);
+      vec3 edge2 = to_world.apply_vector(l.edge2);
+      add_triangle(to_world.apply_point(l.origin), det < 0 ? edge2 : edge1,
+                   det < 0 ? edge1 : edge2, l.radiance);
+    }
+  }
+
+  bool empty() const { return lights.empty(); }
+  size_t size() const { return lights.size(); }
+  real total_area() const { return cumulative.empty() ? 0 : cumulative.back(); }
+
+  // A point on the lights as they are at time. Must not be called on an
+  // empty list
+  light_sample sample(real time, sampler &gen) const {
+    real pick = random_double(gen) * total_area();
+    size_t index = std::upper_bound(cumulative.begin(), cumulative.end(),
+                                    pick) -
+                   cumulative.begin();
+    const light &l = lights[std::min(index, lights.size() - 1)];
+
+    constexpr real eps = std::numeric_limits<real>::epsilon();
+    light_sample s;
+    s.radiance = l.radiance;
+    real extent = 0;
+    if (l.radius > 0) {
+      point3 centre = l.origin + time * l.motion;
+      s.normal = random_unit_vector(gen);
+      s.p = centre + l.radius * s.normal;
+      extent = std::max({std::fabs(centre.x()), std::fabs(centre.y()),
+                         std::fabs(centre.z())}) +
+               l.radius;
+    } else {
+      // The square root warp of a unit square onto the triangle keeps the
+      // points uniform (Osada et al., "Shape distributions", 2002)
+      sample_2d uv = gen.get_2d();
+      real su = std::sqrt(real(uv.u));
+      real v = uv.v;
+      s.p = l.origin + su * (1 - v) * l.edge1 + su * v * l.edge2;
+      s.normal = unit_vector(cross(l.edge1, l.edge2));
+      for (int axis = 0; axis < 3; axis++) {
+        extent = std::max(extent, std::fabs(l.origin[axis]) +
+                                      std::fabs(l.edge1[axis]) +
+                                      std::fabs(l.edge2[axis]));
+      }
+    }
+    s.p_error = 8 * eps * extent;
+    return s;
+  }
+
+private:
+  struct light {
+    point3 origin; // sphere centre at time 0, or the triangle's first vertex
+    vec3 motion;   // spheres only
+    vec3 edge1, edge2; // triangles only
+    real radius;   // 0 for a triangle
+    colour radiance;
+  };
+
+  std::vector<light> lights;
+  // Running total of the light areas, searched to pick a light
+  std::vector<real> cumulative;
+
+  // Lights with no area can never be hit, so they are left out
+  void add_light(const light &l, real area) {
+    if (!(area > 0)) {
+      return;
+    }
+    lights.push_back(l);
+    cumulative.push_back(total_area() + area);
+  }
+};
+
+#endif
@@ -5,74 +5,140 @@
 #include "hittable.h"
 #include "hittable_list.h"
 #include "material.h"
+#include "mesh_loader.h"
+#include "scene_cache.h"
+#include "scenes.h"
 #include "sphere.h"
+#include "sphere_set.h"
 #include "tetrahedron.h"
 #include "triangle.h"
+#include "triangle_mesh.h"
 #include "vec3.h"
+#include <chrono>
 #include <memory>
+#include <sys/stat.h>
 
-int main() {
-  hittable_list world;
+// Bump whenever build_scene, random_spheres or random_spheres_view changes
+// what it builds from the inputs scene_key hashes, so old caches are rebuilt
+constexpr uint32_t scene_version = 1;
+
+static bvh_build_options scene_bvh_options() {
+  // Swap in bvh_split::median to compare against the old object median build,
+  // and width 2/4/8 to compare binary and wide traversal
+  bvh_build_options bvh_options;
+  bvh_options.split = bvh_split::sah;
+  bvh_options.width = 8;
+  return bvh_options;
+}
+
+// Builds the scene into world and cam, adding each object to cache as well.
+// False if the mesh can't be loaded
+static bool build_scene(hittable_list &world, camera &cam,
+                        scene_cache_writer &cache, const char *mesh_path) {
+  auto spheres = random_spheres();
+
+  bvh_build_options bvh_options = scene_bvh_options();
+  spheres->build(bvh_options);
+  spheres->build_stats().print(std::clog);
+  world.add(spheres);
+  cache.add(*spheres);
 
-  auto ground_material = make_shared<lambertian>(colour(0.5, 0.5, 0.5));
-  world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
-
-  // The loop for small random spheres and tetrahedrons
-  for (int a = -11; a < 11; a++) {
-    for (int b = -11; b < 11; b++) {
-      auto choose_mat = random_double();
-      point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
-
-      if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-        shared_ptr<material> object_material;
-
-        if (choose_mat < 0.75) {
-          // diffuse sphere
-          auto albedo = colour::random() * colour::random();
-          object_material = make_shared<lambertian>(albedo);
-          auto centre2 = center + vec3(0, random_double(0, .5), 0);
-          world.add(make_shared<sphere>(center, centre2, 0.2, object_material));
-        } else if (choose_mat < 0.9) {
-          // metal sphere
-          auto albedo = colour::random(0.5, 1);
-          auto fuzz = random_double(0, 0.5);
-          object_material = make_shared<metal>(albedo, fuzz);
-          world.add(make_shared<sphere>(center, 0.2, object_material));
-        } else {
-          // glass sphere
-          object_material = make_shared<dielectric>(1.5);
-          world.add(make_shared<sphere>(center, 0.2, object_material));
-        } 
-      }
+  // An OBJ or binary PLY mesh named on the command line is added as is
+  if (mesh_path) {
+    mesh_load_stats load_stats;
+    auto buffers = load_mesh(mesh_path, &load_stats);
+    if (!buffers) {
+      return false;
     }
+    load_stats.print(std::clog);
+
+    auto mesh_material = make_shared<lambertian>(colour(0.7, 0.7, 0.7));
+    auto mesh = make_shared<triangle_mesh>(buffers, mesh_material, bvh_options);
+    mesh->build_stats().print(std::clog);
+    world.add(mesh);
+    cache.add(*mesh);
   }
 
-  // The three large spheres
-  auto material1 = make_shared<dielectric>(1.5);
-  world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+  random_spheres_view(cam);
+  return true;
+}
 
-  auto material2 = make_shared<lambertian>(colour(0.4, 0.2, 0.1));
-  world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+// Key for the scene cache, from everything build_scene builds from: the
+// scene version, the sphere settings, the BVH options, the camera and the
+// mesh file's path, size and modification time. Rebuilding the program
+// keeps the cache unless one of these changed
+static uint64_t scene_key(const char *mesh_path) {
+  cache_hash scene;
+  scene.add(scene_version);
 
-  auto material3 = make_shared<metal>(colour(0.7, 0.6, 0.5), 0.0);
-  world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+  random_spheres_settings spheres;
+  scene.add(spheres.seed);
+  scene.add(spheres.stream);
+  scene.add(int32_t(spheres.grid));
 
-  world = hittable_list(make_shared<bvh_node>(world));
+  bvh_build_options bvh_options = scene_bvh_options();
+  scene.add(uint32_t(bvh_options.split));
+  scene.add(int32_t(bvh_options.max_leaf_size));
+  scene.add(int32_t(bvh_options.bins));
+  scene.add(bvh_options.traversal_cost);
+  scene.add(bvh_options.intersection_cost);
+  scene.add(int32_t(bvh_options.width));
+  scene.add(bvh_options.motion_traversal_cost);
 
-  camera cam;
+  camera view;
+  random_spheres_view(view);
+  scene.add(view.aspect_ratio);
+  scene.add(int32_t(view.image_width));
+  scene.add(int32_t(view.samples_per_pixel));
+  scene.add(int32_t(view.max_depth));
+  scene.add(view.vfov);
+  scene.add(view.lookfrom);
+  scene.add(view.lookat);
+  scene.add(view.vup);
+  scene.add(view.defocus_angle);
+  scene.add(view.focus_dist);
 
-  cam.aspect_ratio = 16.0 / 9.0;
-  cam.image_width = 1920;
-  cam.samples_per_pixel = 100;
-  cam.max_depth = 50;
+  if (mesh_path) {
+    scene.add(std::string(mesh_path));
+    struct stat info;
+    if (stat(mesh_path, &info) == 0) {
+      scene.add(int64_t(info.st_size));
+      scene.add(int64_t(info.st_mtime));
+    }
+  }
+  return scene_cache_key(scene);
+}
+
+int main(int argc, char *argv[]) {
+  const char *mesh_path = argc > 1 ? argv[1] : nullptr;
+
+  uint64_t key = scene_key(mesh_path);
+  const std::string cache_path = "scene.cache";
 
-  cam.vfov = 20;
-  cam.lookfrom = point3(13, 2, 3);
-  cam.lookat = point3(0, 0, 0);
-  cam.vup = vec3(0, 1, 0);
+  hittable_list world;
+  camera cam;
+  auto start_time = std::chrono::steady_clock::now();
+  auto elapsed_ms = [&] {
+    auto end_time = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end_time - start_time)
+        .count();
+  };
+
+  if (load_scene_cache(cache_path, key, world, cam)) {
+    std::clog << "Loaded scene from " << cache_path << " in " << elapsed_ms()
+              << " ms\n";
+  } else {
+    scene_cache_writer cache;
+    if (!build_scene(world, cam, cache, mesh_path)) {
+      return 1;
+    }
+    std::clog << "Built scene in " << elapsed_ms() << " ms\n";
+    if (!cache.save(cache_path, key, cam)) {
+      std::clog << "Failed to write " << cache_path << '\n';
+    }
+  }
 
-  cam.defocus_angle = 0.8;
-  cam.focus_dist = 10.0; 
+  cam.output_path = "output.png";
 
   cam.render(world);
 }
@@ -0,0 +1,77 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A whole file mapped read only into memory. Pages are brought in by the OS
+// as they are touched, so parsers read straight from the page cache without
+// copying the file into a buffer first
+class mapped_file {
+public:
+  mapped_file() {}
+
+  explicit mapped_file(const std::string &path) { open(path); }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  ~mapped_file() { close(); }
+
+  bool open(const std::string &path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      ::close(fd);
+      return false;
+    }
+
+    length = size_t(info.st_size);
+    if (length > 0) {
+      void *mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped == MAP_FAILED) {
+        ::close(fd);
+        length = 0;
+        return false;
+      }
+      bytes = static_cast<const char *>(mapped);
+      // Parsers walk the file front to back
+      madvise(mapped, length, MADV_SEQUENTIAL);
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    ::close(fd);
+    opened = true;
+    return true;
+  }
+
+  void close() {
+    if (bytes) {
+      munmap(const_cast<char *>(bytes), length);
+    }
+    bytes = nullptr;
+    length = 0;
+    opened = false;
+  }
+
+  bool is_open() const { return opened; }
+  const char *data() const { return bytes; }
+  size_t size() const { return length; }
+
+private:
+  const char *bytes = nullptr;
+  size_t length = 0;
+  bool opened = false;
+};
+
+#endif
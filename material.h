@@ -3,71 +3,116 @@
 
 #include "hittable.h"
 #include "ray.h"
+#include "sampler.h"
 #include "vec3.h"
 #include <cmath>
 
+enum class material_kind : uint32_t {
+  none,
+  lambertian,
+  metal,
+  dielectric,
+  emissive
+};
+
+// Plain description of a material, enough to store it in a scene cache and
+// make an identical one again
+struct material_desc {
+  material_kind kind = material_kind::none;
+  double albedo[3] = {0, 0, 0}; // radiance for emissive
+  double value = 0; // metal fuzz or dielectric refraction index
+};
+
 class material {
 public:
+  // Lets the wavefront integrator sort hits into a queue per material
+  // without a virtual call. Materials it doesn't know are kind none
+  const material_kind kind;
+
+  explicit material(material_kind kind = material_kind::none) : kind(kind) {}
   virtual ~material() = default;
 
   virtual bool scatter(const ray &r, const hit_record &rec, colour &attenuation,
-                       ray &scattered) const {
+                       ray &scattered, sampler & /*gen*/) const {
     return false;
   }
+
+  // Radiance given off by the front face, the same all over the surface.
+  // Black for everything but light sources
+  virtual colour emitted() const { return colour(0, 0, 0); }
+
+  // Materials that can't be described return kind none
+  virtual material_desc describe() const { return {}; }
 };
 
 class lambertian : public material {
 public:
-  lambertian(const colour &albedo) : albedo(albedo) {}
+  lambertian(const colour &albedo)
+      : material(material_kind::lambertian), albedo(albedo) {}
 
   bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation,
-               ray &scattered) const override {
-    auto scatter_dir = rec.normal + random_unit_vector();
+               ray &scattered, sampler &gen) const override {
+    stat_add(stat_counter::lambertian_scatters);
+    auto scatter_dir = rec.normal + random_unit_vector(gen);
 
     if (scatter_dir.near_zero()) {
       scatter_dir = rec.normal;
     }
 
-    scattered = ray(rec.p, scatter_dir, r_in.time());
+    scattered = rec.spawn_ray(scatter_dir, r_in.time());
     attenuation = albedo;
     return true;
   }
 
+  material_desc describe() const override {
+    return {material_kind::lambertian, {albedo.x(), albedo.y(), albedo.z()}, 0};
+  }
+
 private:
   colour albedo;
 };
 
 class metal : public material {
 public:
-  metal(const colour &albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+  metal(const colour &albedo, real fuzz)
+      : material(material_kind::metal), albedo(albedo),
+        fuzz(fuzz < 1 ? fuzz : 1) {}
 
   bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation,
-               ray &scattered) const override {
+               ray &scattered, sampler &gen) const override {
+    stat_add(stat_counter::metal_scatters);
     vec3 reflected = reflect(r_in.direction(), rec.normal);
-    reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-    scattered = ray(rec.p, reflected, r_in.time());
+    reflected = unit_vector(reflected) + (fuzz * random_unit_vector(gen));
+    scattered = rec.spawn_ray(reflected, r_in.time());
     attenuation = albedo;
     return (dot(scattered.direction(), rec.normal) > 0);
   }
 
+  material_desc describe() const override {
+    return {material_kind::metal, {albedo.x(), albedo.y(), albedo.z()}, fuzz};
+  }
+
 private:
   colour albedo;
-  double fuzz;
+  real fuzz;
 };
 
 class dielectric : public material {
   public:
-    dielectric(double refraction_index) : refraction_index(refraction_index) {}
+    dielectric(real refraction_index)
+        : material(material_kind::dielectric),
+          refraction_index(refraction_index) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered) const override {
+    bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, sampler& /*gen*/) const override {
+      stat_add(stat_counter::dielectric_scatters);
       attenuation = colour(1.0, 1.0, 1.0);
-      double ri = rec.front_face ? (1.0 / refraction_index) : refraction_index;
+      real ri = rec.front_face ? (1.0 / refraction_index) : refraction_index;
 
       vec3 unit_dir = unit_vector(r_in.direction());
       vec3 refracted = refract(unit_dir, rec.normal, ri);
 
-      double cos_theta = std::fmin(dot(-unit_dir, rec.normal), 1.0);
-      double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
+      real cos_theta = std::fmin(dot(-unit_dir, rec.normal), 1.0);
+      real sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
       vec3 dir;
 
       if(ri * sin_theta > 1.0) {
@@ -78,16 +123,20 @@ class dielectric : public material {
         dir = refract(unit_dir, rec.normal, ri);
       }
 
-      scattered = ray(rec.p, dir, r_in.time());
+      scattered = rec.spawn_ray(dir, r_in.time());
       return true;
     }
 
+    material_desc describe() const override {
+      return {material_kind::dielectric, {0, 0, 0}, refraction_index};
+    }
+
   private:
     // Refreactive index in a vaccume or air or the ratio of material's refreactive
     // index over thr refeactive index of enclosing media
-    double refraction_index;
+    real refraction_index;
 
-    static double reflectance(double cosine, double refraction_index) {
+    static real reflectance(real cosine, real refraction_index) {
       // Using Schlick's approx
 
       auto r0 = (1-refraction_index) / (1 + refraction_index);
@@ -96,4 +145,41 @@ class dielectric : public material {
     }
   };
 
+// A light source. It gives off radiance from its front face and absorbs
+// whatever hits it. The camera gathers the primitives using it into a
+// light list to sample, see hittable::add_lights
+class diffuse_light : public material {
+public:
+  diffuse_light(const colour &radiance)
+      : material(material_kind::emissive), radiance(radiance) {}
+
+  colour emitted() const override { return radiance; }
+
+  material_desc describe() const override {
+    return {material_kind::emissive,
+            {radiance.x(), radiance.y(), radiance.z()},
+            0};
+  }
+
+private:
+  colour radiance;
+};
+
+// Makes a material from its description, nullptr for kind none
+inline shared_ptr<material> make_material(const material_desc &desc) {
+  colour albedo(desc.albedo[0], desc.albedo[1], desc.albedo[2]);
+  switch (desc.kind) {
+  case material_kind::lambertian:
+    return make_shared<lambertian>(albedo);
+  case material_kind::metal:
+    return make_shared<metal>(albedo, desc.value);
+  case material_kind::dielectric:
+    return make_shared<dielectric>(desc.value);
+  case material_kind::emissive:
+    return make_shared<diffuse_light>(albedo);
+  default:
+    return nullptr;
+  }
+}
+
 #endif
\ No newline at end of file
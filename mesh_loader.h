@@ -0,0 +1,812 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+#include "mapped_file.h"
+#include "triangle_mesh.h"
+
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct mesh_load_stats {
+  std::string format;
+  size_t bytes = 0;
+  size_t vertex_count = 0;
+  size_t triangle_count = 0;
+  int threads = 1;
+  double seconds = 0;
+
+  void print(std::ostream &out) const {
+    double megabytes = bytes / (1024.0 * 1024.0);
+    out << "Mesh: " << triangle_count << " triangles, " << vertex_count
+        << " vertices from " << megabytes << " MB of " << format << " in "
+        << seconds * 1000.0 << " ms on " << threads << " threads ("
+        << triangle_count / seconds / 1e6 << " Mtriangles/s, "
+        << megabytes / seconds << " MB/s)\n";
+  }
+};
+
+// Number parsing that touches no locale, no errno and no heap, unlike strtof
+// and friends. Each returns the position just past the number, or nullptr if
+// there is no number at p
+
+inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+inline const char *parse_int(const char *p, const char *end, int64_t &out) {
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+  if (p == end || !is_digit(*p)) {
+    return nullptr;
+  }
+  // Saturates rather than overflowing, callers range check the result
+  int64_t value = 0;
+  while (p < end && is_digit(*p)) {
+    int digit = *p - '0';
+    value = value > (INT64_MAX - digit) / 10 ? INT64_MAX : value * 10 + digit;
+    p++;
+  }
+  out = negative ? -value : value;
+  return p;
+}
+
+inline const char *parse_float(const char *p, const char *end, float &out) {
+  static constexpr double powers[] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+
+  // Up to 19 significant digits fit in the mantissa, later ones only move
+  // the decimal exponent
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool any = false;
+  while (p < end && is_digit(*p)) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + uint64_t(*p - '0');
+      digits += mantissa != 0;
+    } else {
+      exponent++;
+    }
+    any = true;
+    p++;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && is_digit(*p)) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + uint64_t(*p - '0');
+        digits += mantissa != 0;
+        exponent--;
+      }
+      any = true;
+      p++;
+    }
+  }
+  if (!any) {
+    return nullptr;
+  }
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    int64_t power;
+    const char *after = parse_int(p + 1, end, power);
+    if (!after) {
+      return nullptr;
+    }
+    exponent += int(std::clamp<int64_t>(power, -1000, 1000));
+    p = after;
+  }
+
+  double value = double(mantissa);
+  if (mantissa != 0) {
+    if (exponent >= 0 && exponent <= 22) {
+      value *= powers[exponent];
+    } else if (exponent < 0 && exponent >= -22) {
+      value /= powers[-exponent];
+    } else {
+      value *= std::pow(10.0, exponent);
+    }
+  }
+  out = float(negative ? -value : value);
+  return p;
+}
+
+namespace mesh_loader_detail {
+
+inline bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char *skip_blanks(const char *p, const char *end) {
+  while (p < end && is_blank(*p)) {
+    p++;
+  }
+  return p;
+}
+
+inline const char *line_end(const char *p, const char *end) {
+  auto found = static_cast<const char *>(std::memchr(p, '\n', end - p));
+  return found ? found : end;
+}
+
+// Chunk boundaries of roughly equal size, each moved forward to the start of
+// a line
+inline std::vector<size_t> line_chunks(const char *data, size_t size,
+                                       size_t min_chunk_bytes) {
+  size_t chunk_count = std::max<size_t>(
+      1, std::min<size_t>(size / min_chunk_bytes,
+                          size_t(omp_get_max_threads()) * 8));
+  std::vector<size_t> bounds{0};
+  for (size_t k = 1; k < chunk_count; k++) {
+    size_t pos = std::max(bounds.back(), size * k / chunk_count);
+    if (pos > 0 && pos < size && data[pos - 1] != '\n') {
+      pos = line_end(data + pos, data + size) - data;
+      pos = std::min(size, pos + 1);
+    }
+    bounds.push_back(pos);
+  }
+  bounds.push_back(size);
+  return bounds;
+}
+
+inline size_t line_number(const char *data, const char *at) {
+  return 1 + size_t(std::count(data, at, '\n'));
+}
+
+// A face index counted back from the end of a chunk's vertices, which may
+// reach into earlier chunks
+struct obj_relative_index {
+  size_t slot;   // in the chunk's indices
+  int64_t local; // index into the chunk's vertices, negative before them
+};
+
+// What one OBJ chunk produced. Negative (relative) face indices can only be
+// resolved against the chunk's own vertices here, so they are listed with
+// their slots left empty and filled in once the chunk's first vertex index
+// is known
+struct obj_chunk {
+  std::vector<float> positions;
+  std::vector<uint32_t> indices;
+  std::vector<obj_relative_index> relative;
+  const char *error = nullptr;
+};
+
+inline void parse_obj_chunk(const char *p, const char *end, obj_chunk &chunk) {
+  while (p < end) {
+    p = skip_blanks(p, end);
+    const char *eol = line_end(p, end);
+
+    if (eol - p >= 2 && p[0] == 'v' && is_blank(p[1])) {
+      // v x y z [w], anything after z is ignored
+      const char *q = p + 1;
+      float xyz[3];
+      for (int axis = 0; axis < 3; axis++) {
+        q = parse_float(skip_blanks(q, eol), eol, xyz[axis]);
+        if (!q) {
+          chunk.error = p;
+          return;
+        }
+      }
+      chunk.positions.insert(chunk.positions.end(), xyz, xyz + 3);
+    } else if (eol - p >= 2 && p[0] == 'f' && is_blank(p[1])) {
+      // f v1[/vt1[/vn1]] v2 ... with polygons split into a triangle fan
+      const int64_t local_vertices = int64_t(chunk.positions.size() / 3);
+      int64_t first = 0, previous = 0;
+      bool first_relative = false, previous_relative = false;
+      int corners = 0;
+      auto add_index = [&](int64_t index, bool relative) {
+        if (relative) {
+          chunk.relative.push_back({chunk.indices.size(), index});
+        }
+        chunk.indices.push_back(relative ? 0 : uint32_t(index));
+      };
+
+      const char *q = p + 1;
+      while (true) {
+        q = skip_blanks(q, eol);
+        if (q == eol) {
+          break;
+        }
+        // Checked in 64 bits so nothing wraps into range when narrowed.
+        // A relative index can't go further back than the file's vertex
+        // count, which is checked once the chunks are joined
+        int64_t value;
+        q = parse_int(q, eol, value);
+        if (!q || value == 0 || value > int64_t(UINT32_MAX) ||
+            value < -int64_t(UINT32_MAX)) {
+          chunk.error = p;
+          return;
+        }
+        while (q < eol && !is_blank(*q)) {
+          q++; // texture and normal indices
+        }
+
+        bool relative = value < 0;
+        int64_t index = relative ? local_vertices + value : value - 1;
+        if (corners >= 2) {
+          add_index(first, first_relative);
+          add_index(previous, previous_relative);
+          add_index(index, relative);
+        } else if (corners == 0) {
+          first = index;
+          first_relative = relative;
+        }
+        previous = index;
+        previous_relative = relative;
+        corners++;
+      }
+      if (corners < 3) {
+        chunk.error = p;
+        return;
+      }
+    }
+
+    p = eol < end ? eol + 1 : end;
+  }
+}
+
+inline bool load_obj(const mapped_file &file, mesh_buffers &mesh,
+                     std::string &error) {
+  const char *data = file.data();
+  auto bounds = line_chunks(data, file.size(), 1 << 20);
+  size_t chunk_count = bounds.size() - 1;
+  std::vector<obj_chunk> chunks(chunk_count);
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t c = 0; c < chunk_count; c++) {
+    parse_obj_chunk(data + bounds[c], data + bounds[c + 1], chunks[c]);
+  }
+
+  std::vector<size_t> vertex_base(chunk_count), index_base(chunk_count);
+  size_t vertex_count = 0, index_count = 0;
+  for (size_t c = 0; c < chunk_count; c++) {
+    if (chunks[c].error) {
+      error = "malformed line " +
+              std::to_string(line_number(data, chunks[c].error));
+      return false;
+    }
+    vertex_base[c] = vertex_count;
+    index_base[c] = index_count;
+    vertex_count += chunks[c].positions.size() / 3;
+    index_count += chunks[c].indices.size();
+  }
+  if (vertex_count > UINT32_MAX) {
+    error = "more than 2^32 vertices";
+    return false;
+  }
+
+  mesh.positions.resize(vertex_count * 3);
+  mesh.indices.resize(index_count);
+  bool out_of_range = false;
+
+#pragma omp parallel for schedule(dynamic, 1) reduction(|| : out_of_range)
+  for (size_t c = 0; c < chunk_count; c++) {
+    const auto &chunk = chunks[c];
+    std::copy(chunk.positions.begin(), chunk.positions.end(),
+              mesh.positions.begin() + 3 * vertex_base[c]);
+
+    uint32_t *indices = mesh.indices.data() + index_base[c];
+    std::copy(chunk.indices.begin(), chunk.indices.end(), indices);
+    for (size_t i = 0; i < chunk.indices.size(); i++) {
+      out_of_range = out_of_range || indices[i] >= vertex_count;
+    }
+    for (const obj_relative_index &r : chunk.relative) {
+      int64_t index = int64_t(vertex_base[c]) + r.local;
+      if (index < 0 || index >= int64_t(vertex_count)) {
+        out_of_range = true;
+      } else {
+        indices[r.slot] = uint32_t(index);
+      }
+    }
+  }
+  if (out_of_range) {
+    error = "face refers to a vertex that does not exist";
+    return false;
+  }
+  return true;
+}
+
+enum class ply_type {
+  none,
+  int8,
+  uint8,
+  int16,
+  uint16,
+  int32,
+  uint32,
+  float32,
+  float64
+};
+
+inline ply_type ply_type_from(const std::string &name) {
+  if (name == "char" || name == "int8") {
+    return ply_type::int8;
+  }
+  if (name == "uchar" || name == "uint8") {
+    return ply_type::uint8;
+  }
+  if (name == "short" || name == "int16") {
+    return ply_type::int16;
+  }
+  if (name == "ushort" || name == "uint16") {
+    return ply_type::uint16;
+  }
+  if (name == "int" || name == "int32") {
+    return ply_type::int32;
+  }
+  if (name == "uint" || name == "uint32") {
+    return ply_type::uint32;
+  }
+  if (name == "float" || name == "float32") {
+    return ply_type::float32;
+  }
+  if (name == "double" || name == "float64") {
+    return ply_type::float64;
+  }
+  return ply_type::none;
+}
+
+inline size_t ply_size(ply_type type) {
+  switch (type) {
+  case ply_type::int8:
+  case ply_type::uint8:
+    return 1;
+  case ply_type::int16:
+  case ply_type::uint16:
+    return 2;
+  case ply_type::int32:
+  case ply_type::uint32:
+  case ply_type::float32:
+    return 4;
+  case ply_type::float64:
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+template <typename T> T ply_raw(const char *p, bool swap) {
+  char bytes[sizeof(T)];
+  std::memcpy(bytes, p, sizeof(T));
+  if (swap) {
+    std::reverse(bytes, bytes + sizeof(T));
+  }
+  T value;
+  std::memcpy(&value, bytes, sizeof(T));
+  return value;
+}
+
+inline double ply_read(const char *p, ply_type type, bool swap) {
+  switch (type) {
+  case ply_type::int8:
+    return ply_raw<int8_t>(p, swap);
+  case ply_type::uint8:
+    return ply_raw<uint8_t>(p, swap);
+  case ply_type::int16:
+    return ply_raw<int16_t>(p, swap);
+  case ply_type::uint16:
+    return ply_raw<uint16_t>(p, swap);
+  case ply_type::int32:
+    return ply_raw<int32_t>(p, swap);
+  case ply_type::uint32:
+    return ply_raw<uint32_t>(p, swap);
+  case ply_type::float32:
+    return ply_raw<float>(p, swap);
+  case ply_type::float64:
+    return ply_raw<double>(p, swap);
+  default:
+    return 0;
+  }
+}
+
+// Reads a list count or a vertex index into value. False unless it lies in
+// [0, limit), checked while still a double since casting a negative or too
+// big one to an unsigned type is undefined
+inline bool ply_read_index(const char *p, ply_type type, bool swap,
+                           double limit, uint64_t &value) {
+  double v = ply_read(p, type, swap);
+  if (!(v >= 0 && v < limit)) {
+    return false;
+  }
+  value = uint64_t(v);
+  return true;
+}
+
+// One past the largest index that fits a uint32_t
+constexpr double ply_index_limit = 4294967296.0;
+
+struct ply_property {
+  std::string name;
+  ply_type type = ply_type::none;
+  ply_type count_type = ply_type::none; // set for list properties
+};
+
+struct ply_element {
+  std::string name;
+  size_t count = 0;
+  std::vector<ply_property> properties;
+
+  // Bytes per item, or 0 if it has list properties and varies
+  size_t stride() const {
+    size_t bytes = 0;
+    for (const auto &prop : properties) {
+      if (prop.count_type != ply_type::none) {
+        return 0;
+      }
+      bytes += ply_size(prop.type);
+    }
+    return bytes;
+  }
+};
+
+// Walks one item of a variable size element, calling list(prop, count, p)
+// for each list. Returns the position after the item, or nullptr if it runs
+// past the end of the file or a list count is negative
+template <typename ListFn>
+const char *ply_walk_item(const ply_element &element, const char *p,
+                          const char *end, bool swap, ListFn list) {
+  for (size_t k = 0; k < element.properties.size(); k++) {
+    const auto &prop = element.properties[k];
+    if (prop.count_type == ply_type::none) {
+      p += ply_size(prop.type);
+      continue;
+    }
+    size_t count_size = ply_size(prop.count_type);
+    if (end - p < ptrdiff_t(count_size)) {
+      return nullptr;
+    }
+    // Every list entry takes at least a byte
+    uint64_t count = 0;
+    if (!ply_read_index(p, prop.count_type, swap, double(end - p) + 1,
+                        count)) {
+      return nullptr;
+    }
+    p += count_size;
+    if (size_t(end - p) < count * ply_size(prop.type)) {
+      return nullptr;
+    }
+    list(k, count, p);
+    p += count * ply_size(prop.type);
+  }
+  return p <= end ? p : nullptr;
+}
+
+inline bool load_ply(const mapped_file &file, mesh_buffers &mesh,
+                     std::string &error) {
+  const char *data = file.data();
+  const char *end = data + file.size();
+
+  // The header is short ASCII, parsed the ordinary way
+  const char *p = data;
+  bool swap = false;
+  bool header_done = false;
+  std::vector<ply_element> elements;
+  while (p < end && !header_done) {
+    const char *eol = line_end(p, end);
+    std::string line(p, eol);
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    p = eol < end ? eol + 1 : end;
+
+    std::vector<std::string> words;
+    size_t pos = 0;
+    while (pos < line.size()) {
+      size_t next = line.find_first_of(" \t", pos);
+      if (next == std::string::npos) {
+        next = line.size();
+      }
+      if (next > pos) {
+        words.push_back(line.substr(pos, next - pos));
+      }
+      pos = next + 1;
+    }
+    if (words.empty() || words[0] == "comment" || words[0] == "obj_info" ||
+        words[0] == "ply") {
+      continue;
+    }
+
+    if (words[0] == "format" && words.size() >= 2) {
+      uint16_t probe = 1;
+      bool little = *reinterpret_cast<const uint8_t *>(&probe) == 1;
+      if (words[1] == "binary_little_endian") {
+        swap = !little;
+      } else if (words[1] == "binary_big_endian") {
+        swap = little;
+      } else {
+        error = "only binary PLY is supported, not " + words[1];
+        return false;
+      }
+    } else if (words[0] == "element" && words.size() >= 3) {
+      // Every item takes at least a byte, so a count bigger than the file
+      // can't be right
+      const std::string &word = words[2];
+      const char *word_end = word.data() + word.size();
+      int64_t count = 0;
+      if (parse_int(word.data(), word_end, count) != word_end || count < 0 ||
+          uint64_t(count) > file.size()) {
+        error = "bad element count in '" + line + "'";
+        return false;
+      }
+      ply_element element;
+      element.name = words[1];
+      element.count = size_t(count);
+      elements.push_back(element);
+    } else if (words[0] == "property" && !elements.empty()) {
+      ply_property prop;
+      if (words.size() >= 5 && words[1] == "list") {
+        prop.count_type = ply_type_from(words[2]);
+        prop.type = ply_type_from(words[3]);
+        prop.name = words[4];
+        if (prop.count_type == ply_type::none) {
+          error = "unknown property type " + words[2];
+          return false;
+        }
+      } else if (words.size() >= 3) {
+        prop.type = ply_type_from(words[1]);
+        prop.name = words[2];
+      }
+      if (prop.type == ply_type::none) {
+        error = "unknown property in '" + line + "'";
+        return false;
+      }
+      elements.back().properties.push_back(prop);
+    } else if (words[0] == "end_header") {
+      header_done = true;
+    }
+  }
+  if (!header_done) {
+    error = "no end_header";
+    return false;
+  }
+
+  bool have_vertices = false;
+  for (const auto &element : elements) {
+    size_t stride = element.stride();
+
+    if (element.name == "vertex") {
+      if (stride == 0) {
+        error = "list properties on vertices are not supported";
+        return false;
+      }
+      size_t offset[3] = {0, 0, 0};
+      ply_type type[3] = {ply_type::none, ply_type::none, ply_type::none};
+      size_t at = 0;
+      for (const auto &prop : element.properties) {
+        for (int axis = 0; axis < 3; axis++) {
+          if (prop.name == std::string(1, char('x' + axis))) {
+            offset[axis] = at;
+            type[axis] = prop.type;
+          }
+        }
+        at += ply_size(prop.type);
+      }
+      if (type[0] == ply_type::none || type[1] == ply_type::none ||
+          type[2] == ply_type::none) {
+        error = "vertices need x, y and z";
+        return false;
+      }
+      if (size_t(end - p) / stride < element.count) {
+        error = "file ends inside the vertex list";
+        return false;
+      }
+      if (element.count > UINT32_MAX) {
+        error = "more than 2^32 vertices";
+        return false;
+      }
+
+      mesh.positions.resize(element.count * 3);
+      float *out = mesh.positions.data();
+      const char *base = p;
+      auto count = int64_t(element.count);
+#pragma omp parallel for schedule(static)
+      for (int64_t v = 0; v < count; v++) {
+        const char *item = base + size_t(v) * stride;
+        for (int axis = 0; axis < 3; axis++) {
+          out[3 * v + axis] =
+              float(ply_read(item + offset[axis], type[axis], swap));
+        }
+      }
+      p += element.count * stride;
+      have_vertices = true;
+      continue;
+    }
+
+    if (element.name == "face") {
+      size_t list = element.properties.size();
+      for (size_t k = 0; k < element.properties.size(); k++) {
+        const auto &prop = element.properties[k];
+        if (prop.count_type != ply_type::none &&
+            (prop.name == "vertex_indices" || prop.name == "vertex_index")) {
+          list = k;
+        }
+      }
+      if (list == element.properties.size()) {
+        error = "faces have no vertex_indices list";
+        return false;
+      }
+      const auto &prop = element.properties[list];
+      size_t count_size = ply_size(prop.count_type);
+      size_t index_size = ply_size(prop.type);
+
+      // Nearly every file is all triangles with nothing else per face, which
+      // makes the face list fixed size and lets it be read in parallel. The
+      // count bytes are checked first and anything else takes the
+      // sequential path
+      size_t triangle_stride = count_size + 3 * index_size;
+      bool all_triangles = element.properties.size() == 1 &&
+                           size_t(end - p) / triangle_stride >= element.count;
+      auto count = int64_t(element.count);
+      const char *base = p;
+      if (all_triangles) {
+        bool other = false;
+#pragma omp parallel for schedule(static) reduction(|| : other)
+        for (int64_t f = 0; f < count; f++) {
+          const char *item = base + size_t(f) * triangle_stride;
+          other = other || ply_read(item, prop.count_type, swap) != 3;
+        }
+        all_triangles = !other;
+      }
+
+      // Indices are only narrowed once they fit a uint32_t, whether they
+      // name a real vertex is checked at the end
+      bool bad_index = false;
+      if (all_triangles) {
+        mesh.indices.resize(element.count * 3);
+        uint32_t *out = mesh.indices.data();
+#pragma omp parallel for schedule(static) reduction(|| : bad_index)
+        for (int64_t f = 0; f < count; f++) {
+          const char *item = base + size_t(f) * triangle_stride + count_size;
+          for (int corner = 0; corner < 3; corner++) {
+            uint64_t index = 0;
+            bad_index = !ply_read_index(item + corner * index_size, prop.type,
+                                        swap, ply_index_limit, index) ||
+                        bad_index;
+            out[3 * f + corner] = uint32_t(index);
+          }
+        }
+        p += element.count * triangle_stride;
+      } else {
+        // Only faces with three or more corners add triangles, and each of
+        // those takes at least triangle_stride bytes
+        mesh.indices.clear();
+        mesh.indices.reserve(
+            std::min(element.count, size_t(end - p) / triangle_stride) * 3);
+        for (size_t f = 0; f < element.count; f++) {
+          auto face = [&](size_t k, size_t corners, const char *at) {
+            if (k != list) {
+              return;
+            }
+            auto index = [&](size_t corner) {
+              uint64_t value = 0;
+              if (!ply_read_index(at + corner * index_size, prop.type, swap,
+                                  ply_index_limit, value)) {
+                bad_index = true;
+              }
+              return uint32_t(value);
+            };
+            for (size_t corner = 2; corner < corners; corner++) {
+              mesh.indices.push_back(index(0));
+              mesh.indices.push_back(index(corner - 1));
+              mesh.indices.push_back(index(corner));
+            }
+          };
+          p = ply_walk_item(element, p, end, swap, face);
+          if (!p) {
+            error = "face list is cut short or has a bad count";
+            return false;
+          }
+        }
+      }
+      if (bad_index) {
+        error = "face refers to a vertex that does not exist";
+        return false;
+      }
+      break; // nothing after the faces is needed
+    }
+
+    // Some other element, skipped
+    if (stride > 0) {
+      if (size_t(end - p) / stride < element.count) {
+        error = "file ends inside element " + element.name;
+        return false;
+      }
+      p += element.count * stride;
+    } else {
+      for (size_t item = 0; item < element.count && p; item++) {
+        p = ply_walk_item(element, p, end, swap,
+                          [](size_t, size_t, const char *) {});
+      }
+      if (!p) {
+        error = "element " + element.name + " is cut short or has a bad count";
+        return false;
+      }
+    }
+  }
+
+  if (!have_vertices) {
+    error = "no vertex element";
+    return false;
+  }
+
+  const uint32_t *indices = mesh.indices.data();
+  auto index_count = int64_t(mesh.indices.size());
+  size_t vertex_count = mesh.vertex_count();
+  bool out_of_range = false;
+#pragma omp parallel for schedule(static) reduction(|| : out_of_range)
+  for (int64_t i = 0; i < index_count; i++) {
+    out_of_range = out_of_range || indices[i] >= vertex_count;
+  }
+  if (out_of_range) {
+    error = "face refers to a vertex that does not exist";
+    return false;
+  }
+  return true;
+}
+
+} // namespace mesh_loader_detail
+
+// Loads a Wavefront OBJ or binary PLY file, picked by extension, into
+// shareable mesh buffers ready for triangle_mesh. Only vertex positions and
+// faces are read, polygons are split into triangle fans. Returns nullptr and
+// logs the reason if the file can't be read
+inline shared_ptr<mesh_buffers> load_mesh(const std::string &path,
+                                          mesh_load_stats *stats = nullptr) {
+  using namespace mesh_loader_detail;
+  auto start_time = std::chrono::steady_clock::now();
+
+  auto ends_with = [&](const std::string &ext) {
+    return path.size() >= ext.size() &&
+           path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+  };
+
+  bool obj = ends_with(".obj") || ends_with(".OBJ");
+  bool ply = ends_with(".ply") || ends_with(".PLY");
+  if (!obj && !ply) {
+    std::clog << "Failed to load " << path << ": not an .obj or .ply file\n";
+    return nullptr;
+  }
+
+  mapped_file file(path);
+  if (!file.is_open()) {
+    std::clog << "Failed to load " << path << ": can't open file\n";
+    return nullptr;
+  }
+
+  auto mesh = make_shared<mesh_buffers>();
+  std::string error;
+  bool loaded =
+      obj ? load_obj(file, *mesh, error) : load_ply(file, *mesh, error);
+  if (!loaded) {
+    std::clog << "Failed to load " << path << ": " << error << '\n';
+    return nullptr;
+  }
+
+  if (stats) {
+    auto end_time = std::chrono::steady_clock::now();
+    stats->format = obj ? "OBJ" : "PLY";
+    stats->bytes = file.size();
+    stats->vertex_count = mesh->vertex_count();
+    stats->triangle_count = mesh->triangle_count();
+    stats->threads = omp_get_max_threads();
+    stats->seconds =
+        std::chrono::duration<double>(end_time - start_time).count();
+  }
+  return mesh;
+}
+
+#endif
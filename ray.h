@@ -3,27 +3,67 @@
 
 #include "vec3.h"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 class ray {
 public:
   ray() {}
 
-  ray(const point3& origin, const vec3& direction, double time) : orig(origin), dir(direction), tm(time) {}
+  ray(const point3& origin, const vec3& direction, real time) : orig(origin), dir(direction), tm(time) {
+    // Precomputed once per ray so box tests need no divides
+    inv_dir = vec3(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+    neg[0] = inv_dir.x() < 0;
+    neg[1] = inv_dir.y() < 0;
+    neg[2] = inv_dir.z() < 0;
+  }
 
   ray(const point3 &origin, const vec3 &direction)
       : ray(origin, direction, 0) {}
 
   const point3 &origin() const { return orig; }
   const vec3 &direction() const { return dir; }
+  const vec3 &inv_direction() const { return inv_dir; }
 
-  double time() const {return tm; }
+  // True if the direction is negative along the axis, used to pick the near
+  // and far slab planes without comparing t values
+  bool dir_is_neg(int axis) const { return neg[axis]; }
 
-  point3 at(double t) const { return orig + t * dir; }
+  real time() const {return tm; }
+
+  point3 at(real t) const { return orig + t * dir; }
 
 private:
   point3 orig;
   vec3 dir;
-  double tm;
+  vec3 inv_dir;
+  real tm;
+  bool neg[3];
 };
 
+// Moves p, a hit point whose coordinates are each within error of the true
+// surface, to the side of the surface that n points to. The result is past
+// the error bound along n and then one ulp further in each coordinate, so a
+// ray started there can't hit the surface it leaves whatever the precision
+// of real (after Pharr, Jakob and Humphreys, PBR 3rd ed. 3.9.5). error gets
+// a floor of a few ulps of p for primitives that don't bound their own
+inline point3 offset_ray_origin(const point3 &p, real error, const vec3 &n) {
+  constexpr real eps = std::numeric_limits<real>::epsilon();
+  real largest =
+      std::max({std::fabs(p.x()), std::fabs(p.y()), std::fabs(p.z())});
+  error = std::max(error, 4 * eps * largest);
+
+  real d = error * (std::fabs(n.x()) + std::fabs(n.y()) + std::fabs(n.z()));
+  point3 out = p + d * n;
+  for (int axis = 0; axis < 3; axis++) {
+    if (n[axis] > 0) {
+      out[axis] = std::nextafter(out[axis], infinity);
+    } else if (n[axis] < 0) {
+      out[axis] = std::nextafter(out[axis], -infinity);
+    }
+  }
+  return out;
+}
+
 #endif
\ No newline at end of file
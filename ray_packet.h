@@ -0,0 +1,68 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "aabb_simd.h"
+#include "ray.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Enough for the camera rays of an 8x8 block of pixels
+constexpr int packet_max_rays = 64;
+
+// Rays traced through a BVH together. finish() bounds the float origins and
+// reciprocal directions of all the rays, so one interval arithmetic slab
+// test can cull a box for the whole packet (see packet_hit_boxes)
+struct ray_packet {
+  int count = 0;
+  ray rays[packet_max_rays];
+  // The float origins and reciprocal directions the single ray slab tests
+  // use (see simd_ray), by axis then ray so the per ray tests at the leaves
+  // vectorise
+  alignas(32) float orig_near[3][packet_max_rays];
+  alignas(32) float orig_far[3][packet_max_rays];
+  alignas(32) float inv_dir[3][packet_max_rays];
+
+  // Only set when every ray points the same way along each axis and none
+  // is parallel to an axis. Otherwise the bounds can't cull anything and
+  // the rays are traced one at a time. The origin bounds cover both
+  // roundings of every origin
+  bool coherent = false;
+  int neg[3];
+  float orig_lo[3], orig_hi[3];
+  float inv_lo[3], inv_hi[3];
+
+  void clear() { count = 0; }
+
+  void add(const ray &r) {
+    rays[count] = r;
+    simd_ray s(r);
+    for (int axis = 0; axis < 3; axis++) {
+      orig_near[axis][count] = s.orig_near[axis];
+      orig_far[axis][count] = s.orig_far[axis];
+      inv_dir[axis][count] = s.inv_dir[axis];
+    }
+    count++;
+  }
+
+  void finish() {
+    coherent = count > 0;
+    for (int axis = 0; axis < 3 && coherent; axis++) {
+      neg[axis] = rays[0].dir_is_neg(axis);
+      orig_lo[axis] = orig_hi[axis] = orig_near[axis][0];
+      inv_lo[axis] = inv_hi[axis] = inv_dir[axis][0];
+      for (int k = 0; k < count; k++) {
+        orig_lo[axis] = std::min(
+            orig_lo[axis], std::min(orig_near[axis][k], orig_far[axis][k]));
+        orig_hi[axis] = std::max(
+            orig_hi[axis], std::max(orig_near[axis][k], orig_far[axis][k]));
+        inv_lo[axis] = std::min(inv_lo[axis], inv_dir[axis][k]);
+        inv_hi[axis] = std::max(inv_hi[axis], inv_dir[axis][k]);
+        coherent = coherent && int(rays[k].dir_is_neg(axis)) == neg[axis] &&
+                   std::isfinite(inv_dir[axis][k]);
+      }
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cmath>
+#include <cstdint>
+
+// Small, fast PCG32 generator (see pcg-random.org).
+// State is 16 bytes so every render thread can own one on its stack, which
+// means no shared state and no locking on the hot path.
+class rng {
+public:
+  rng() : rng(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL) {}
+
+  rng(uint64_t seed, uint64_t stream) {
+    state = 0;
+    inc = (stream << 1u) | 1u;
+    next_u32();
+    state += seed;
+    next_u32();
+  }
+
+  // Deterministic generator for one camera sample. The same (pixel, sample,
+  // frame) always gives the same stream, no matter which thread renders it
+  static rng for_sample(uint64_t pixel, uint64_t sample, uint64_t frame) {
+    return rng(mix(pixel ^ mix(sample + 0x9e3779b97f4a7c15ULL)), mix(frame));
+  }
+
+  uint32_t next_u32() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = uint32_t(((old >> 18u) ^ old) >> 27u);
+    uint32_t rot = uint32_t(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
+
+  // Uniform in [0, 1)
+  double next_double() { return std::ldexp(double(next_u32()), -32); }
+
+  // SplitMix64 finaliser, used to decorrelate seeds built from small integers
+  static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+private:
+  uint64_t state;
+  uint64_t inc;
+};
+
+#endif
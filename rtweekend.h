@@ -6,34 +6,59 @@
 #include <limits>
 #include <memory>
 #include <cstdlib>
-#include <random>
+
+#include "rng.h"
+#include "stats.h"
 
 using std::shared_ptr;
 using std::make_shared;
 
+// Scalar type of the geometry maths: vectors, rays, intervals, boxes and hit
+// records. Configure with -DRT_SINGLE_PRECISION=ON to render in float
+#ifdef RT_SINGLE_PRECISION
+using real = float;
+#else
+using real = double;
+#endif
+
 // Consts
 
-const double infinity = std::numeric_limits<double>::infinity();
-const double pi = 3.1415926535897932385;
+const real infinity = std::numeric_limits<real>::infinity();
+const real pi = real(3.1415926535897932385);
 
-inline double deg_to_rad(double deg) {
+inline real deg_to_rad(real deg) {
     return deg * pi / 180.0;
 }
 
+inline double random_double(rng& gen){
+    return gen.next_double();
+}
+
+inline double random_double(rng& gen, double min, double max){
+    return min + (max - min) * random_double(gen);
+}
+
+inline int random_int(rng& gen, int min, int max) {
+    return int(random_double(gen, min, max+1));
+}
+
+// Generator for single threaded setup code (scene construction etc)
+// Rendering always passes its own per sample generator instead
+inline rng& default_rng() {
+    thread_local rng generator;
+    return generator;
+}
+
 inline double random_double(){
-    // return std::rand() / (RAND_MAX + 1.0);
-    // or
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return random_double(default_rng());
 }
 
 inline double random_double(double min, double max){
-    return min + (max - min) * random_double();
+    return random_double(default_rng(), min, max);
 }
 
 inline int random_int(int min, int max) {
-    return int(random_double(min, max+1));
+    return random_int(default_rng(), min, max);
 }
 
 //Common headers
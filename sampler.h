@@ -0,0 +1,293 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Where the random numbers of a camera sample come from
+enum class sampler_type {
+  independent, // PCG32, every number independent of the others
+  sobol,       // Owen scrambled Sobol points, scrambled afresh in every pixel
+  blue_noise   // the same scrambled Sobol points in every pixel, each pixel
+               // offset by a blue noise mask so neighbours' errors differ
+};
+
+// Two sample values in [0, 1)
+struct sample_2d {
+  double u, v;
+};
+
+namespace sampler_detail {
+
+inline uint32_t reverse_bits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+  x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+  x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+  x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+  return x;
+}
+
+// The first two dimensions of the Sobol sequence as 32 bit fractions. The
+// first is the van der Corput sequence, the second has the Pascal matrix
+// mod 2 as its generator, so neither needs a table of direction numbers
+inline uint32_t sobol_0(uint32_t index) { return reverse_bits(index); }
+
+inline uint32_t sobol_1(uint32_t index) {
+  uint32_t x = 0;
+  for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+    if (index & 1) {
+      x ^= v;
+    }
+  }
+  return x;
+}
+
+// Owen scrambling by hashing: a Laine-Karras style permutation applied to
+// the reversed bits, so each bit is flipped by a hash of the bits above it
+// (Burley, "Practical hash-based Owen scrambling", JCGT 2020). Applied to a
+// sample index it shuffles the order of the samples while keeping every
+// power of two prefix a well stratified set
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+  x = reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverse_bits(x);
+}
+
+inline double to_unit(uint32_t x) { return std::ldexp(double(x), -32); }
+
+constexpr int blue_noise_size = 64;
+
+// Blue noise by void and cluster (Ulichney, "The void-and-cluster method
+// for dither array generation", 1993). Each pixel gets a rank, placed so
+// that the pixels below any rank are evenly spread on the torus. Built
+// once, the same on every run
+inline std::vector<float> make_blue_noise_mask() {
+  constexpr int n = blue_noise_size;
+  constexpr int pixels = n * n;
+
+  // Toroidal Gaussian with the sigma of 1.5 Ulichney suggests
+  std::vector<float> kernel(pixels);
+  for (int y = 0; y < n; y++) {
+    for (int x = 0; x < n; x++) {
+      int dx = std::min(x, n - x), dy = std::min(y, n - y);
+      kernel[y * n + x] = std::exp(-float(dx * dx + dy * dy) / 4.5f);
+    }
+  }
+
+  // energy is the kernel summed over every pixel that is on
+  std::vector<unsigned char> on(pixels, 0);
+  std::vector<float> energy(pixels, 0);
+  auto toggle = [&](int p, bool set) {
+    on[p] = set;
+    float sign = set ? 1.0f : -1.0f;
+    int px = p % n, py = p / n;
+    for (int y = 0; y < n; y++) {
+      const float *row = &kernel[((y - py + n) % n) * n];
+      for (int x = 0; x < n; x++) {
+        energy[y * n + x] += sign * row[(x - px + n) % n];
+      }
+    }
+  };
+  // The pixel that is on with the most energy, or off with the least
+  auto extreme = [&](bool tightest_cluster) {
+    int best = -1;
+    for (int p = 0; p < pixels; p++) {
+      if (bool(on[p]) != tightest_cluster) {
+        continue;
+      }
+      if (best < 0 || (tightest_cluster ? energy[p] > energy[best]
+                                        : energy[p] < energy[best])) {
+        best = p;
+      }
+    }
+    return best;
+  };
+
+  // A tenth of the pixels at random, then the tightest cluster is moved to
+  // the largest void until that changes nothing
+  rng gen(0x626c7565, 0x6e6f697365);
+  int initial = pixels / 10;
+  for (int placed = 0; placed < initial;) {
+    int p = int(gen.next_u32() % pixels);
+    if (!on[p]) {
+      toggle(p, true);
+      placed++;
+    }
+  }
+  for (int step = 0; step < pixels; step++) {
+    int cluster = extreme(true);
+    toggle(cluster, false);
+    int hole = extreme(false);
+    toggle(hole, true);
+    if (hole == cluster) {
+      break;
+    }
+  }
+
+  // Ranks below the initial pattern come from taking its tightest cluster
+  // away, those above from filling the largest void. Past half full the
+  // largest void of the ones is the tightest cluster of the zeros, since
+  // the two energies sum to a constant, so one loop covers both of
+  // Ulichney's later phases
+  std::vector<int> rank(pixels);
+  auto start_on = on;
+  auto start_energy = energy;
+  for (int r = initial - 1; r >= 0; r--) {
+    int p = extreme(true);
+    toggle(p, false);
+    rank[p] = r;
+  }
+  on = start_on;
+  energy = start_energy;
+  for (int r = initial; r < pixels; r++) {
+    int p = extreme(false);
+    toggle(p, true);
+    rank[p] = r;
+  }
+
+  std::vector<float> mask(pixels);
+  for (int p = 0; p < pixels; p++) {
+    mask[p] = (rank[p] + 0.5f) / pixels;
+  }
+  return mask;
+}
+
+inline const std::vector<float> &blue_noise_mask() {
+  static const std::vector<float> mask = make_blue_noise_mask();
+  return mask;
+}
+
+} // namespace sampler_detail
+
+// The numbers for one camera sample, drawn one or two dimensions at a time.
+// The Sobol samplers are padded, as pbrt-v4's PaddedSobolSampler is: every
+// draw takes the first one or two Sobol dimensions at a sample index
+// shuffled by a hash of the dimension, then Owen scrambles the values. Each
+// draw on its own is then as evenly spread as Sobol's best dimensions, and
+// different draws are decorrelated by their hashes
+//
+// Dimensions go to whatever draws them in order, but every bounce starts
+// at a fixed one (see start_bounce), so what a bounce gets doesn't depend
+// on how much earlier bounces drew. The camera ray comes first, then each
+// bounce has bounce_dimensions, more than the Lambertian scatter, light
+// sample and Russian roulette use between them
+class sampler {
+public:
+  static constexpr uint32_t camera_dimensions = 5; // pixel, lens, time
+  static constexpr uint32_t bounce_dimensions = 8;
+
+  sampler() = default;
+
+  // Sample number index of pixel (x, y) in the given animation frame. The
+  // same arguments always give the same numbers
+  sampler(sampler_type type, int x, int y, uint32_t index, uint32_t frame)
+      : type(type), x(x), y(y), index(index) {
+    uint64_t pixel = (uint64_t(uint32_t(y)) << 32) | uint32_t(x);
+    switch (type) {
+    case sampler_type::independent:
+      gen = rng::for_sample(pixel, index, frame);
+      break;
+    case sampler_type::sobol:
+      seed = rng::mix(pixel ^ rng::mix(frame));
+      break;
+    case sampler_type::blue_noise:
+      // One sequence for the whole image, the mask decorrelates pixels
+      seed = rng::mix(rng::mix(frame));
+      break;
+    }
+  }
+
+  double get_1d() {
+    if (type == sampler_type::independent) {
+      return gen.next_double();
+    }
+    using namespace sampler_detail;
+    uint64_t h = dimension_hash();
+    uint32_t i = owen_scramble(index, uint32_t(h));
+    double u = to_unit(owen_scramble(sobol_0(i), uint32_t(h >> 32)));
+    if (type == sampler_type::blue_noise) {
+      u = dither(u, rng::mix(h));
+    }
+    return u;
+  }
+
+  sample_2d get_2d() {
+    if (type == sampler_type::independent) {
+      double u = gen.next_double();
+      return {u, gen.next_double()};
+    }
+    using namespace sampler_detail;
+    uint64_t h = dimension_hash(2);
+    uint64_t h2 = rng::mix(h);
+    uint32_t i = owen_scramble(index, uint32_t(h));
+    sample_2d s = {to_unit(owen_scramble(sobol_0(i), uint32_t(h >> 32))),
+                   to_unit(owen_scramble(sobol_1(i), uint32_t(h2)))};
+    if (type == sampler_type::blue_noise) {
+      uint64_t h3 = rng::mix(h2);
+      s.u = dither(s.u, h3);
+      s.v = dither(s.v, h3 >> 32);
+    }
+    return s;
+  }
+
+  // Moves to the first dimension of bounce depth, 0 being the bounce at
+  // the camera ray's hit
+  void start_bounce(int depth) {
+    dimension = camera_dimensions + uint32_t(depth) * bounce_dimensions;
+  }
+
+private:
+  sampler_type type = sampler_type::independent;
+  rng gen; // independent only
+  uint64_t seed = 0;
+  int x = 0, y = 0;
+  uint32_t index = 0;
+  uint32_t dimension = 0;
+
+  // Hash of the next dimension, then moves past the dimensions the draw
+  // takes. A 2D draw takes two so the counts match what independent numbers
+  // would use, and camera_dimensions and bounce_dimensions count that way
+  uint64_t dimension_hash(uint32_t taken = 1) {
+    uint64_t h = rng::mix(seed ^ rng::mix(dimension));
+    dimension += taken;
+    return h;
+  }
+
+  // Cranley-Patterson rotation by the mask value at this pixel, the mask
+  // shifted by a hash of the dimension so each dimension sees a different
+  // arrangement (Georgiev and Fajardo, "Blue-noise dithered sampling", 2016)
+  double dither(double u, uint64_t h) const {
+    using namespace sampler_detail;
+    constexpr int n = blue_noise_size;
+    int mx = (x + int(h % n)) % n;
+    int my = (y + int((h >> 8) % n)) % n;
+    u += blue_noise_mask()[my * n + mx];
+    return u < 1 ? u : u - 1;
+  }
+};
+
+// Overloads for code written against rng, so materials and lights draw
+// from whichever sampler the camera uses. Sphere and disk points take one
+// 2D draw each
+inline double random_double(sampler &s) { return s.get_1d(); }
+
+inline vec3 random_unit_vector(sampler &s) {
+  sample_2d p = s.get_2d();
+  return unit_sphere_point(p.u, p.v);
+}
+
+inline vec3 random_in_unit_disk(sampler &s) {
+  sample_2d p = s.get_2d();
+  return unit_disk_point(p.u, p.v);
+}
+
+#endif
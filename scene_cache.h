@@ -0,0 +1,212 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include "cache_io.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "mapped_file.h"
+#include "simd.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+// A whole built scene in one file: camera settings, materials and every
+// top level object with its flattened BVH, so a repeated render can skip
+// scene setup and BVH builds. Layout is a 64 byte header, the objects, then
+// the material table. Arrays are stored exactly as they sit in memory and
+// come back with one copy each
+//
+// Bump the version whenever anything written here changes shape
+constexpr uint32_t scene_cache_version = 2;
+
+struct scene_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t object_count;
+  uint64_t key;
+  uint64_t objects_size;
+  uint64_t material_count;
+  uint64_t reserved[3];
+};
+
+static_assert(sizeof(scene_cache_header) == 64, "header is 64 bytes");
+
+enum class cache_object : uint32_t { sphere_set = 1, triangle_mesh = 2 };
+
+// Key for a cache, from a hash of whatever the caller built the scene from.
+// The format version and the in-memory layouts the arrays depend on are
+// mixed in, so a cache from another build never loads
+inline uint64_t scene_cache_key(cache_hash scene) {
+  scene.add(scene_cache_version);
+  scene.add(uint32_t(sizeof(bvh_linear_node)));
+  scene.add(uint32_t(sizeof(bvh_wide_node<4>)));
+  scene.add(uint32_t(sizeof(bvh_wide_node<8>)));
+  scene.add(uint32_t(fvec::width));
+  scene.add(uint32_t(sizeof(real)));
+  return scene.value();
+}
+
+class scene_cache_writer {
+public:
+  void add(const sphere_set &spheres) {
+    out.write(cache_object::sphere_set);
+    spheres.save(out);
+    object_count++;
+  }
+
+  void add(const triangle_mesh &mesh) {
+    out.write(cache_object::triangle_mesh);
+    mesh.save(out);
+    object_count++;
+  }
+
+  // Writes to a temporary file and renames it into place, so a reader never
+  // sees half a cache. False if a material can't be described or the file
+  // can't be written
+  bool save(const std::string &path, uint64_t key, const camera &cam) const {
+    if (!out.complete()) {
+      return false;
+    }
+
+    cache_writer objects;
+    write_camera(objects, cam);
+    const auto &body = out.bytes();
+
+    scene_cache_header header = {};
+    std::memcpy(header.magic, "RTSCENE", 8);
+    header.version = scene_cache_version;
+    header.object_count = object_count;
+    header.key = key;
+    header.objects_size = objects.bytes().size() + body.size();
+    header.material_count = out.material_table().size();
+
+    std::string temp_path = path + ".tmp";
+    {
+      std::ofstream file(temp_path, std::ios::binary);
+      file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+      file.write(objects.bytes().data(), objects.bytes().size());
+      file.write(body.data(), body.size());
+      file.write(reinterpret_cast<const char *>(out.material_table().data()),
+                 out.material_table().size() * sizeof(material_desc));
+      if (!file) {
+        std::remove(temp_path.c_str());
+        return false;
+      }
+    }
+    return std::rename(temp_path.c_str(), path.c_str()) == 0;
+  }
+
+private:
+  cache_writer out;
+  uint32_t object_count = 0;
+
+  // Camera settings go first, padded to the cache alignment so the objects
+  // after them keep their array alignment
+  static void write_camera(cache_writer &out, const camera &cam) {
+    out.write(cam.aspect_ratio);
+    out.write(int32_t(cam.image_width));
+    out.write(int32_t(cam.samples_per_pixel));
+    out.write(int32_t(cam.max_depth));
+    out.write(cam.vfov);
+    out.write(cam.lookfrom);
+    out.write(cam.lookat);
+    out.write(cam.vup);
+    out.write(cam.defocus_angle);
+    out.write(cam.focus_dist);
+    out.write_array(std::vector<char>());
+  }
+};
+
+// Loads a cache written with the same key into world and the camera
+// settings into cam. False, with world and cam untouched, if the file is
+// missing, stale, from another build or damaged
+inline bool load_scene_cache(const std::string &path, uint64_t key,
+                             hittable_list &world, camera &cam) {
+  mapped_file file(path);
+  if (!file.is_open() || file.size() < sizeof(scene_cache_header)) {
+    return false;
+  }
+
+  scene_cache_header header;
+  std::memcpy(&header, file.data(), sizeof(header));
+  size_t body_size = file.size() - sizeof(header);
+  if (std::memcmp(header.magic, "RTSCENE", 8) != 0 ||
+      header.version != scene_cache_version || header.key != key ||
+      header.objects_size > body_size ||
+      header.material_count !=
+          (body_size - header.objects_size) / sizeof(material_desc)) {
+    return false;
+  }
+
+  const char *objects = file.data() + sizeof(header);
+  std::vector<shared_ptr<material>> materials;
+  for (uint64_t m = 0; m < header.material_count; m++) {
+    material_desc desc;
+    std::memcpy(&desc, objects + header.objects_size + m * sizeof(desc),
+                sizeof(desc));
+    materials.push_back(make_material(desc));
+    if (!materials.back()) {
+      return false;
+    }
+  }
+
+  cache_reader in(objects, header.objects_size, std::move(materials));
+  camera loaded_cam = cam;
+  int32_t image_width = 0, samples_per_pixel = 0, max_depth = 0;
+  std::vector<char> padding;
+  in.read(loaded_cam.aspect_ratio);
+  in.read(image_width);
+  in.read(samples_per_pixel);
+  in.read(max_depth);
+  in.read(loaded_cam.vfov);
+  in.read(loaded_cam.lookfrom);
+  in.read(loaded_cam.lookat);
+  in.read(loaded_cam.vup);
+  in.read(loaded_cam.defocus_angle);
+  in.read(loaded_cam.focus_dist);
+  in.read_array(padding);
+  // camera::initialize divides by these
+  if (image_width <= 0 || samples_per_pixel <= 0 || max_depth < 0 ||
+      !(loaded_cam.aspect_ratio > 0) ||
+      !std::isfinite(loaded_cam.aspect_ratio)) {
+    return false;
+  }
+  loaded_cam.image_width = image_width;
+  loaded_cam.samples_per_pixel = samples_per_pixel;
+  loaded_cam.max_depth = max_depth;
+
+  hittable_list loaded;
+  for (uint32_t i = 0; i < header.object_count; i++) {
+    cache_object kind;
+    if (!in.read(kind)) {
+      return false;
+    }
+    if (kind == cache_object::sphere_set) {
+      auto spheres = make_shared<sphere_set>();
+      if (!spheres->load(in)) {
+        return false;
+      }
+      loaded.add(spheres);
+    } else if (kind == cache_object::triangle_mesh) {
+      auto mesh = make_shared<triangle_mesh>();
+      if (!mesh->load(in)) {
+        return false;
+      }
+      loaded.add(mesh);
+    } else {
+      return false;
+    }
+  }
+
+  for (const auto &object : loaded.objects) {
+    world.add(object);
+  }
+  cam = loaded_cam;
+  return true;
+}
+
+#endif
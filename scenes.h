@@ -0,0 +1,654 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+#include "rtweekend.h"
+#include "sphere_set.h"
+#include "transform.h"
+#include "triangle_mesh.h"
+#include "two_level_bvh.h"
+
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <string>
+#include <vector>
+
+// The standard scenes, shared by the renderer and the benchmark. Each one
+// reseeds default_rng() before it starts, so it comes out the same on every
+// run whatever was built before it
+
+// What moving an animated scene to a new frame did, over all its refits
+struct frame_update {
+  double seconds = 0; // the whole update, refits included
+  int refits = 0;
+  int rebuilds = 0; // refits that fell back to a rebuild
+  double max_cost_ratio = 1;
+
+  void add(const bvh_refit_result &result) {
+    refits++;
+    rebuilds += result.rebuilt;
+    max_cost_ratio = std::fmax(max_cost_ratio, result.cost_ratio);
+  }
+};
+
+struct scene {
+  hittable_list world;
+  camera cam;
+  // Totals over every object with its own BVH, build time includes
+  // collapsing to the wide layout
+  size_t primitive_count = 0;
+  double bvh_build_seconds = 0;
+  // Copies placed with instance, 0 if the scene doesn't use them
+  size_t instance_count = 0;
+
+  // Animated scenes only, empty otherwise. advance(frame) moves everything
+  // to frame and refits the BVHs. rebuild() builds every BVH that advance
+  // refits from scratch as things stand, returning the seconds it took, to
+  // compare against the refits
+  std::function<frame_update(int frame)> advance;
+  std::function<double()> rebuild;
+};
+
+inline const std::vector<std::string> &scene_names() {
+  static const std::vector<std::string> names = {
+      "spheres", "mesh",   "motion",       "glass",
+      "room",    "forest", "forest_baked", "animated"};
+  return names;
+}
+
+namespace scene_detail {
+
+using clock = std::chrono::steady_clock;
+
+inline double seconds_since(clock::time_point start) {
+  return std::chrono::duration<double>(clock::now() - start).count();
+}
+
+inline void add_spheres(scene &out, shared_ptr<sphere_set> spheres,
+                        const bvh_build_options &options) {
+  auto start = clock::now();
+  spheres->build(options);
+  out.bvh_build_seconds += seconds_since(start);
+  out.primitive_count += spheres->build_stats().primitive_count;
+  out.world.add(spheres);
+}
+
+inline void add_mesh(scene &out, shared_ptr<mesh_buffers> buffers,
+                     shared_ptr<material> mat,
+                     const bvh_build_options &options) {
+  auto start = clock::now();
+  auto mesh = make_shared<triangle_mesh>(buffers, mat, options);
+  out.bvh_build_seconds += seconds_since(start);
+  out.primitive_count += mesh->build_stats().primitive_count;
+  out.world.add(mesh);
+}
+
+inline void add_ground(sphere_set &spheres) {
+  auto ground_material = make_shared<lambertian>(colour(0.5, 0.5, 0.5));
+  spheres.add(point3(0, -1000, 0), 1000, ground_material);
+}
+
+// Torus in the xz plane around centre, with ripples on the tube so the
+// triangles aren't all alike. rings * sides * 2 triangles
+inline shared_ptr<mesh_buffers> make_torus(const point3 &centre, real major,
+                                           real minor, int rings, int sides) {
+  auto buffers = make_shared<mesh_buffers>();
+  buffers->positions.reserve(size_t(rings) * sides * 3);
+  for (int i = 0; i < rings; i++) {
+    real phi = 2 * pi * i / rings;
+    for (int j = 0; j < sides; j++) {
+      real theta = 2 * pi * j / sides;
+      real tube = minor * (1 + 0.1 * std::sin(12 * phi) * std::sin(5 * theta));
+      real ring = major + tube * std::cos(theta);
+      buffers->positions.push_back(float(centre.x() + ring * std::cos(phi)));
+      buffers->positions.push_back(float(centre.y() + tube * std::sin(theta)));
+      buffers->positions.push_back(float(centre.z() + ring * std::sin(phi)));
+    }
+  }
+
+  buffers->indices.reserve(size_t(rings) * sides * 6);
+  for (int i = 0; i < rings; i++) {
+    for (int j = 0; j < sides; j++) {
+      uint32_t a = uint32_t(i * sides + j);
+      uint32_t b = uint32_t(((i + 1) % rings) * sides + j);
+      uint32_t c = uint32_t(((i + 1) % rings) * sides + (j + 1) % sides);
+      uint32_t d = uint32_t(i * sides + (j + 1) % sides);
+      buffers->indices.insert(buffers->indices.end(), {a, b, c, a, c, d});
+    }
+  }
+  return buffers;
+}
+
+// A fir tree standing on the origin: a trunk and layers of cones, their
+// surfaces rippled so the triangles aren't all alike. About
+// (2 * layers * rings + 2) * sides triangles
+inline shared_ptr<mesh_buffers> make_tree(int layers, real height, real width,
+                                          int rings, int sides) {
+  auto buffers = make_shared<mesh_buffers>();
+  auto ring = [&](real y, real radius, real wobble) {
+    uint32_t first = uint32_t(buffers->positions.size() / 3);
+    for (int j = 0; j < sides; j++) {
+      real theta = 2 * pi * j / sides;
+      real r = radius * (1 + wobble * std::sin(7 * theta));
+      buffers->positions.push_back(float(r * std::cos(theta)));
+      buffers->positions.push_back(float(y));
+      buffers->positions.push_back(float(r * std::sin(theta)));
+    }
+    return first;
+  };
+  // Joins two rings of sides vertices, facing outwards
+  auto band = [&](uint32_t lower, uint32_t upper) {
+    for (int j = 0; j < sides; j++) {
+      uint32_t k = uint32_t((j + 1) % sides);
+      buffers->indices.insert(buffers->indices.end(),
+                              {lower + j, upper + j, upper + k, lower + j,
+                               upper + k, lower + k});
+    }
+  };
+
+  real trunk = 0.08 * width;
+  real trunk_top = 0.3 * height;
+  band(ring(0, trunk, 0), ring(trunk_top, trunk, 0));
+
+  real layer_height = (height - trunk_top) / layers * 1.6;
+  for (int layer = 0; layer < layers; layer++) {
+    real base = trunk_top + layer * (height - trunk_top - layer_height) /
+                                std::max(1, layers - 1);
+    real radius = width * (1 - 0.6 * layer / std::max(1, layers));
+    uint32_t lower = ring(base, radius, 0);
+    for (int i = 1; i <= rings; i++) {
+      real f = real(i) / rings;
+      uint32_t upper = ring(base + f * layer_height,
+                            std::fmax(radius * (1 - f), 0.01 * width),
+                            0.08 * random_double());
+      band(lower, upper);
+      lower = upper;
+    }
+  }
+  return buffers;
+}
+
+// Spheres as plain lists, for a prototype that is also baked into copies
+struct sphere_list {
+  std::vector<point3> centres;
+  std::vector<real> radii;
+  std::vector<shared_ptr<material>> materials;
+
+  void add(const point3 &centre, real radius, shared_ptr<material> mat) {
+    centres.push_back(centre);
+    radii.push_back(radius);
+    materials.push_back(mat);
+  }
+
+  // Adds every sphere moved by to_world, whose scale must be uniform
+  void add_to(sphere_set &out, const transform &to_world, real scale) const {
+    for (size_t i = 0; i < centres.size(); i++) {
+      out.add(to_world.apply_point(centres[i]), radii[i] * scale,
+              materials[i]);
+    }
+  }
+};
+
+// A bush: a mound of small spheres in two greens
+inline sphere_list make_bush(int count) {
+  auto light = make_shared<lambertian>(colour(0.25, 0.5, 0.15));
+  auto dark = make_shared<lambertian>(colour(0.1, 0.3, 0.08));
+  sphere_list bush;
+  for (int i = 0; i < count; i++) {
+    vec3 d = random_unit_vector(default_rng());
+    d[1] = std::fabs(d[1]);
+    real r = 0.6 * std::cbrt(random_double());
+    bush.add(point3(0, 0, 0) + r * d, random_double(0.05, 0.12),
+             random_double() < 0.5 ? light : dark);
+  }
+  return bush;
+}
+
+// Where one copy of a forest prototype goes. scale is the uniform scale in
+// to_world
+struct forest_copy {
+  int prototype;
+  transform to_world;
+  real scale;
+};
+
+// A grid x grid field of copies, jittered, turned and scaled at random.
+// Prototypes 0 and 1 are trees, 2 is a bush
+inline std::vector<forest_copy> forest_layout(int grid, real spacing) {
+  std::vector<forest_copy> copies;
+  for (int a = 0; a < grid; a++) {
+    for (int b = 0; b < grid; b++) {
+      real pick = random_double();
+      int prototype = pick < 0.4 ? 0 : pick < 0.75 ? 1 : 2;
+      real scale = random_double(0.7, 1.3);
+      vec3 at((a - 0.5 * grid + random_double(0.1, 0.9)) * spacing, 0,
+              (b - 0.5 * grid + random_double(0.1, 0.9)) * spacing);
+      transform to_world = transform::translate(at) *
+                           transform::rotate(vec3(0, 1, 0),
+                                             random_double(0, 360)) *
+                           transform::scale(scale);
+      copies.push_back({prototype, to_world, scale});
+    }
+  }
+  return copies;
+}
+
+// Appends the vertices of from moved by to_world to out
+inline void bake_mesh(mesh_buffers &out, const mesh_buffers &from,
+                      const transform &to_world) {
+  uint32_t first = uint32_t(out.vertex_count());
+  for (size_t v = 0; v < from.vertex_count(); v++) {
+    point3 p(from.positions[3 * v], from.positions[3 * v + 1],
+             from.positions[3 * v + 2]);
+    p = to_world.apply_point(p);
+    for (int axis = 0; axis < 3; axis++) {
+      out.positions.push_back(float(p[axis]));
+    }
+  }
+  for (uint32_t index : from.indices) {
+    out.indices.push_back(first + index);
+  }
+}
+
+// The torus make_torus gives with every vertex pushed along the tube's
+// surface normal by a wave travelling round the ring, at time seconds
+inline shared_ptr<mesh_buffers> wave_torus(const mesh_buffers &rest,
+                                           const point3 &centre, real major,
+                                           real time) {
+  auto moved = make_shared<mesh_buffers>(rest);
+  for (size_t v = 0; v < rest.vertex_count(); v++) {
+    point3 p(rest.positions[3 * v], rest.positions[3 * v + 1],
+             rest.positions[3 * v + 2]);
+    vec3 radial = p - centre;
+    radial[1] = 0;
+    point3 core = centre + major * unit_vector(radial);
+    vec3 normal = unit_vector(p - core);
+    real phi = std::atan2(radial.z(), radial.x());
+    p += 0.25 * std::sin(4 * phi - 3 * time) * normal;
+    for (int axis = 0; axis < 3; axis++) {
+      moved->positions[3 * v + axis] = float(p[axis]);
+    }
+  }
+  return moved;
+}
+
+// Two triangles, a b c and a c d. The front face is the side
+// cross(b - a, c - a) points to
+inline void add_quad(mesh_buffers &buffers, const point3 &a, const point3 &b,
+                     const point3 &c, const point3 &d) {
+  uint32_t first = uint32_t(buffers.positions.size() / 3);
+  for (const point3 &p : {a, b, c, d}) {
+    for (int axis = 0; axis < 3; axis++) {
+      buffers.positions.push_back(float(p[axis]));
+    }
+  }
+  buffers.indices.insert(buffers.indices.end(),
+                         {first, first + 1, first + 2, first, first + 2,
+                          first + 3});
+}
+
+} // namespace scene_detail
+
+// What random_spheres is built from. The defaults are default_rng()'s seed
+// and the book's grid
+struct random_spheres_settings {
+  uint64_t seed = 0x853c49e6748fea9bULL;
+  uint64_t stream = 0xda3e39cb94b95bdbULL;
+  int grid = 11; // small spheres at a, b in [-grid, grid)
+};
+
+// The book's final scene: a ground sphere, a grid of small random spheres
+// (the diffuse ones bouncing) and three large ones. main.cpp keys its scene
+// cache on the settings and its scene_version, which needs bumping when
+// this or random_spheres_view changes what they build
+inline shared_ptr<sphere_set>
+random_spheres(const random_spheres_settings &settings = {}) {
+  default_rng() = rng(settings.seed, settings.stream);
+
+  // All the spheres go in one packed set, intersected several at a time
+  auto spheres = make_shared<sphere_set>();
+  scene_detail::add_ground(*spheres);
+
+  for (int a = -settings.grid; a < settings.grid; a++) {
+    for (int b = -settings.grid; b < settings.grid; b++) {
+      auto choose_mat = random_double();
+      point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+
+      if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+        shared_ptr<material> object_material;
+
+        if (choose_mat < 0.75) {
+          // diffuse sphere
+          auto albedo = colour::random() * colour::random();
+          object_material = make_shared<lambertian>(albedo);
+          auto centre2 = center + vec3(0, random_double(0, .5), 0);
+          spheres->add(center, centre2, 0.2, object_material);
+        } else if (choose_mat < 0.9) {
+          // metal sphere
+          auto albedo = colour::random(0.5, 1);
+          auto fuzz = random_double(0, 0.5);
+          object_material = make_shared<metal>(albedo, fuzz);
+          spheres->add(center, 0.2, object_material);
+        } else {
+          // glass sphere
+          object_material = make_shared<dielectric>(1.5);
+          spheres->add(center, 0.2, object_material);
+        }
+      }
+    }
+  }
+
+  // The three large spheres
+  auto material1 = make_shared<dielectric>(1.5);
+  spheres->add(point3(0, 1, 0), 1.0, material1);
+
+  auto material2 = make_shared<lambertian>(colour(0.4, 0.2, 0.1));
+  spheres->add(point3(-4, 1, 0), 1.0, material2);
+
+  auto material3 = make_shared<metal>(colour(0.7, 0.6, 0.5), 0.0);
+  spheres->add(point3(4, 1, 0), 1.0, material3);
+
+  return spheres;
+}
+
+inline void random_spheres_view(camera &cam) {
+  cam.aspect_ratio = 16.0 / 9.0;
+  cam.image_width = 1920;
+  cam.samples_per_pixel = 100;
+  cam.max_depth = 50;
+
+  cam.vfov = 20;
+  cam.lookfrom = point3(13, 2, 3);
+  cam.lookat = point3(0, 0, 0);
+  cam.vup = vec3(0, 1, 0);
+
+  cam.defocus_angle = 0.8;
+  cam.focus_dist = 10.0;
+}
+
+// Builds the named scene, one of scene_names(), into out. False for an
+// unknown name
+inline bool make_scene(const std::string &name, scene &out,
+                       const bvh_build_options &options) {
+  using namespace scene_detail;
+
+  if (name == "spheres") {
+    add_spheres(out, random_spheres(), options);
+    random_spheres_view(out.cam);
+    return true;
+  }
+
+  default_rng() = rng();
+  random_spheres_view(out.cam);
+  out.cam.defocus_angle = 0;
+
+  if (name == "mesh") {
+    // About half a million triangles in one mesh, over a plain ground
+    auto ground = make_shared<sphere_set>();
+    add_ground(*ground);
+    add_spheres(out, ground, options);
+
+    auto buffers = make_torus(point3(0, 1, 0), 2.5, 0.9, 1024, 256);
+    auto mesh_material = make_shared<metal>(colour(0.8, 0.6, 0.4), 0.2);
+    add_mesh(out, buffers, mesh_material, options);
+
+    out.cam.lookfrom = point3(0, 7, 9);
+    out.cam.lookat = point3(0, 0.5, 0);
+    out.cam.vfov = 35;
+    return true;
+  }
+
+  if (name == "motion") {
+    // Every small sphere moves a long way during the shutter, in a random
+    // direction, so swept boxes overlap heavily
+    auto spheres = make_shared<sphere_set>();
+    add_ground(*spheres);
+    for (int a = -11; a < 11; a++) {
+      for (int b = -11; b < 11; b++) {
+        point3 centre(a + 0.9 * random_double(), 0.2,
+                      b + 0.9 * random_double());
+        vec3 travel = 1.5 * random_unit_vector(default_rng());
+        travel[1] = std::fabs(travel[1]);
+        shared_ptr<material> object_material;
+        if (random_double() < 0.8) {
+          object_material =
+              make_shared<lambertian>(colour::random() * colour::random());
+        } else {
+          object_material =
+              make_shared<metal>(colour::random(0.5, 1), random_double(0, 0.5));
+        }
+        spheres->add(centre, centre + travel, 0.2, object_material);
+      }
+    }
+    add_spheres(out, spheres, options);
+    return true;
+  }
+
+  if (name == "glass") {
+    // Nearly every ray refracts through several spheres before it escapes
+    auto spheres = make_shared<sphere_set>();
+    add_ground(*spheres);
+    for (int a = -11; a < 11; a++) {
+      for (int b = -11; b < 11; b++) {
+        real radius = random_double(0.15, 0.35);
+        point3 centre(a + 0.9 * random_double(), radius,
+                      b + 0.9 * random_double());
+        spheres->add(centre, radius,
+                     make_shared<dielectric>(random_double(1.3, 1.8)));
+      }
+    }
+    auto glass = make_shared<dielectric>(1.5);
+    spheres->add(point3(0, 1, 0), 1.0, glass);
+    spheres->add(point3(-4, 1, 0), 1.0, glass);
+    spheres->add(point3(4, 1, 0), 1.0, glass);
+    add_spheres(out, spheres, options);
+    return true;
+  }
+
+  if (name == "room") {
+    // A closed box lit only by a small panel in the ceiling and a glowing
+    // sphere, with no sky. Almost all the light arrives after a diffuse
+    // bounce, so it shows what light sampling is worth
+    auto white = make_shared<lambertian>(colour(0.73, 0.73, 0.73));
+    auto walls = make_shared<mesh_buffers>();
+    add_quad(*walls, point3(-1, 0, -1), point3(1, 0, -1), point3(1, 0, 1),
+             point3(-1, 0, 1));
+    add_quad(*walls, point3(-1, 2, -1), point3(1, 2, -1), point3(1, 2, 1),
+             point3(-1, 2, 1));
+    add_quad(*walls, point3(-1, 0, -1), point3(1, 0, -1), point3(1, 2, -1),
+             point3(-1, 2, -1));
+    add_mesh(out, walls, white, options);
+
+    auto left = make_shared<mesh_buffers>();
+    add_quad(*left, point3(-1, 0, -1), point3(-1, 0, 1), point3(-1, 2, 1),
+             point3(-1, 2, -1));
+    add_mesh(out, left, make_shared<lambertian>(colour(0.65, 0.05, 0.05)),
+             options);
+
+    auto right = make_shared<mesh_buffers>();
+    add_quad(*right, point3(1, 0, -1), point3(1, 0, 1), point3(1, 2, 1),
+             point3(1, 2, -1));
+    add_mesh(out, right, make_shared<lambertian>(colour(0.12, 0.45, 0.15)),
+             options);
+
+    // Wound to face down into the room
+    auto panel = make_shared<mesh_buffers>();
+    add_quad(*panel, point3(-0.3, 1.99, -0.3), point3(0.3, 1.99, -0.3),
+             point3(0.3, 1.99, 0.3), point3(-0.3, 1.99, 0.3));
+    add_mesh(out, panel, make_shared<diffuse_light>(colour(15, 15, 15)),
+             options);
+
+    auto spheres = make_shared<sphere_set>();
+    spheres->add(point3(-0.4, 0.4, -0.3), 0.4, white);
+    spheres->add(point3(0.45, 0.35, 0.3), 0.35,
+                 make_shared<metal>(colour(0.8, 0.85, 0.9), 0.05));
+    spheres->add(point3(0.55, 1.3, -0.6), 0.08,
+                 make_shared<diffuse_light>(colour(8, 5, 2)));
+    add_spheres(out, spheres, options);
+
+    out.cam.aspect_ratio = 1.0;
+    out.cam.lookfrom = point3(0, 1, 3.8);
+    out.cam.lookat = point3(0, 1, 0);
+    out.cam.vfov = 40;
+    out.cam.sky = false;
+    return true;
+  }
+
+  if (name == "forest" || name == "forest_baked") {
+    // A thousand trees and bushes made from three prototypes. forest places
+    // each copy with an instance under a BVH over the instances, so memory
+    // grows with the prototypes plus a transform per copy. forest_baked
+    // copies every one into world space geometry instead, for comparing
+    // peak RSS and speed
+    auto ground = make_shared<sphere_set>();
+    add_ground(*ground);
+    add_spheres(out, ground, options);
+
+    auto needles = make_shared<lambertian>(colour(0.12, 0.35, 0.12));
+    shared_ptr<mesh_buffers> trees[2] = {make_tree(3, 2.0, 0.7, 12, 48),
+                                         make_tree(5, 3.2, 0.6, 8, 40)};
+    sphere_list bush = make_bush(300);
+    auto copies = forest_layout(32, 1.0);
+
+    out.cam.lookfrom = point3(0, 4, 18);
+    out.cam.lookat = point3(0, 0.5, 0);
+    out.cam.vfov = 40;
+
+    if (name == "forest_baked") {
+      auto baked_trees = make_shared<mesh_buffers>();
+      auto baked_bushes = make_shared<sphere_set>();
+      for (const forest_copy &copy : copies) {
+        if (copy.prototype < 2) {
+          bake_mesh(*baked_trees, *trees[copy.prototype], copy.to_world);
+        } else {
+          bush.add_to(*baked_bushes, copy.to_world, copy.scale);
+        }
+      }
+      add_mesh(out, baked_trees, needles, options);
+      add_spheres(out, baked_bushes, options);
+      return true;
+    }
+
+    auto start = clock::now();
+    shared_ptr<hittable> prototypes[3];
+    for (int t = 0; t < 2; t++) {
+      auto mesh = make_shared<triangle_mesh>(trees[t], needles, options);
+      out.primitive_count += mesh->build_stats().primitive_count;
+      prototypes[t] = mesh;
+    }
+    auto bush_set = make_shared<sphere_set>();
+    bush.add_to(*bush_set, transform(), 1);
+    bush_set->build(options);
+    out.primitive_count += bush_set->build_stats().primitive_count;
+    prototypes[2] = bush_set;
+
+    std::vector<shared_ptr<hittable>> instances;
+    for (const forest_copy &copy : copies) {
+      instances.push_back(
+          make_shared<instance>(prototypes[copy.prototype], copy.to_world));
+    }
+    out.instance_count = instances.size();
+    out.primitive_count += instances.size();
+    out.world.add(make_shared<bvh_node>(instances, options));
+    out.bvh_build_seconds += seconds_since(start);
+    return true;
+  }
+
+  if (name == "animated") {
+    // Frames of an animation at 24 fps. The ground and a ring of spheres
+    // stay put in the static tree. A rippling torus is refit to its new
+    // vertices each frame, and tori copied from one prototype by instances
+    // orbit, bob and spin in the dynamic tree, which update() refits
+    auto start = clock::now();
+    auto world = make_shared<two_level_bvh>();
+
+    auto still = make_shared<sphere_set>();
+    add_ground(*still);
+    for (int i = 0; i < 24; i++) {
+      real angle = 2 * pi * i / 24;
+      still->add(point3(7 * std::cos(angle), 0.5, 7 * std::sin(angle)), 0.5,
+                 make_shared<lambertian>(colour::random() * colour::random()));
+    }
+    still->build(options);
+    out.primitive_count += still->build_stats().primitive_count;
+    world->add_static(still);
+
+    const point3 centre(0, 1.2, 0);
+    const real major = 2.2;
+    auto rest = make_torus(centre, major, 0.7, 256, 64);
+    auto ripple_material = make_shared<metal>(colour(0.8, 0.6, 0.4), 0.2);
+    auto ripple = make_shared<triangle_mesh>(
+        wave_torus(*rest, centre, major, 0), ripple_material, options);
+    out.primitive_count += ripple->build_stats().primitive_count;
+    world->add_dynamic(ripple);
+
+    auto prototype = make_shared<triangle_mesh>(
+        make_torus(point3(0, 0, 0), 0.35, 0.12, 48, 16),
+        make_shared<lambertian>(colour(0.2, 0.3, 0.7)), options);
+    out.primitive_count += prototype->build_stats().primitive_count;
+
+    // Each orbiter's radius, speed, phase and height
+    struct orbit {
+      real radius, speed, phase, height;
+    };
+    std::vector<orbit> orbits;
+    std::vector<shared_ptr<instance>> orbiters;
+    auto place = [](const orbit &o, real time) {
+      real angle = o.phase + o.speed * time;
+      vec3 at(o.radius * std::cos(angle),
+              o.height + 0.4 * std::sin(3 * angle + o.phase),
+              o.radius * std::sin(angle));
+      return transform::translate(at) *
+             transform::rotate(vec3(1, 0, 0), 90 * time + o.phase * 50);
+    };
+    for (int i = 0; i < 96; i++) {
+      orbit o;
+      o.radius = random_double(3.2, 6);
+      o.speed = random_double(-1.5, 1.5);
+      o.phase = random_double(0, 2 * pi);
+      o.height = random_double(0.5, 3);
+      orbits.push_back(o);
+      orbiters.push_back(make_shared<instance>(prototype, place(o, 0)));
+      world->add_dynamic(orbiters.back());
+    }
+    out.instance_count = orbiters.size();
+    out.primitive_count += orbiters.size();
+
+    world->build(options);
+    out.bvh_build_seconds += seconds_since(start);
+    out.world.add(world);
+
+    out.advance = [=](int frame) {
+      auto update_start = clock::now();
+      real time = frame / 24.0;
+      frame_update update;
+      update.add(ripple->refit(wave_torus(*rest, centre, major, time)));
+      for (size_t i = 0; i < orbiters.size(); i++) {
+        orbiters[i]->set_transform(place(orbits[i], time));
+      }
+      update.add(world->update());
+      update.seconds = seconds_since(update_start);
+      return update;
+    };
+    out.rebuild = [=] {
+      auto rebuild_start = clock::now();
+      *ripple = triangle_mesh(ripple->shared_mesh(), ripple_material, options);
+      world->build(options);
+      return seconds_since(rebuild_start);
+    };
+
+    out.cam.lookfrom = point3(0, 6, 12);
+    out.cam.lookat = point3(0, 1, 0);
+    out.cam.vfov = 45;
+    return true;
+  }
+
+  return false;
+}
+
+#endif
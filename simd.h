@@ -0,0 +1,92 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__AVX__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+// Thin wrapper over the widest float vector the build targets, so kernels
+// can be written once. Lanes are 8 with AVX, 4 with SSE4.1 and 1 otherwise
+#if defined(__AVX__)
+
+struct fvec {
+  static constexpr int width = 8;
+  __m256 v;
+
+  fvec() {}
+  fvec(__m256 v) : v(v) {}
+  fvec(float x) : v(_mm256_set1_ps(x)) {}
+
+  static fvec load(const float *p) { return _mm256_loadu_ps(p); }
+};
+
+inline fvec operator+(fvec a, fvec b) { return _mm256_add_ps(a.v, b.v); }
+inline fvec operator-(fvec a, fvec b) { return _mm256_sub_ps(a.v, b.v); }
+inline fvec operator*(fvec a, fvec b) { return _mm256_mul_ps(a.v, b.v); }
+inline fvec sqrt(fvec a) { return _mm256_sqrt_ps(a.v); }
+inline fvec max(fvec a, fvec b) { return _mm256_max_ps(a.v, b.v); }
+
+// Comparisons return a lane bit mask
+inline uint32_t operator<(fvec a, fvec b) {
+  return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)));
+}
+inline uint32_t operator>(fvec a, fvec b) { return b < a; }
+inline uint32_t operator>=(fvec a, fvec b) {
+  return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)));
+}
+
+#elif defined(__SSE4_1__)
+
+struct fvec {
+  static constexpr int width = 4;
+  __m128 v;
+
+  fvec() {}
+  fvec(__m128 v) : v(v) {}
+  fvec(float x) : v(_mm_set1_ps(x)) {}
+
+  static fvec load(const float *p) { return _mm_loadu_ps(p); }
+};
+
+inline fvec operator+(fvec a, fvec b) { return _mm_add_ps(a.v, b.v); }
+inline fvec operator-(fvec a, fvec b) { return _mm_sub_ps(a.v, b.v); }
+inline fvec operator*(fvec a, fvec b) { return _mm_mul_ps(a.v, b.v); }
+inline fvec sqrt(fvec a) { return _mm_sqrt_ps(a.v); }
+inline fvec max(fvec a, fvec b) { return _mm_max_ps(a.v, b.v); }
+
+inline uint32_t operator<(fvec a, fvec b) {
+  return uint32_t(_mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)));
+}
+inline uint32_t operator>(fvec a, fvec b) { return b < a; }
+inline uint32_t operator>=(fvec a, fvec b) {
+  return uint32_t(_mm_movemask_ps(_mm_cmpge_ps(a.v, b.v)));
+}
+
+#else
+
+struct fvec {
+  static constexpr int width = 1;
+  float v;
+
+  fvec() {}
+  fvec(float x) : v(x) {}
+
+  static fvec load(const float *p) { return *p; }
+};
+
+inline fvec operator+(fvec a, fvec b) { return a.v + b.v; }
+inline fvec operator-(fvec a, fvec b) { return a.v - b.v; }
+inline fvec operator*(fvec a, fvec b) { return a.v * b.v; }
+inline fvec sqrt(fvec a) { return std::sqrt(a.v); }
+inline fvec max(fvec a, fvec b) { return a.v > b.v ? a.v : b.v; }
+
+inline uint32_t operator<(fvec a, fvec b) { return a.v < b.v; }
+inline uint32_t operator>(fvec a, fvec b) { return b < a; }
+inline uint32_t operator>=(fvec a, fvec b) { return a.v >= b.v; }
+
+#endif
+
+#endif
@@ -2,12 +2,58 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "lights.h"
+#include "material.h"
 #include "rtweekend.h"
 
+#include <algorithm>
+#include <limits>
+
+// Ray/sphere test shared by sphere and sphere_set, fills in everything but
+// the material. The discriminant is in the form from Ray Tracing Gems ch. 7,
+// which avoids the cancellation in h*h - a*c on spheres that are large next
+// to their distance from the ray. The hit point is projected back onto the
+// sphere, leaving an error of a few ulps of the centre and radius
+inline bool hit_sphere(const ray &r, const point3 &centre, real radius,
+                       interval ray_t, hit_record &rec) {
+  vec3 oc = centre - r.origin();
+  auto a = r.direction().length_squared();
+  auto k = dot(r.direction(), oc) / a;
+  vec3 f = oc - k * r.direction();
+  auto discriminant = radius * radius - f.length_squared();
+
+  if (discriminant < 0) {
+    return false;
+  }
+
+  auto sqrtd = std::sqrt(discriminant / a);
+
+  // Find the nearest root that lies in acceptable range
+  auto root = k - sqrtd;
+  if (!ray_t.surrounds(root)) {
+    root = k + sqrtd;
+    if (!ray_t.surrounds(root)) {
+      return false;
+    }
+  }
+
+  rec.t = root;
+  vec3 outward_norm = unit_vector(r.at(rec.t) - centre);
+  rec.p = centre + radius * outward_norm;
+  rec.set_face_normal(r, outward_norm);
+
+  constexpr real eps = std::numeric_limits<real>::epsilon();
+  real extent = std::max({std::fabs(centre.x()), std::fabs(centre.y()),
+                          std::fabs(centre.z())}) +
+                radius;
+  rec.p_error = 8 * eps * extent;
+  return true;
+}
+
 class sphere : public hittable {
 public:
   // Stationary
-  sphere(const point3 &static_centre, double radius, shared_ptr<material> mat)
+  sphere(const point3 &static_centre, real radius, shared_ptr<material> mat)
       : centre(static_centre, vec3(0, 0, 0)), radius(std::fmax(0, radius)),
         mat(mat) {
             auto rvec = vec3(radius, radius, radius);
@@ -15,7 +61,7 @@ public:
         }
 
   // Moving
-  sphere(const point3 &centre, const point3 &centre2, double radius,
+  sphere(const point3 &centre, const point3 &centre2, real radius,
          shared_ptr<material> mat)
       : centre(centre, centre2 - centre), radius(std::fmax(0, radius)),
         mat(mat) {
@@ -31,41 +77,35 @@ public:
         return bbox;
     }
 
-  bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
-    point3 curr_centre = centre.at(r.time());
-    vec3 oc = curr_centre - r.origin();
-    auto a = r.direction().length_squared();
-    auto h = dot(r.direction(), oc);
-    auto c = oc.length_squared() - radius * radius;
-    auto discriminant = h * h - a * c;
-
-    if (discriminant < 0) {
+  bool motion_bounds(aabb &start, aabb &end) const override {
+    if (centre.direction().near_zero()) {
       return false;
     }
+    auto rvec = vec3(radius, radius, radius);
+    start = aabb(centre.at(0) - rvec, centre.at(0) + rvec);
+    end = aabb(centre.at(1) - rvec, centre.at(1) + rvec);
+    return true;
+  }
 
-    auto sqrtd = std::sqrt(discriminant);
-
-    // Find the nearest root that lies in acceptable range
-    auto root = (h - sqrtd) / a;
-    if (!ray_t.surrounds(root)) {
-      root = (h + sqrtd) / a;
-      if (!ray_t.surrounds(root)) {
-        return false;
-      }
+  bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+    stat_add(stat_counter::sphere_tests);
+    if (!hit_sphere(r, centre.at(r.time()), radius, ray_t, rec)) {
+      return false;
     }
-
-    rec.t = root;
-    rec.p = r.at(rec.t);
-    vec3 outward_norm = (rec.p - curr_centre) / radius;
-    rec.set_face_normal(r, outward_norm);
-    rec.mat = mat;
-
+    rec.mat = mat.get();
     return true;
   }
 
+  void add_lights(light_list &lights) const override {
+    colour radiance = mat->emitted();
+    if (radiance.length_squared() > 0) {
+      lights.add_sphere(centre.origin(), centre.direction(), radius, radiance);
+    }
+  }
+
 private:
   ray centre;
-  double radius;
+  real radius;
   shared_ptr<material> mat;
   aabb bbox;
 };
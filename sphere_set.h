@@ -0,0 +1,498 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "bvh.h"
+#include "bvh_packet.h"
+#include "cache_io.h"
+#include "hittable.h"
+#include "lights.h"
+#include "material.h"
+#include "rtweekend.h"
+#include "simd.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Many spheres stored structure of arrays in float, about 32 bytes each plus
+// their share of an internal BVH. Leaves hold up to fvec::width spheres which
+// are tested together in one pass of vector instructions. The float test only
+// picks candidates, each candidate is then confirmed in real with the same
+// maths as sphere::hit so hit points keep full precision
+class sphere_set : public hittable {
+public:
+  // Stationary
+  void add(const point3 &centre, real radius, shared_ptr<material> mat) {
+    add(centre, centre, radius, mat);
+  }
+
+  // Moving, centre at time 0 to centre2 at time 1
+  void add(const point3 &centre, const point3 &centre2, real radius,
+           shared_ptr<material> mat) {
+    vec3 motion = centre2 - centre;
+    for (int axis = 0; axis < 3; axis++) {
+      pending.centre[axis].push_back(float(centre[axis]));
+      pending.motion[axis].push_back(float(motion[axis]));
+    }
+    pending.radius.push_back(float(std::fmax(0, radius)));
+    pending.mat.push_back(material_index(mat));
+  }
+
+  // Builds the internal BVH. Must be called after the last add and before
+  // rendering
+  void build(bvh_build_options options = {}) {
+    data = std::move(pending);
+    pending = arrays();
+
+    size_t count = data.radius.size();
+    std::vector<aabb> bounds(count);
+    for (size_t i = 0; i < count; i++) {
+      bounds[i] = sphere_box(data, i);
+    }
+
+    options.max_leaf_size = std::max(options.max_leaf_size, fvec::width);
+    options.leaf_batch_size = fvec::width;
+    auto result = build_bvh(bounds, options);
+    nodes = std::move(result.nodes);
+    bbox = result.bounds;
+    stats = std::move(result.stats);
+
+    width = options.width;
+
+    // Store the spheres in leaf order, padded so a full vector load from the
+    // last leaf stays inside the arrays
+    arrays sorted;
+    for (uint32_t index : result.order) {
+      sorted.append(data, index);
+    }
+    for (int pad = 0; pad < fvec::width; pad++) {
+      sorted.append_empty();
+    }
+    data = std::move(sorted);
+
+    // With moving spheres a copy of the tree is fitted to their boxes at
+    // time 0 and another to their boxes at time 1, and traversal
+    // interpolates the two by ray time instead of testing boxes around each
+    // whole swept path, when the SAH says that pays
+    has_motion = false;
+    for (size_t i = 0; i < count && !has_motion; i++) {
+      has_motion = data.motion[0][i] != 0 || data.motion[1][i] != 0 ||
+                   data.motion[2][i] != 0;
+    }
+    moving = false;
+    motion_nodes.clear();
+    motion_wide4.clear();
+    motion_wide8.clear();
+    if (has_motion) {
+      std::vector<aabb> starts(count), ends(count);
+      for (size_t i = 0; i < count; i++) {
+        starts[i] = sphere_box_at(data, i, 0);
+        ends[i] = sphere_box_at(data, i, 1);
+      }
+      auto start_nodes = nodes;
+      auto end_nodes = nodes;
+      refit_bvh(start_nodes, starts);
+      refit_bvh(end_nodes, ends);
+      moving = bvh_motion_pays(nodes, start_nodes, end_nodes, options);
+      if (moving && width == 4) {
+        motion_wide4 = collapse_bvh_motion<4>(start_nodes, end_nodes);
+      } else if (moving && width == 8) {
+        motion_wide8 = collapse_bvh_motion<8>(start_nodes, end_nodes);
+      } else if (moving) {
+        motion_nodes = make_motion_nodes(start_nodes, end_nodes);
+      }
+    }
+
+    if (!moving && width == 4) {
+      wide4 = collapse_bvh<4>(nodes);
+    } else if (!moving && width == 8) {
+      wide8 = collapse_bvh<8>(nodes);
+    }
+  }
+
+  bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+    const leaf_ray lr(r);
+    auto leaf = [&](uint32_t first, uint32_t count, interval &t) {
+      return hit_leaf(lr, r, first, count, t, rec);
+    };
+    return traverse<false>(r, ray_t, leaf);
+  }
+
+  bool occluded(const ray &r, interval ray_t) const override {
+    const leaf_ray lr(r);
+    hit_record rec;
+    auto leaf = [&](uint32_t first, uint32_t count, interval &t) {
+      return hit_leaf<true>(lr, r, first, count, t, rec);
+    };
+    return traverse<true>(r, ray_t, leaf);
+  }
+
+  // Moving sets keep to their motion trees one ray at a time, the swept
+  // boxes are too loose to share
+  void hit_packet(const ray_packet &packet, packet_hits &hits) const override {
+    if (!packet.coherent || moving) {
+      hittable::hit_packet(packet, hits);
+      return;
+    }
+
+    auto leaf = [&](uint32_t first, uint32_t count, int k) {
+      const ray &r = packet.rays[k];
+      if (hit_leaf(leaf_ray(r), r, first, count, hits.t[k], hits.rec[k])) {
+        hits.mask |= uint64_t(1) << k;
+      }
+    };
+
+    switch (width) {
+    case 4:
+      bvh_traverse_wide_packet<4>(wide4, packet, hits, leaf);
+      break;
+    case 8:
+      bvh_traverse_wide_packet<8>(wide8, packet, hits, leaf);
+      break;
+    default:
+      bvh_traverse_packet(nodes, packet, hits, leaf);
+      break;
+    }
+  }
+
+  aabb bounding_box() const override { return bbox; }
+
+  void add_lights(light_list &lights) const override {
+    // The padding after the last leaf has radius 0
+    for (size_t i = 0; i < data.radius.size(); i++) {
+      if (data.radius[i] <= 0) {
+        continue;
+      }
+      colour radiance = material_ptrs[data.mat[i]]->emitted();
+      if (radiance.length_squared() > 0) {
+        lights.add_sphere(
+            point3(data.centre[0][i], data.centre[1][i], data.centre[2][i]),
+            vec3(data.motion[0][i], data.motion[1][i], data.motion[2][i]),
+            data.radius[i], radiance);
+      }
+    }
+  }
+
+  bool motion_bounds(aabb &start, aabb &end) const override {
+    if (!has_motion) {
+      return false;
+    }
+    start = aabb::empty;
+    end = aabb::empty;
+    for (size_t i = 0; i < data.radius.size(); i++) {
+      start = aabb(start, sphere_box_at(data, i, 0));
+      end = aabb(end, sphere_box_at(data, i, 1));
+    }
+    return true;
+  }
+
+  const bvh_build_stats &build_stats() const { return stats; }
+
+  // Writes the built set, arrays and BVH as they are in memory
+  void save(cache_writer &out) const {
+    for (int axis = 0; axis < 3; axis++) {
+      out.write_array(data.centre[axis]);
+      out.write_array(data.motion[axis]);
+    }
+    out.write_array(data.radius);
+    out.write_array(data.mat);
+
+    std::vector<uint32_t> material_ids;
+    for (const material *mat : material_ptrs) {
+      material_ids.push_back(out.material_id(mat));
+    }
+    out.write_array(material_ids);
+
+    // Only the tree the set traverses is kept, the others are stored empty
+    const decltype(nodes) no_nodes;
+    const decltype(wide4) no_wide4;
+    const decltype(wide8) no_wide8;
+    const decltype(motion_nodes) no_motion_nodes;
+    const decltype(motion_wide4) no_motion_wide4;
+    const decltype(motion_wide8) no_motion_wide8;
+    bool binary = width != 4 && width != 8;
+    out.write_array(!moving && binary ? nodes : no_nodes);
+    out.write_array(!moving && width == 4 ? wide4 : no_wide4);
+    out.write_array(!moving && width == 8 ? wide8 : no_wide8);
+    out.write(uint8_t(has_motion));
+    out.write(uint8_t(moving));
+    out.write_array(moving && binary ? motion_nodes : no_motion_nodes);
+    out.write_array(moving && width == 4 ? motion_wide4 : no_motion_wide4);
+    out.write_array(moving && width == 8 ? motion_wide8 : no_motion_wide8);
+    out.write(int32_t(width));
+    out.write(bbox);
+    write_bvh_stats(out, stats);
+  }
+
+  // Replaces this set with one written by save, ready to render without a
+  // build
+  bool load(cache_reader &in) {
+    *this = sphere_set();
+    for (int axis = 0; axis < 3; axis++) {
+      in.read_array(data.centre[axis]);
+      in.read_array(data.motion[axis]);
+    }
+    in.read_array(data.radius);
+    in.read_array(data.mat);
+
+    std::vector<uint32_t> material_ids;
+    in.read_array(material_ids);
+    for (uint32_t id : material_ids) {
+      material_index(in.material_at(id));
+    }
+
+    int32_t saved_width = 2;
+    uint8_t saved_has_motion = 0, saved_moving = 0;
+    in.read_array(nodes);
+    in.read_array(wide4);
+    in.read_array(wide8);
+    in.read(saved_has_motion);
+    in.read(saved_moving);
+    in.read_array(motion_nodes);
+    in.read_array(motion_wide4);
+    in.read_array(motion_wide8);
+    in.read(saved_width);
+    has_motion = saved_has_motion != 0;
+    moving = saved_moving != 0;
+    in.read(bbox);
+    read_bvh_stats(in, stats);
+    width = saved_width;
+
+    // Leaves are read a whole vector at a time, so the padding this build
+    // needs must be there
+    size_t count = data.radius.size();
+    bool consistent = count >= size_t(fvec::width);
+    for (int axis = 0; axis < 3; axis++) {
+      consistent = consistent && data.centre[axis].size() == count &&
+                   data.motion[axis].size() == count;
+    }
+    consistent = consistent && data.mat.size() == count;
+    for (uint32_t mat : data.mat) {
+      consistent = consistent && mat < materials.size();
+    }
+    // The tree must stay inside the arrays, since nothing checks it during
+    // traversal
+    consistent = consistent && (width == 2 || width == 4 || width == 8) &&
+                 trees_valid(count - fvec::width);
+    return in.good() && consistent;
+  }
+
+private:
+  struct arrays {
+    std::vector<float> centre[3];
+    std::vector<float> motion[3];
+    std::vector<float> radius;
+    std::vector<uint32_t> mat;
+
+    void append(const arrays &from, size_t i) {
+      for (int axis = 0; axis < 3; axis++) {
+        centre[axis].push_back(from.centre[axis][i]);
+        motion[axis].push_back(from.motion[axis][i]);
+      }
+      radius.push_back(from.radius[i]);
+      mat.push_back(from.mat[i]);
+    }
+
+    void append_empty() {
+      for (int axis = 0; axis < 3; axis++) {
+        centre[axis].push_back(0);
+        motion[axis].push_back(0);
+      }
+      radius.push_back(0);
+      mat.push_back(0);
+    }
+  };
+
+  // Ray values broadcast once per traversal rather than once per leaf
+  struct leaf_ray {
+    fvec orig[3];
+    fvec dir[3];
+    fvec time;
+    fvec inv_a;
+    fvec orig_slack; // how far rounding the origin to float can move t
+
+    leaf_ray(const ray &r) {
+      for (int axis = 0; axis < 3; axis++) {
+        orig[axis] = float(r.origin()[axis]);
+        dir[axis] = float(r.direction()[axis]);
+      }
+      time = float(r.time());
+      inv_a = float(1.0 / r.direction().length_squared());
+      const vec3 &o = r.origin();
+      orig_slack = float(1e-6 * (std::fabs(o.x()) + std::fabs(o.y()) +
+                                 std::fabs(o.z())) /
+                         r.direction().length());
+    }
+  };
+
+  arrays pending;
+  arrays data;
+  std::vector<shared_ptr<material>> materials;
+  std::vector<const material *> material_ptrs;
+  std::unordered_map<const material *, uint32_t> material_lookup;
+
+  std::vector<bvh_linear_node> nodes;
+  std::vector<bvh_wide_node<4>> wide4;
+  std::vector<bvh_wide_node<8>> wide8;
+  int width = 2;
+  aabb bbox;
+  bvh_build_stats stats;
+
+  // has_motion is set when any sphere moves, moving when one of these is
+  // traversed instead of the trees above
+  bool has_motion = false;
+  bool moving = false;
+  std::vector<bvh_motion_node> motion_nodes;
+  std::vector<bvh_wide_motion_node<4>> motion_wide4;
+  std::vector<bvh_wide_motion_node<8>> motion_wide8;
+
+  uint32_t material_index(const shared_ptr<material> &mat) {
+    auto found = material_lookup.find(mat.get());
+    if (found != material_lookup.end()) {
+      return found->second;
+    }
+    uint32_t index = uint32_t(materials.size());
+    materials.push_back(mat);
+    material_ptrs.push_back(mat.get());
+    material_lookup[mat.get()] = index;
+    return index;
+  }
+
+  static aabb sphere_box_at(const arrays &a, size_t i, real time) {
+    point3 c = point3(a.centre[0][i], a.centre[1][i], a.centre[2][i]) +
+               time * vec3(a.motion[0][i], a.motion[1][i], a.motion[2][i]);
+    auto rvec = vec3(a.radius[i], a.radius[i], a.radius[i]);
+    return aabb(c - rvec, c + rvec);
+  }
+
+  static aabb sphere_box(const arrays &a, size_t i) {
+    point3 c0(a.centre[0][i], a.centre[1][i], a.centre[2][i]);
+    point3 c1 = c0 + vec3(a.motion[0][i], a.motion[1][i], a.motion[2][i]);
+    auto rvec = vec3(a.radius[i], a.radius[i], a.radius[i]);
+    return aabb(aabb(c0 - rvec, c0 + rvec), aabb(c1 - rvec, c1 + rvec));
+  }
+
+  // Whether the tree traverse() walks is valid over primitive_count spheres
+  // and every other tree is empty, as save() writes them
+  bool trees_valid(size_t primitive_count) const {
+    auto check = [&](bool kept, const auto &tree) {
+      return kept ? bvh_valid(tree, primitive_count) : tree.empty();
+    };
+    return check(!moving && width == 2, nodes) &&
+           check(!moving && width == 4, wide4) &&
+           check(!moving && width == 8, wide8) &&
+           check(moving && width == 2, motion_nodes) &&
+           check(moving && width == 4, motion_wide4) &&
+           check(moving && width == 8, motion_wide8);
+  }
+
+  // Whichever tree build() kept. With any_hit the walk stops at the first
+  // hit, see bvh_traverse
+  template <bool any_hit, typename LeafFn>
+  bool traverse(const ray &r, interval ray_t, LeafFn &&leaf) const {
+    if (moving) {
+      switch (width) {
+      case 4:
+        return bvh_traverse_wide_motion<4, any_hit>(motion_wide4, r, ray_t,
+                                                    leaf);
+      case 8:
+        return bvh_traverse_wide_motion<8, any_hit>(motion_wide8, r, ray_t,
+                                                    leaf);
+      default:
+        return bvh_traverse_motion<any_hit>(motion_nodes, r, ray_t, leaf);
+      }
+    }
+
+    switch (width) {
+    case 4:
+      return bvh_traverse_wide<4, any_hit>(wide4, r, ray_t, leaf);
+    case 8:
+      return bvh_traverse_wide<8, any_hit>(wide8, r, ray_t, leaf);
+    default:
+      return bvh_traverse<any_hit>(nodes, r, ray_t, leaf);
+    }
+  }
+
+  // With any_hit it returns at the first sphere hit rather than the closest
+  template <bool any_hit = false>
+  bool hit_leaf(const leaf_ray &lr, const ray &r, uint32_t first,
+                uint32_t count, interval &ray_t, hit_record &rec) const {
+    // Loose float bounds, the exact check makes the final call
+    const fvec tmin = float(ray_t.min);
+    const fvec tmax = float(ray_t.max);
+    bool hit_anything = false;
+    stat_add(stat_counter::sphere_tests, count);
+
+    for (uint32_t base = first; base < first + count; base += fvec::width) {
+      fvec oc[3];
+      for (int axis = 0; axis < 3; axis++) {
+        fvec centre = fvec::load(&data.centre[axis][base]) +
+                      lr.time * fvec::load(&data.motion[axis][base]);
+        oc[axis] = centre - lr.orig[axis];
+      }
+      fvec h = lr.dir[0] * oc[0] + lr.dir[1] * oc[1] + lr.dir[2] * oc[2];
+
+      // Discriminant in the form from Ray Tracing Gems ch. 7, which avoids
+      // the cancellation in h*h - a*c that float can't afford on big spheres
+      fvec k = h * lr.inv_a;
+      fvec f[3];
+      for (int axis = 0; axis < 3; axis++) {
+        f[axis] = oc[axis] - k * lr.dir[axis];
+      }
+      fvec radius = fvec::load(&data.radius[base]);
+      fvec r2 = radius * radius;
+      fvec disc = r2 - (f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+      uint32_t mask = disc >= fvec(-1e-4f) * r2;
+
+      fvec sqrtd = sqrt(max(disc, fvec(0.0f)) * lr.inv_a);
+      fvec t0 = k - sqrtd;
+      fvec t1 = k + sqrtd;
+
+      // The float roots are only good to an absolute error, which scales
+      // with the sphere rather than with t. A few ulps lost in disc become
+      // their square root in sqrtd, so t is off by up to about
+      // sqrt(eps) (|oc| + radius) / |d|, a good part of a unit near the
+      // edge of the radius 1000 ground. The window is widened by that, with
+      // room to spare, and by the shift from rounding the origin to float
+      fvec oc2 = oc[0] * oc[0] + oc[1] * oc[1] + oc[2] * oc[2];
+      fvec slack =
+          fvec(4e-3f) * sqrt(fvec(2.0f) * (oc2 + r2) * lr.inv_a) +
+          lr.orig_slack;
+      fvec lo = tmin - slack, hi = tmax + slack;
+      mask &= ((t0 > lo) & (t0 < hi)) | ((t1 > lo) & (t1 < hi));
+
+      uint32_t lanes = std::min<uint32_t>(fvec::width, first + count - base);
+      mask &= (1u << lanes) - 1;
+
+      while (mask) {
+        int lane = __builtin_ctz(mask);
+        mask &= mask - 1;
+        if (hit_exact(r, base + lane, ray_t, rec)) {
+          if constexpr (any_hit) {
+            return true;
+          }
+          hit_anything = true;
+          ray_t.max = rec.t;
+        }
+      }
+    }
+    return hit_anything;
+  }
+
+  bool hit_exact(const ray &r, size_t i, interval ray_t,
+                 hit_record &rec) const {
+    point3 curr_centre =
+        point3(data.centre[0][i], data.centre[1][i], data.centre[2][i]) +
+        r.time() * vec3(data.motion[0][i], data.motion[1][i], data.motion[2][i]);
+    if (!hit_sphere(r, curr_centre, data.radius[i], ray_t, rec)) {
+      return false;
+    }
+    rec.mat = material_ptrs[data.mat[i]];
+
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Counters for where render time goes. They are compiled in only when
+// RT_STATS is defined (-DRT_STATS=ON in CMake). Otherwise every call below
+// is an empty inline function, so the hot paths stay exactly as they were
+#ifdef RT_STATS
+constexpr bool stats_enabled = true;
+#else
+constexpr bool stats_enabled = false;
+#endif
+
+enum class stat_counter : int {
+  box_tests, // one per box, a wide node counts all its lanes
+  sphere_tests,
+  triangle_tests,
+  tetrahedron_tests,
+  lambertian_scatters,
+  metal_scatters,
+  dielectric_scatters,
+  shadow_rays, // occlusion queries towards the lights
+  count
+};
+
+inline const char *stat_name(stat_counter s) {
+  static const char *const names[] = {
+      "box_tests",          "sphere_tests",        "triangle_tests",
+      "tetrahedron_tests",  "lambertian_scatters", "metal_scatters",
+      "dielectric_scatters", "shadow_rays"};
+  return names[int(s)];
+}
+
+// Rays are counted by bounce depth, 0 being camera rays. Depths from
+// stat_depths - 1 on share the last slot
+constexpr int stat_depths = 16;
+
+struct stat_counts {
+  uint64_t values[int(stat_counter::count)] = {};
+  uint64_t rays[stat_depths] = {};
+
+  uint64_t operator[](stat_counter s) const { return values[int(s)]; }
+
+  uint64_t total_rays() const {
+    uint64_t total = 0;
+    for (uint64_t n : rays) {
+      total += n;
+    }
+    return total;
+  }
+
+  // Box and primitive tests, the cost the traversal heatmap shows
+  uint64_t traversal_cost() const {
+    return values[int(stat_counter::box_tests)] +
+           values[int(stat_counter::sphere_tests)] +
+           values[int(stat_counter::triangle_tests)] +
+           values[int(stat_counter::tetrahedron_tests)];
+  }
+
+  stat_counts &operator+=(const stat_counts &other) {
+    for (int i = 0; i < int(stat_counter::count); i++) {
+      values[i] += other.values[i];
+    }
+    for (int depth = 0; depth < stat_depths; depth++) {
+      rays[depth] += other.rays[depth];
+    }
+    return *this;
+  }
+
+  void print(std::ostream &out) const {
+    uint64_t total = total_rays();
+    double per_ray = total > 0 ? 1.0 / total : 0;
+    out << "Rays: " << rays[0] << " camera, " << total - rays[0]
+        << " secondary\n";
+    out << "Rays by depth:";
+    for (int depth = 0; depth < stat_depths; depth++) {
+      if (rays[depth] > 0) {
+        out << ' ' << depth << ':' << rays[depth];
+      }
+    }
+    out << '\n';
+    for (int i = 0; i < int(stat_counter::count); i++) {
+      out << stat_name(stat_counter(i)) << ": " << values[i] << " ("
+          << values[i] * per_ray << " per ray)\n";
+    }
+  }
+
+  // One JSON object on a single line
+  void write_json(std::ostream &out) const {
+    out << "{\"camera_rays\": " << rays[0] << ", \"rays_by_depth\": [";
+    for (int depth = 0; depth < stat_depths; depth++) {
+      out << (depth > 0 ? ", " : "") << rays[depth];
+    }
+    out << ']';
+    for (int i = 0; i < int(stat_counter::count); i++) {
+      out << ", \"" << stat_name(stat_counter(i)) << "\": " << values[i];
+    }
+    out << '}';
+  }
+};
+
+namespace stats_detail {
+
+// Each thread's counters sit on cache lines of their own, so threads
+// counting at the same time never write to a shared line
+struct alignas(64) thread_counts {
+  stat_counts counts;
+};
+
+struct registry {
+  std::mutex lock;
+  std::vector<std::unique_ptr<thread_counts>> threads;
+};
+
+inline registry &global() {
+  static registry r;
+  return r;
+}
+
+inline thread_counts *register_thread() {
+  registry &r = global();
+  std::lock_guard<std::mutex> guard(r.lock);
+  r.threads.push_back(std::make_unique<thread_counts>());
+  return r.threads.back().get();
+}
+
+} // namespace stats_detail
+
+// The calling thread's counters. Only read them from the thread itself, or
+// through stats_merged once the threads have stopped counting
+inline stat_counts &thread_stats() {
+  thread_local stats_detail::thread_counts *local =
+      stats_detail::register_thread();
+  return local->counts;
+}
+
+inline void stat_add(stat_counter s, uint64_t n = 1) {
+  if constexpr (stats_enabled) {
+    thread_stats().values[int(s)] += n;
+  }
+}
+
+inline void stat_ray(int depth) {
+  if constexpr (stats_enabled) {
+    thread_stats().rays[depth < stat_depths ? depth : stat_depths - 1]++;
+  }
+}
+
+// Sum over every thread that has counted anything. Not safe while threads
+// are still counting
+inline stat_counts stats_merged() {
+  stat_counts total;
+  auto &r = stats_detail::global();
+  std::lock_guard<std::mutex> guard(r.lock);
+  for (const auto &t : r.threads) {
+    total += t->counts;
+  }
+  return total;
+}
+
+inline void stats_reset() {
+  auto &r = stats_detail::global();
+  std::lock_guard<std::mutex> guard(r.lock);
+  for (auto &t : r.threads) {
+    t->counts = stat_counts();
+  }
+}
+
+#endif
@@ -2,41 +2,42 @@
 #define TETRAHEDRON_H
 
 #include "hittable.h"
+#include "triangle.h"
 
 // A helper function to test for an intersection with a single triangle.
 // It's placed outside the class as a static utility since it doesn't depend on instance state.
 static bool hit_one_triangle(const ray& r, interval ray_t, hit_record& rec, const point3& v0,
-                             const point3& v1, const point3& v2, shared_ptr<material> mat) {
+                             const point3& v1, const point3& v2, const material* mat) {
     const vec3 edge1 = v1 - v0;
     const vec3 edge2 = v2 - v0;
     const vec3 pvec = cross(r.direction(), edge2);
-    const double det = dot(edge1, pvec);
+    const real det = dot(edge1, pvec);
 
     if (fabs(det) < 1e-8) {
         return false; // Ray is parallel to the triangle
     }
 
-    const double inv_det = 1.0 / det;
+    const real inv_det = 1.0 / det;
     const vec3 tvec = r.origin() - v0;
-    const double u = dot(tvec, pvec) * inv_det;
+    const real u = dot(tvec, pvec) * inv_det;
     if (u < 0.0 || u > 1.0) {
         return false;
     }
 
     const vec3 qvec = cross(tvec, edge1);
-    const double v = dot(r.direction(), qvec) * inv_det;
+    const real v = dot(r.direction(), qvec) * inv_det;
     if (v < 0.0 || u + v > 1.0) {
         return false;
     }
 
-    const double t = dot(edge2, qvec) * inv_det;
-    if (!ray_t.contains(t)) {
+    const real t = dot(edge2, qvec) * inv_det;
+    if (!ray_t.surrounds(t)) {
         return false;
     }
 
     // A valid hit was found, record the details.
     rec.t = t;
-    rec.p = r.at(t);
+    set_triangle_point(rec, v0, edge1, edge2, u, v);
     rec.mat = mat;
     vec3 outward_normal = unit_vector(cross(edge1, edge2));
     rec.set_face_normal(r, outward_normal);
@@ -49,52 +50,65 @@ class tetrahedron : public hittable {
     // Constructor now takes four points to define the tetrahedron
     tetrahedron(const point3& p0, const point3& p1, const point3& p2, const point3& p3,
                 shared_ptr<material> m)
-        : v0(p0), v1(p1), v2(p2), v3(p3), mat_ptr(m) {}
+        : v0(p0), v1(p1), v2(p2), v3(p3), mat_ptr(m) {
+        bbox = aabb(aabb(v0, v1), aabb(v2, v3));
+    }
+
+    aabb bounding_box() const override { return bbox; }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        hit_record temp_rec;
+        stat_add(stat_counter::tetrahedron_tests);
         bool hit_anything = false;
 
-        // The interval is shrunk each time a closer intersection is found.
+        // The interval is shrunk each time a closer intersection is found, so
+        // rec can be written in place; a face only writes it on a closer hit
         interval current_interval = ray_t;
 
         // Define the four faces with consistent counter-clockwise winding for outward normals.
         // 
 
         // Face 1: v0, v1, v2
-        if (hit_one_triangle(r, current_interval, temp_rec, v0, v1, v2, mat_ptr)) {
+        if (hit_one_triangle(r, current_interval, rec, v0, v1, v2, mat_ptr.get())) {
             hit_anything = true;
-            current_interval.max = temp_rec.t;
-            rec = temp_rec;
+            current_interval.max = rec.t;
         }
 
         // Face 2: v0, v2, v3
-        if (hit_one_triangle(r, current_interval, temp_rec, v0, v2, v3, mat_ptr)) {
+        if (hit_one_triangle(r, current_interval, rec, v0, v2, v3, mat_ptr.get())) {
             hit_anything = true;
-            current_interval.max = temp_rec.t;
-            rec = temp_rec;
+            current_interval.max = rec.t;
         }
 
         // Face 3: v0, v3, v1
-        if (hit_one_triangle(r, current_interval, temp_rec, v0, v3, v1, mat_ptr)) {
+        if (hit_one_triangle(r, current_interval, rec, v0, v3, v1, mat_ptr.get())) {
             hit_anything = true;
-            current_interval.max = temp_rec.t;
-            rec = temp_rec;
+            current_interval.max = rec.t;
         }
 
         // Face 4: v1, v3, v2
-        if (hit_one_triangle(r, current_interval, temp_rec, v1, v3, v2, mat_ptr)) {
+        if (hit_one_triangle(r, current_interval, rec, v1, v3, v2, mat_ptr.get())) {
             hit_anything = true;
-            rec = temp_rec;
         }
 
         return hit_anything;
     }
 
+    // The four faces with the windings hit uses
+    void add_lights(light_list& lights) const override {
+        colour radiance = mat_ptr->emitted();
+        if (radiance.length_squared() > 0) {
+            lights.add_triangle(v0, v1 - v0, v2 - v0, radiance);
+            lights.add_triangle(v0, v2 - v0, v3 - v0, radiance);
+            lights.add_triangle(v0, v3 - v0, v1 - v0, radiance);
+            lights.add_triangle(v1, v3 - v1, v2 - v1, radiance);
+        }
+    }
+
   private:
     // Stores the four vertices of the tetrahedron
     point3 v0, v1, v2, v3;
     shared_ptr<material> mat_ptr;
+    aabb bbox;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,165 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A rectangle of pixels [x0, x1) x [y0, y1)
+struct tile {
+  int x0, y0, x1, y1;
+};
+
+struct tile_timing {
+  tile area;
+  int thread = 0;
+  double seconds = 0;    // summed over passes
+  double first_done = 0; // render start to the end of its first pass
+  uint64_t rays = 0;     // camera and scattered rays traced
+};
+
+enum class tile_order {
+  morton, // Z order, neighbouring tiles stay close in the list
+  spiral  // centre out, useful when watching a progressive preview
+};
+
+inline uint32_t morton_code(uint32_t x, uint32_t y) {
+  auto spread = [](uint32_t v) {
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+  };
+  return spread(x) | (spread(y) << 1);
+}
+
+inline std::vector<tile> make_tiles(int width, int height, int tile_size,
+                                    tile_order order) {
+  tile_size = std::max(1, tile_size);
+  int tiles_x = (width + tile_size - 1) / tile_size;
+  int tiles_y = (height + tile_size - 1) / tile_size;
+
+  struct keyed {
+    double key;
+    tile area;
+  };
+  std::vector<keyed> keyed_tiles;
+  keyed_tiles.reserve(size_t(tiles_x) * tiles_y);
+
+  for (int ty = 0; ty < tiles_y; ty++) {
+    for (int tx = 0; tx < tiles_x; tx++) {
+      tile t = {tx * tile_size, ty * tile_size,
+                std::min(width, (tx + 1) * tile_size),
+                std::min(height, (ty + 1) * tile_size)};
+
+      double key;
+      if (order == tile_order::morton) {
+        key = morton_code(uint32_t(tx), uint32_t(ty));
+      } else {
+        // Square rings around the centre, each ring walked by angle
+        double dx = tx - 0.5 * (tiles_x - 1);
+        double dy = ty - 0.5 * (tiles_y - 1);
+        double ring = std::ceil(std::fmax(std::fabs(dx), std::fabs(dy)));
+        key = ring * 8.0 + std::atan2(dy, dx) + 4.0;
+      }
+      keyed_tiles.push_back({key, t});
+    }
+  }
+
+  std::stable_sort(keyed_tiles.begin(), keyed_tiles.end(),
+                   [](const keyed &a, const keyed &b) { return a.key < b.key; });
+
+  std::vector<tile> tiles;
+  tiles.reserve(keyed_tiles.size());
+  for (const auto &k : keyed_tiles) {
+    tiles.push_back(k.area);
+  }
+  return tiles;
+}
+
+// Hands out tile indices to a fixed set of worker threads. Each thread owns
+// a contiguous run of the ordered tile list, so it works through
+// neighbouring tiles and keeps their BVH nodes warm in its cache. A thread
+// that runs out steals from the queue with the most work left. Claiming a
+// tile is a single fetch_add, owners and thieves never lock
+class tile_scheduler {
+public:
+  tile_scheduler(size_t tile_count, int thread_count)
+      : queues(new queue[std::max(1, thread_count)]),
+        queue_count(std::max(1, thread_count)) {
+    for (int q = 0; q < queue_count; q++) {
+      queues[q].next.store(int(tile_count * q / queue_count));
+      queues[q].end = int(tile_count * (q + 1) / queue_count);
+    }
+  }
+
+  // Returns false once every tile has been claimed
+  bool next(int thread, int &tile_index) {
+    if (claim(queues[thread % queue_count], tile_index)) {
+      return true;
+    }
+
+    while (true) {
+      int victim = -1;
+      int most_left = 0;
+      for (int q = 0; q < queue_count; q++) {
+        int left = queues[q].end - queues[q].next.load(std::memory_order_relaxed);
+        if (left > most_left) {
+          most_left = left;
+          victim = q;
+        }
+      }
+      if (victim < 0) {
+        return false;
+      }
+      if (claim(queues[victim], tile_index)) {
+        return true;
+      }
+    }
+  }
+
+private:
+  // Padded so queues owned by different threads never share a cache line
+  struct alignas(64) queue {
+    std::atomic<int> next{0};
+    int end = 0;
+  };
+
+  std::unique_ptr<queue[]> queues;
+  int queue_count;
+
+  static bool claim(queue &q, int &tile_index) {
+    if (q.next.load(std::memory_order_relaxed) >= q.end) {
+      return false;
+    }
+    int index = q.next.fetch_add(1, std::memory_order_relaxed);
+    if (index >= q.end) {
+      return false;
+    }
+    tile_index = index;
+    return true;
+  }
+};
+
+// One line per tile: position, size, the thread that rendered it, time and
+// rays traced
+inline bool write_tile_timings(const std::string &path,
+                               const std::vector<tile_timing> &timings) {
+  std::ofstream out(path);
+  out << "x,y,width,height,thread,ms,rays\n";
+  for (const auto &t : timings) {
+    out << t.area.x0 << ',' << t.area.y0 << ',' << (t.area.x1 - t.area.x0)
+        << ',' << (t.area.y1 - t.area.y0) << ',' << t.thread << ','
+        << t.seconds * 1000.0 << ',' << t.rays << '\n';
+  }
+  return bool(out);
+}
+
+#endif
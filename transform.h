@@ -0,0 +1,150 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "aabb.h"
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Affine map p -> M p + offset, stored as the three rows of M with the
+// offset as a fourth column
+class transform {
+public:
+  real m[3][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}};
+
+  static transform translate(const vec3 &offset) {
+    transform t;
+    for (int row = 0; row < 3; row++) {
+      t.m[row][3] = offset[row];
+    }
+    return t;
+  }
+
+  static transform scale(const vec3 &factors) {
+    transform t;
+    for (int row = 0; row < 3; row++) {
+      t.m[row][row] = factors[row];
+    }
+    return t;
+  }
+
+  static transform scale(real factor) {
+    return scale(vec3(factor, factor, factor));
+  }
+
+  // Rotation by degrees about an axis through the origin, anticlockwise
+  // looking down the axis (Rodrigues)
+  static transform rotate(const vec3 &axis, real degrees) {
+    vec3 a = unit_vector(axis);
+    real radians = deg_to_rad(degrees);
+    real c = std::cos(radians), s = std::sin(radians), k = 1 - c;
+
+    transform t;
+    t.m[0][0] = c + a.x() * a.x() * k;
+    t.m[0][1] = a.x() * a.y() * k - a.z() * s;
+    t.m[0][2] = a.x() * a.z() * k + a.y() * s;
+    t.m[1][0] = a.y() * a.x() * k + a.z() * s;
+    t.m[1][1] = c + a.y() * a.y() * k;
+    t.m[1][2] = a.y() * a.z() * k - a.x() * s;
+    t.m[2][0] = a.z() * a.x() * k - a.y() * s;
+    t.m[2][1] = a.z() * a.y() * k + a.x() * s;
+    t.m[2][2] = c + a.z() * a.z() * k;
+    return t;
+  }
+
+  point3 apply_point(const point3 &p) const {
+    return apply_vector(p) + vec3(m[0][3], m[1][3], m[2][3]);
+  }
+
+  vec3 apply_vector(const vec3 &v) const {
+    return vec3(m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+                m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+                m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+  }
+
+  // Multiplies by the transpose of M. On an inverse transform this is the
+  // matrix that carries normals the other way
+  vec3 apply_transposed(const vec3 &v) const {
+    return vec3(m[0][0] * v[0] + m[1][0] * v[1] + m[2][0] * v[2],
+                m[0][1] * v[0] + m[1][1] * v[1] + m[2][1] * v[2],
+                m[0][2] * v[0] + m[1][2] * v[1] + m[2][2] * v[2]);
+  }
+
+  // Bound on the error in each coordinate of apply_point(p), for a p whose
+  // coordinates are each within error: the error carried through M plus
+  // the rounding of the products and sums
+  real point_error(const point3 &p, real error) const {
+    constexpr real eps = std::numeric_limits<real>::epsilon();
+    real out = 0;
+    for (int row = 0; row < 3; row++) {
+      real carried = 0, extent = std::fabs(m[row][3]);
+      for (int col = 0; col < 3; col++) {
+        carried += std::fabs(m[row][col]) * error;
+        extent += std::fabs(m[row][col] * p[col]);
+      }
+      out = std::max(out, carried + 4 * eps * extent);
+    }
+    return out;
+  }
+
+  // Box around the transformed box, one row at a time (Arvo, Graphics Gems)
+  aabb apply_box(const aabb &box) const {
+    interval out[3];
+    for (int row = 0; row < 3; row++) {
+      real lo = m[row][3], hi = m[row][3];
+      for (int col = 0; col < 3; col++) {
+        const interval &in = box.axis_interval(col);
+        real a = m[row][col] * in.min;
+        real b = m[row][col] * in.max;
+        lo += std::fmin(a, b);
+        hi += std::fmax(a, b);
+      }
+      out[row] = interval(lo, hi);
+    }
+    return aabb(out[0], out[1], out[2]);
+  }
+
+  real determinant() const {
+    return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+           m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+           m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+  }
+
+  // M must not be singular
+  transform inverse() const {
+    real inv_det = 1.0 / determinant();
+    transform t;
+    t.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+    t.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    t.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    t.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+    t.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    t.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    t.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+    t.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    t.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+    vec3 offset = t.apply_vector(vec3(m[0][3], m[1][3], m[2][3]));
+    for (int row = 0; row < 3; row++) {
+      t.m[row][3] = -offset[row];
+    }
+    return t;
+  }
+};
+
+// a * b applies b first, then a
+inline transform operator*(const transform &a, const transform &b) {
+  transform t;
+  for (int row = 0; row < 3; row++) {
+    for (int col = 0; col < 4; col++) {
+      t.m[row][col] = a.m[row][0] * b.m[0][col] + a.m[row][1] * b.m[1][col] +
+                      a.m[row][2] * b.m[2][col];
+    }
+    t.m[row][3] += a.m[row][3];
+  }
+  return t;
+}
+
+#endif
@@ -2,62 +2,98 @@
 #define TRIANGLE_H
 
 #include "hittable.h"
+#include "lights.h"
+#include "material.h"
 #include "ray.h"
 #include "vec3.h"
+#include <algorithm>
 #include <cmath>
+#include <limits>
+
+// Sets the hit point from barycentric coordinates rather than from the ray,
+// so its error is a few ulps of the vertex coordinates instead of growing
+// with the distance along the ray
+inline void set_triangle_point(hit_record &rec, const point3 &v0,
+                               const vec3 &edge1, const vec3 &edge2, real u,
+                               real v) {
+  rec.p = v0 + u * edge1 + v * edge2;
+
+  constexpr real eps = std::numeric_limits<real>::epsilon();
+  real extent = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    extent = std::max(extent, std::fabs(v0[axis]) + std::fabs(edge1[axis]) +
+                                  std::fabs(edge2[axis]));
+  }
+  rec.p_error = 8 * eps * extent;
+}
 
 class triangle : public hittable {
 public:
   triangle(point3 v0, point3 v1, point3 v2, shared_ptr<material> m)
-      : v0(v0), v1(v1), v2(v2), mat_ptr(m) {}
+      : v0(v0), v1(v1), v2(v2), mat_ptr(m) {
+    bbox = aabb(aabb(v0, v1), aabb(v2, v2));
+  }
+
+  aabb bounding_box() const override { return bbox; }
 
   bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+    stat_add(stat_counter::triangle_tests);
 
     const vec3 edge1 = v1 - v0;
     const vec3 edge2 = v2 - v0;
     const vec3 pvec = cross(r.direction(), edge2);
-    const double det = dot(edge1, pvec);
+    const real det = dot(edge1, pvec);
 
     // If the ray is parallel to the triangle (culling)
     if (fabs(det) < 1e-8) {
         return false;
     }
 
-    const double inv_det = 1.0 / det;
+    const real inv_det = 1.0 / det;
     const vec3 tvec = r.origin() - v0;
-    const double u = dot(tvec, pvec) * inv_det;
+    const real u = dot(tvec, pvec) * inv_det;
 
     if (u < 0.0 || u > 1.0) {
         return false;
     }
 
     const vec3 qvec = cross(tvec, edge1);
-    const double v = dot(r.direction(), qvec) * inv_det;
+    const real v = dot(r.direction(), qvec) * inv_det;
 
     if (v < 0.0 || u + v > 1.0) {
         return false;
     }
 
-    const double t = dot(edge2, qvec) * inv_det;
+    const real t = dot(edge2, qvec) * inv_det;
 
-    // Use the interval's `contains` method for the check
-    if (!ray_t.contains(t)) {
+    // Strictly inside, so a ray leaving this triangle can't hit it at t = 0
+    if (!ray_t.surrounds(t)) {
         return false;
     }
 
     // A valid hit was found within the required interval.
     rec.t = t;
-    rec.p = r.at(t);
+    set_triangle_point(rec, v0, edge1, edge2, u, v);
     vec3 outward_normal = unit_vector(cross(edge1, edge2));
     rec.set_face_normal(r, outward_normal);
-    rec.mat = mat_ptr;
+    rec.mat = mat_ptr.get();
     
     return true;
   };
 
+  void add_lights(light_list &lights) const override {
+    colour radiance = mat_ptr->emitted();
+    if (radiance.length_squared() > 0) {
+      lights.add_triangle(v0, v1 - v0, v2 - v0, radiance);
+    }
+  }
+
 public:
   point3 v0, v1, v2;
   shared_ptr<material> mat_ptr;
+
+private:
+  aabb bbox;
 };
 
 #endif
\ No newline at end of file
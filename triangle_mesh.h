@@ -0,0 +1,401 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "bvh.h"
+#include "bvh_packet.h"
+#include "cache_io.h"
+#include "hittable.h"
+#include "lights.h"
+#include "material.h"
+#include "rtweekend.h"
+#include "triangle.h"
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Vertex and index buffers for an indexed triangle mesh. Held by shared_ptr
+// so loaders, meshes and instances can all refer to one copy
+struct mesh_buffers {
+  std::vector<float> positions; // x, y, z per vertex
+  std::vector<uint32_t> indices; // three vertex indices per triangle
+
+  size_t vertex_count() const { return positions.size() / 3; }
+  size_t triangle_count() const { return indices.size() / 3; }
+
+  point3 vertex(uint32_t index) const {
+    return point3(positions[3 * index], positions[3 * index + 1],
+                  positions[3 * index + 2]);
+  }
+};
+
+// A whole triangle mesh as one hittable, with its own BVH over the
+// triangles. Each triangle's first vertex and two edges are precomputed in
+// leaf order (36 bytes per triangle) so Moller-Trumbore starts straight from
+// them instead of gathering three vertices and subtracting on every test
+class triangle_mesh : public hittable {
+public:
+  // Empty, to be filled by load
+  triangle_mesh() : buffers(make_shared<mesh_buffers>()) {}
+
+  triangle_mesh(shared_ptr<const mesh_buffers> buffers,
+                shared_ptr<material> mat, bvh_build_options options = {})
+      : buffers(buffers), mat(mat), options(options) {
+    size_t count = buffers->triangle_count();
+    std::vector<aabb> bounds(count);
+    for (size_t tri = 0; tri < count; tri++) {
+      bounds[tri] = triangle_box(uint32_t(tri));
+    }
+
+    auto result = build_bvh(bounds, options);
+    nodes = std::move(result.nodes);
+    bbox = result.bounds;
+    stats = std::move(result.stats);
+    built_cost = bvh_sah_cost(nodes, options);
+    width = options.width;
+    collapse();
+
+    triangles.resize(count);
+    triangle_ids = std::move(result.order);
+    for (size_t slot = 0; slot < count; slot++) {
+      pack_triangle(slot);
+    }
+  }
+
+  // Moves the mesh to new vertex positions with the same index buffer, e.g.
+  // the next frame of a deforming animation. The BVH is refit rather than
+  // rebuilt unless that loses too much quality, see
+  // bvh_build_options::rebuild_ratio. A mesh whose vertex count or indices
+  // changed can't be refit, so it is rebuilt
+  bvh_refit_result refit(shared_ptr<const mesh_buffers> moved) {
+    auto start_time = std::chrono::steady_clock::now();
+    bvh_refit_result result;
+    // The leaves index triangles by the ids the tree was built with
+    bool same_shape = moved->positions.size() == buffers->positions.size() &&
+                      moved->indices == buffers->indices;
+
+    std::vector<aabb> slot_bounds;
+    if (same_shape) {
+      buffers = moved;
+      slot_bounds.resize(triangles.size());
+      for (size_t slot = 0; slot < triangles.size(); slot++) {
+        pack_triangle(slot);
+        slot_bounds[slot] = triangle_box(triangle_ids[slot]);
+      }
+      refit_bvh(nodes, slot_bounds);
+      result.cost_ratio =
+          built_cost > 0 ? bvh_sah_cost(nodes, options) / built_cost : 1;
+    }
+
+    // A mesh loaded from a cache with a wide tree has no binary tree to
+    // refit, so it is rebuilt too
+    if (!same_shape || nodes.empty() ||
+        result.cost_ratio > options.rebuild_ratio) {
+      *this = triangle_mesh(moved, mat, options);
+      result.rebuilt = true;
+    } else {
+      bbox = aabb::empty;
+      for (const auto &box : slot_bounds) {
+        bbox = aabb(bbox, box);
+      }
+      collapse();
+    }
+
+    auto end_time = std::chrono::steady_clock::now();
+    result.seconds =
+        std::chrono::duration<double>(end_time - start_time).count();
+    return result;
+  }
+
+  bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+    // Only the triangle index is tracked during traversal, the hit record is
+    // filled in once for the closest hit
+    uint32_t closest = 0;
+    real closest_t = 0, closest_u = 0, closest_v = 0;
+    auto leaf = [&](uint32_t first, uint32_t count, interval &t) {
+      bool hit_anything = false;
+      stat_add(stat_counter::triangle_tests, count);
+      for (uint32_t slot = first; slot < first + count; slot++) {
+        real hit_t, hit_u, hit_v;
+        if (intersect(triangles[slot], r, t, hit_t, hit_u, hit_v)) {
+          hit_anything = true;
+          t.max = hit_t;
+          closest = slot;
+          closest_t = hit_t;
+          closest_u = hit_u;
+          closest_v = hit_v;
+        }
+      }
+      return hit_anything;
+    };
+
+    if (!traverse<false>(r, ray_t, leaf)) {
+      return false;
+    }
+    fill_record(r, closest, closest_t, closest_u, closest_v, rec);
+    return true;
+  }
+
+  bool occluded(const ray &r, interval ray_t) const override {
+    auto leaf = [&](uint32_t first, uint32_t count, interval &t) {
+      for (uint32_t slot = first; slot < first + count; slot++) {
+        stat_add(stat_counter::triangle_tests);
+        real hit_t, hit_u, hit_v;
+        if (intersect(triangles[slot], r, t, hit_t, hit_u, hit_v)) {
+          return true;
+        }
+      }
+      return false;
+    };
+    return traverse<true>(r, ray_t, leaf);
+  }
+
+  void hit_packet(const ray_packet &packet, packet_hits &hits) const override {
+    if (!packet.coherent) {
+      hittable::hit_packet(packet, hits);
+      return;
+    }
+
+    // As in hit, only the closest triangle of each ray is tracked until the
+    // end. found marks the rays that hit this mesh
+    uint32_t closest[packet_max_rays];
+    real closest_u[packet_max_rays], closest_v[packet_max_rays];
+    uint64_t found = 0;
+    auto leaf = [&](uint32_t first, uint32_t count, int k) {
+      const ray &r = packet.rays[k];
+      interval &t = hits.t[k];
+      stat_add(stat_counter::triangle_tests, count);
+      for (uint32_t slot = first; slot < first + count; slot++) {
+        real hit_t, hit_u, hit_v;
+        if (intersect(triangles[slot], r, t, hit_t, hit_u, hit_v)) {
+          t.max = hit_t;
+          closest[k] = slot;
+          closest_u[k] = hit_u;
+          closest_v[k] = hit_v;
+          found |= uint64_t(1) << k;
+        }
+      }
+    };
+
+    switch (width) {
+    case 4:
+      bvh_traverse_wide_packet<4>(wide4, packet, hits, leaf);
+      break;
+    case 8:
+      bvh_traverse_wide_packet<8>(wide8, packet, hits, leaf);
+      break;
+    default:
+      bvh_traverse_packet(nodes, packet, hits, leaf);
+      break;
+    }
+
+    hits.mask |= found;
+    while (found) {
+      int k = __builtin_ctzll(found);
+      found &= found - 1;
+      fill_record(packet.rays[k], closest[k], hits.t[k].max, closest_u[k],
+                  closest_v[k], hits.rec[k]);
+    }
+  }
+
+  aabb bounding_box() const override { return bbox; }
+
+  void add_lights(light_list &lights) const override {
+    colour radiance = mat->emitted();
+    if (radiance.length_squared() <= 0) {
+      return;
+    }
+    for (const auto &tri : triangles) {
+      lights.add_triangle(point3(tri.v0[0], tri.v0[1], tri.v0[2]),
+                          vec3(tri.edge1[0], tri.edge1[1], tri.edge1[2]),
+                          vec3(tri.edge2[0], tri.edge2[1], tri.edge2[2]),
+                          radiance);
+    }
+  }
+
+  const bvh_build_stats &build_stats() const { return stats; }
+
+  const mesh_buffers &mesh() const { return *buffers; }
+  const shared_ptr<const mesh_buffers> &shared_mesh() const { return buffers; }
+
+  // Index of the triangle in the source index buffer for a leaf slot
+  uint32_t triangle_id(uint32_t slot) const { return triangle_ids[slot]; }
+
+  // Writes the mesh with its packed triangles and BVH
+  void save(cache_writer &out) const {
+    out.write_array(buffers->positions);
+    out.write_array(buffers->indices);
+    out.write(out.material_id(mat.get()));
+    out.write_array(triangles);
+    out.write_array(triangle_ids);
+    // Only the tree the mesh traverses is kept, the others are stored empty
+    const decltype(nodes) no_nodes;
+    const decltype(wide4) no_wide4;
+    const decltype(wide8) no_wide8;
+    out.write_array(width == 4 || width == 8 ? no_nodes : nodes);
+    out.write_array(width == 4 ? wide4 : no_wide4);
+    out.write_array(width == 8 ? wide8 : no_wide8);
+    out.write(int32_t(width));
+    out.write(bbox);
+    write_bvh_stats(out, stats);
+  }
+
+  // Replaces this mesh with one written by save, ready to render without a
+  // build
+  bool load(cache_reader &in) {
+    auto loaded = make_shared<mesh_buffers>();
+    in.read_array(loaded->positions);
+    in.read_array(loaded->indices);
+    buffers = loaded;
+
+    uint32_t material_id = 0;
+    int32_t saved_width = 2;
+    in.read(material_id);
+    mat = in.material_at(material_id);
+    in.read_array(triangles);
+    in.read_array(triangle_ids);
+    in.read_array(nodes);
+    in.read_array(wide4);
+    in.read_array(wide8);
+    in.read(saved_width);
+    in.read(bbox);
+    read_bvh_stats(in, stats);
+    width = saved_width;
+    options.width = width;
+
+    // Nothing checks indices or the tree during traversal, so everything
+    // they point at must be inside the arrays
+    size_t count = triangles.size();
+    bool consistent = in.good() && triangle_ids.size() == count &&
+                      loaded->positions.size() % 3 == 0 &&
+                      loaded->indices.size() % 3 == 0 &&
+                      count == loaded->triangle_count();
+    for (uint32_t id : triangle_ids) {
+      consistent = consistent && id < count;
+    }
+    for (uint32_t index : loaded->indices) {
+      consistent = consistent && index < loaded->vertex_count();
+    }
+    auto check = [&](bool kept, const auto &tree) {
+      return kept ? bvh_valid(tree, count) : tree.empty();
+    };
+    consistent = consistent && check(width == 2, nodes) &&
+                 check(width == 4, wide4) && check(width == 8, wide8);
+    if (!consistent) {
+      return false;
+    }
+    built_cost = bvh_sah_cost(nodes, options);
+    return true;
+  }
+
+private:
+  struct packed_triangle {
+    float v0[3];
+    float edge1[3];
+    float edge2[3];
+  };
+
+  shared_ptr<const mesh_buffers> buffers;
+  shared_ptr<material> mat;
+  std::vector<packed_triangle> triangles;
+  std::vector<uint32_t> triangle_ids;
+
+  std::vector<bvh_linear_node> nodes;
+  std::vector<bvh_wide_node<4>> wide4;
+  std::vector<bvh_wide_node<8>> wide8;
+  int width = 2;
+  aabb bbox;
+  bvh_build_stats stats;
+  bvh_build_options options;
+  double built_cost = 0;
+
+  aabb triangle_box(uint32_t tri) const {
+    point3 v0 = buffers->vertex(buffers->indices[3 * tri]);
+    point3 v1 = buffers->vertex(buffers->indices[3 * tri + 1]);
+    point3 v2 = buffers->vertex(buffers->indices[3 * tri + 2]);
+    return aabb(aabb(v0, v1), aabb(v2, v2));
+  }
+
+  void pack_triangle(size_t slot) {
+    uint32_t tri = triangle_ids[slot];
+    point3 v0 = buffers->vertex(buffers->indices[3 * tri]);
+    point3 v1 = buffers->vertex(buffers->indices[3 * tri + 1]);
+    point3 v2 = buffers->vertex(buffers->indices[3 * tri + 2]);
+    vec3 edge1 = v1 - v0;
+    vec3 edge2 = v2 - v0;
+    for (int axis = 0; axis < 3; axis++) {
+      triangles[slot].v0[axis] = float(v0[axis]);
+      triangles[slot].edge1[axis] = float(edge1[axis]);
+      triangles[slot].edge2[axis] = float(edge2[axis]);
+    }
+  }
+
+  void collapse() {
+    if (width == 4) {
+      wide4 = collapse_bvh<4>(nodes);
+    } else if (width == 8) {
+      wide8 = collapse_bvh<8>(nodes);
+    }
+  }
+
+  // Whichever tree the build kept. With any_hit the walk stops at the first
+  // hit, see bvh_traverse
+  template <bool any_hit, typename LeafFn>
+  bool traverse(const ray &r, interval ray_t, LeafFn &&leaf) const {
+    switch (width) {
+    case 4:
+      return bvh_traverse_wide<4, any_hit>(wide4, r, ray_t, leaf);
+    case 8:
+      return bvh_traverse_wide<8, any_hit>(wide8, r, ray_t, leaf);
+    default:
+      return bvh_traverse<any_hit>(nodes, r, ray_t, leaf);
+    }
+  }
+
+  // The record for a hit on triangles[slot] found by intersect
+  void fill_record(const ray &r, uint32_t slot, real t, real u, real v,
+                   hit_record &rec) const {
+    const auto &tri = triangles[slot];
+    rec.t = t;
+    vec3 edge1(tri.edge1[0], tri.edge1[1], tri.edge1[2]);
+    vec3 edge2(tri.edge2[0], tri.edge2[1], tri.edge2[2]);
+    set_triangle_point(rec, point3(tri.v0[0], tri.v0[1], tri.v0[2]), edge1,
+                       edge2, u, v);
+    rec.set_face_normal(r, unit_vector(cross(edge1, edge2)));
+    rec.mat = mat.get();
+  }
+
+  // Moller-Trumbore, the same test as triangle::hit. u and v are the
+  // barycentric coordinates of the hit along edge1 and edge2
+  static bool intersect(const packed_triangle &tri, const ray &r,
+                        const interval &ray_t, real &t, real &u, real &v) {
+    const vec3 edge1(tri.edge1[0], tri.edge1[1], tri.edge1[2]);
+    const vec3 edge2(tri.edge2[0], tri.edge2[1], tri.edge2[2]);
+    const vec3 pvec = cross(r.direction(), edge2);
+    const real det = dot(edge1, pvec);
+
+    // Only exactly parallel rays are rejected, a fixed epsilon would throw
+    // away legitimately tiny triangles in dense meshes
+    if (det == 0.0) {
+      return false;
+    }
+
+    const real inv_det = 1.0 / det;
+    const vec3 tvec = r.origin() - point3(tri.v0[0], tri.v0[1], tri.v0[2]);
+    u = dot(tvec, pvec) * inv_det;
+    if (u < 0.0 || u > 1.0) {
+      return false;
+    }
+
+    const vec3 qvec = cross(tvec, edge1);
+    v = dot(r.direction(), qvec) * inv_det;
+    if (v < 0.0 || u + v > 1.0) {
+      return false;
+    }
+
+    t = dot(edge2, qvec) * inv_det;
+    return ray_t.surrounds(t);
+  }
+};
+
+#endif
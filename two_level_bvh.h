@@ -0,0 +1,98 @@
+#ifndef TWO_LEVEL_BVH_H
+#define TWO_LEVEL_BVH_H
+
+#include "bvh.h"
+#include "hittable.h"
+#include "rtweekend.h"
+
+#include <memory>
+#include <vector>
+
+// Scene BVH split by how objects change between frames. Static objects get
+// a top level tree built once. Dynamic objects, such as instances that are
+// moved with set_transform or meshes refit to new vertices, get their own
+// top level tree that update() refits each frame, falling back to a rebuild
+// when the refit tree has lost too much quality. Each object keeps its own
+// bottom level BVH
+class two_level_bvh : public hittable {
+public:
+  void add_static(shared_ptr<hittable> object) {
+    static_objects.push_back(object);
+  }
+
+  void add_dynamic(shared_ptr<hittable> object) {
+    dynamic_objects.push_back(object);
+  }
+
+  // Builds both top level trees. Must be called after the last add and
+  // before rendering
+  void build(const bvh_build_options &options = {}) {
+    static_tree.reset();
+    dynamic_tree.reset();
+    if (!static_objects.empty()) {
+      static_tree = std::make_unique<bvh_node>(static_objects, options);
+    }
+    if (!dynamic_objects.empty()) {
+      dynamic_tree = std::make_unique<bvh_node>(dynamic_objects, options);
+    }
+    update_bounds();
+  }
+
+  // Call once dynamic objects have moved, before the next frame renders.
+  // The static tree is left alone
+  bvh_refit_result update() {
+    bvh_refit_result result;
+    if (dynamic_tree) {
+      result = dynamic_tree->refit();
+    }
+    update_bounds();
+    return result;
+  }
+
+  bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+    bool hit_anything = false;
+    if (static_tree && static_tree->hit(r, ray_t, rec)) {
+      hit_anything = true;
+      ray_t.max = rec.t;
+    }
+    if (dynamic_tree && dynamic_tree->hit(r, ray_t, rec)) {
+      hit_anything = true;
+    }
+    return hit_anything;
+  }
+
+  bool occluded(const ray &r, interval ray_t) const override {
+    return (static_tree && static_tree->occluded(r, ray_t)) ||
+           (dynamic_tree && dynamic_tree->occluded(r, ray_t));
+  }
+
+  void add_lights(light_list &lights) const override {
+    if (static_tree) {
+      static_tree->add_lights(lights);
+    }
+    if (dynamic_tree) {
+      dynamic_tree->add_lights(lights);
+    }
+  }
+
+  aabb bounding_box() const override { return bbox; }
+
+private:
+  std::vector<shared_ptr<hittable>> static_objects;
+  std::vector<shared_ptr<hittable>> dynamic_objects;
+  std::unique_ptr<bvh_node> static_tree;
+  std::unique_ptr<bvh_node> dynamic_tree;
+  aabb bbox;
+
+  void update_bounds() {
+    bbox = aabb::empty;
+    if (static_tree) {
+      bbox = aabb(bbox, static_tree->bounding_box());
+    }
+    if (dynamic_tree) {
+      bbox = aabb(bbox, dynamic_tree->bounding_box());
+    }
+  }
+};
+
+#endif
@@ -7,18 +7,18 @@
 
 class vec3 {
 public:
-  double e[3];
+  real e[3];
 
   vec3() : e{0, 0, 0} {}
-  vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+  vec3(real e0, real e1, real e2) : e{e0, e1, e2} {}
 
-  double x() const { return e[0]; }
-  double y() const { return e[1]; }
-  double z() const { return e[2]; }
+  real x() const { return e[0]; }
+  real y() const { return e[1]; }
+  real z() const { return e[2]; }
 
   vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-  double operator[](int i) const { return e[i]; }
-  double &operator[](int i) { return e[i]; }
+  real operator[](int i) const { return e[i]; }
+  real &operator[](int i) { return e[i]; }
 
   vec3 &operator+=(const vec3 &v) {
     e[0] += v.e[0];
@@ -27,29 +27,33 @@ public:
     return *this;
   }
 
-  vec3 &operator*=(double t) {
+  vec3 &operator*=(real t) {
     e[0] *= t;
     e[1] *= t;
     e[2] *= t;
     return *this;
   }
 
-  vec3 &operator/=(double t) { return *this *= 1 / t; }
+  vec3 &operator/=(real t) { return *this *= 1 / t; }
 
-  double length() const { return std::sqrt(length_squared()); }
+  real length() const { return std::sqrt(length_squared()); }
 
-  double length_squared() const {
+  real length_squared() const {
     return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
   }
 
-  static vec3 random() {
-    return vec3(random_double(), random_double(), random_double());
+  static vec3 random(rng& gen) {
+    return vec3(random_double(gen), random_double(gen), random_double(gen));
   }
 
-  static vec3 random(double min, double max){
-    return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+  static vec3 random(rng& gen, real min, real max){
+    return vec3(random_double(gen, min, max), random_double(gen, min, max), random_double(gen, min, max));
   }
 
+  static vec3 random() { return random(default_rng()); }
+
+  static vec3 random(real min, real max){ return random(default_rng(), min, max); }
+
   bool near_zero() const {
     //r return true if the vec is close to zero in all dir
     auto s = 1e-8;
@@ -80,19 +84,19 @@ inline vec3 operator*(const vec3& u, const vec3& v) {
     return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3& v){
+inline vec3 operator*(real t, const vec3& v){
     return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline vec3 operator*(const vec3& v, double t){
+inline vec3 operator*(const vec3& v, real t){
     return t * v;
 }
 
-inline vec3 operator/(const vec3& v, double t){
+inline vec3 operator/(const vec3& v, real t){
     return (1/t) * v;
 }
 
-inline double dot(const vec3& u, const vec3& v){
+inline real dot(const vec3& u, const vec3& v){
     return u.e[0] * v.e[0]
         + u.e[1] * v.e[1]
         + u.e[2] * v.e[2];
@@ -108,18 +112,45 @@ inline vec3 unit_vector(const vec3& v){
     return v / v.length();
 }
 
-inline vec3 random_unit_vector(){
-    while (true) {
-        auto p = vec3::random(-1, 1);
-        auto lensq = p.length_squared();
-        if (lensq <= 1 && 1e-160 < lensq) {
-            return p / sqrt(lensq);
-        }
+// Maps a point of the unit square onto the unit sphere, uniform by area:
+// z is uniform in [-1, 1] (Archimedes' hat box theorem) and the angle
+// around z uniform in [0, 2 pi). Strata of the square stay compact on the
+// sphere, so stratified and low discrepancy samples keep their advantage
+inline vec3 unit_sphere_point(double u1, double u2) {
+    real z = 1 - 2 * u1;
+    real r = std::sqrt(std::fmax(real(0), 1 - z * z));
+    real phi = 2 * pi * u2;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// Maps a point of the unit square onto the unit disk in the z = 0 plane,
+// uniform by area, with Shirley and Chiu's concentric map ("A low
+// distortion map between disk and square", 1997)
+inline vec3 unit_disk_point(double u1, double u2) {
+    real a = 2 * u1 - 1;
+    real b = 2 * u2 - 1;
+    if (a == 0 && b == 0) {
+        return vec3(0, 0, 0);
     }
+    real r, theta;
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        theta = (pi / 4) * (b / a);
+    } else {
+        r = b;
+        theta = pi / 2 - (pi / 4) * (a / b);
+    }
+    return vec3(r * std::cos(theta), r * std::sin(theta), 0);
+}
+
+// Two draws each, no rejection loop
+inline vec3 random_unit_vector(rng& gen){
+    auto u1 = random_double(gen);
+    return unit_sphere_point(u1, random_double(gen));
 }
 
-inline vec3 random_on_hemisphere(const vec3& normal) {
-    vec3 on_unit_sphere = random_unit_vector();
+inline vec3 random_on_hemisphere(rng& gen, const vec3& normal) {
+    vec3 on_unit_sphere = random_unit_vector(gen);
     if(dot(on_unit_sphere, normal) > 0.0) {
         // In the same hemisphere as normal 
         return on_unit_sphere;
@@ -132,20 +163,16 @@ inline vec3 reflect(const vec3& v, const vec3& n){
     return v - 2*dot(v, n)*n;
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
+inline vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat) {
     auto cos_theta = std::fmin(dot(-uv, n), 1.0);
     vec3 r_out_perp = etai_over_etat * (uv + cos_theta*n);
     vec3 r_out_parallel = -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
 
-inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() < 1) {
-            return p;
-        }
-    }
+inline vec3 random_in_unit_disk(rng& gen) {
+    auto u1 = random_double(gen);
+    return unit_disk_point(u1, random_double(gen));
 }
 
 #endif
\ No newline at end of file